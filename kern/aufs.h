@@ -2,18 +2,60 @@
 #define __AUFS_H__
 
 #include <linux/types.h>
+#include <linux/completion.h>
 #include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/shrinker.h>
+#include <linux/spinlock.h>
 
 #define AUFS_DDE_SIZE         32
 #define AUFS_DDE_MAX_NAME_LEN (AUFS_DDE_SIZE - sizeof(__be32))
 
 static const unsigned long AUFS_MAGIC = 0x13131313;
 
+/* dsb_features bits */
+#define AUFS_FEATURE_CSUM	0x00000001UL
+#define AUFS_FEATURE_SORTED_DIRS	0x00000002UL
+#define AUFS_FEATURE_DIR_INDEX	0x00000004UL
+#define AUFS_FEATURE_DIR_BLOOM	0x00000008UL
+#define AUFS_FEATURE_DIR_RECORDS	0x00000010UL
+#define AUFS_FEATURE_COMPACT_INODES	0x00000020UL
+#define AUFS_FEATURE_EXTENTS	0x00000040UL
+#define AUFS_FEATURES_SUPPORTED	(AUFS_FEATURE_CSUM | \
+				 AUFS_FEATURE_SORTED_DIRS | \
+				 AUFS_FEATURE_DIR_INDEX | \
+				 AUFS_FEATURE_DIR_BLOOM | \
+				 AUFS_FEATURE_DIR_RECORDS | \
+				 AUFS_FEATURE_COMPACT_INODES | \
+				 AUFS_FEATURE_EXTENTS)
+
+/* bits set per name in a directory Bloom filter */
+#define AUFS_BLOOM_HASHES	8
+
+/* dsb_compat_features bits, safe to ignore for older drivers */
+#define AUFS_COMPAT_DIR_TYPES	0x00000001UL
+
+/* mount options in asb_opts */
+#define AUFS_OPT_VERIFY		0x00000001UL
+#define AUFS_OPT_PRELOAD_INODES	0x00000002UL
+
 struct aufs_disk_super_block {
 	__be32	dsb_magic;
 	__be32	dsb_block_size;
 	__be32	dsb_root_inode;
 	__be32	dsb_inode_blocks;
+	__be32	dsb_features;
+	__be32	dsb_csum_first;
+	__be32	dsb_csum_blocks;
+	__be32	dsb_compat_features;
+	__be32	dsb_attrs_first;
+	__be32	dsb_attrs_count;
+	__be32	dsb_times_first;
+	__be32	dsb_times_count;
 };
 
 struct aufs_disk_inode {
@@ -26,17 +68,166 @@ struct aufs_disk_inode {
 	__be64	di_ctime;
 };
 
+/*
+ * With AUFS_FEATURE_COMPACT_INODES the inode table holds these instead.
+ * Owner and mode are an index into the attribute table and the creation
+ * time one into the table of __be64 times, the super block locates both.
+ */
+#define AUFS_COMPACT_TABLE_MAX	65536
+
+struct aufs_disk_compact_inode {
+	__be32	dci_first;
+	__be32	dci_blocks;
+	__be32	dci_size;
+	__be16	dci_attr;
+	__be16	dci_time;
+};
+
+struct aufs_disk_inode_attr {
+	__be32	dia_uid;
+	__be32	dia_gid;
+	__be32	dia_mode;
+	__be32	dia_reserved;
+};
+
+/*
+ * With AUFS_FEATURE_EXTENTS a regular file may keep its blocks in several
+ * runs: its first block has AUFS_EXTENT_LIST set and the rest of it is
+ * the block of the extent list, a header and then the runs in file order.
+ * The inode blocks count only the data blocks. There are no inline
+ * extents: even a file of two runs takes a list block, and loading the
+ * inode reads that block too.
+ */
+#define AUFS_EXTENT_LIST	0x80000000U
+
+struct aufs_disk_extent_header {
+	__be32	deh_count;
+	__be32	deh_reserved;
+};
+
+struct aufs_disk_extent {
+	__be32	de_first;
+	__be32	de_blocks;
+};
+
+/* a file run in memory, ei_logical is the first file block it holds */
+struct aufs_extent_info {
+	u32 ei_logical;
+	u32 ei_first;
+	u32 ei_blocks;
+};
+
+/* a decoded disk inode, filled in only while its inode is loaded */
+struct aufs_inode_info {
+	u32 ii_first;
+	u32 ii_blocks;
+	u32 ii_size;
+	u32 ii_gid;
+	u32 ii_uid;
+	u32 ii_mode;
+	s64 ii_ctime;
+};
+
 struct aufs_disk_dir_entry {
 	char dde_name[AUFS_DDE_MAX_NAME_LEN];
 	__be32 dde_inode;
 };
 
+/* with AUFS_COMPAT_DIR_TYPES names are at most AUFS_DDE_MAX_NAME_LEN - 2
+ * bytes and the last name byte holds the DT_* type of the child */
+#define AUFS_DDE_TYPE(de)	((de)->dde_name[AUFS_DDE_MAX_NAME_LEN - 1])
+
+/*
+ * With AUFS_FEATURE_DIR_RECORDS directories hold these variable length
+ * records instead: the name is not null terminated and the record is
+ * padded to AUFS_DDR_ALIGN bytes. Records never cross a block, a zero
+ * ddr_rec_len ends the records of a block. The directory size is the
+ * offset past the last record, record offsets are readdir positions.
+ */
+#define AUFS_DDR_ALIGN		8
+#define AUFS_DDR_MAX_NAME_LEN	255
+#define AUFS_DDR_REC_LEN(len)	ALIGN(sizeof(struct aufs_disk_dir_rec) + \
+					(len), AUFS_DDR_ALIGN)
+
+struct aufs_disk_dir_rec {
+	__be32 ddr_inode;
+	__be16 ddr_rec_len;
+	__u8 ddr_name_len;
+	__u8 ddr_type;
+	char ddr_name[];
+};
+
+/* hash index slot, stored in the directory blocks after the entries */
+struct aufs_disk_dir_slot {
+	__be32 dds_hash;
+	__be32 dds_pos;
+};
+
+/* per mount counters, see stats.c */
+enum aufs_stat {
+	AUFS_STAT_LOOKUP_HITS,
+	AUFS_STAT_LOOKUP_MISSES,
+	AUFS_STAT_LOOKUP_SCANNED,
+	AUFS_STAT_READDIR_PAGES,
+	AUFS_STAT_INODE_READS,
+	AUFS_STAT_IOMAP_BEGIN,
+	AUFS_STAT_READAHEAD_PAGES,
+	AUFS_STAT_BUFFERED_BYTES,
+	AUFS_STAT_DIRECT_BYTES,
+	AUFS_STAT_COUNT
+};
+
+/* latency histograms, log2 microsecond buckets */
+enum aufs_hist {
+	AUFS_HIST_INODE_GET,
+	AUFS_HIST_LOOKUP,
+	AUFS_HIST_COUNT
+};
+
+#define AUFS_HIST_BUCKETS	16
+
+struct aufs_stats {
+	u64 as_counters[AUFS_STAT_COUNT];
+	u64 as_hist[AUFS_HIST_COUNT][AUFS_HIST_BUCKETS];
+};
+
 struct aufs_super_block {
 	unsigned long asb_magic;
 	unsigned long asb_inode_blocks;
 	unsigned long asb_block_size;
 	unsigned long asb_root_inode;
 	unsigned long asb_inodes_in_block;
+	unsigned long asb_features;
+	unsigned long asb_csum_first;
+	unsigned long asb_csum_blocks;
+	unsigned long asb_compat_features;
+	unsigned long asb_attrs_first;
+	unsigned long asb_attrs_count;
+	unsigned long asb_times_first;
+	unsigned long asb_times_count;
+	unsigned long asb_opts;
+	/* CRC32C of every block, loaded at mount time with "verify" */
+	__be32 *asb_csums;
+	unsigned long asb_csums_count;
+	/* shared tables of compact inodes, loaded at mount time */
+	struct aufs_disk_inode_attr *asb_attrs;
+	__be64 *asb_times;
+	/* the whole inode table as it is on disk, so compact inodes keep
+	 * their table indexes, loaded at mount time with "preload_inodes" */
+	void *asb_inodes;
+	unsigned long asb_inodes_count;
+	/* in-memory lookup hashes of large directories, see dirhash.c */
+	unsigned long asb_dirhash_min;
+	unsigned long asb_dirhash_maxmem;
+	unsigned long asb_dirhash_bytes;
+	unsigned long asb_dirhash_count;
+	spinlock_t asb_dirhash_lock;
+	struct list_head asb_dirhash_lru;
+	struct shrinker *asb_dirhash_shrinker;
+	/* per-CPU counters and their /sys/fs/aufs/<device> directory */
+	struct aufs_stats __percpu *asb_stats;
+	struct kobject asb_kobj;
+	struct completion asb_kobj_released;
 };
 
 static inline struct aufs_super_block *AUFS_SB(struct super_block *sb)
@@ -44,9 +235,44 @@ static inline struct aufs_super_block *AUFS_SB(struct super_block *sb)
 	return (struct aufs_super_block *)sb->s_fs_info;
 }
 
+static inline void aufs_stat_add(struct super_block *sb,
+			enum aufs_stat stat, u64 value)
+{
+	this_cpu_add(AUFS_SB(sb)->asb_stats->as_counters[stat], value);
+}
+
+/* start is the ktime_get_ns() taken when the timed call began */
+static inline void aufs_hist_add(struct super_block *sb,
+			enum aufs_hist hist, u64 start)
+{
+	u64 us = div_u64(ktime_get_ns() - start, NSEC_PER_USEC);
+	unsigned bucket = us ? min_t(unsigned, ilog2(us) + 1,
+				AUFS_HIST_BUCKETS - 1) : 0;
+
+	this_cpu_inc(AUFS_SB(sb)->asb_stats->as_hist[hist][bucket]);
+}
+
+static inline size_t aufs_inode_size(struct aufs_super_block const *asb)
+{
+	if (asb->asb_features & AUFS_FEATURE_COMPACT_INODES)
+		return sizeof(struct aufs_disk_compact_inode);
+	return sizeof(struct aufs_disk_inode);
+}
+
+struct aufs_dirhash;
+
 struct aufs_inode {
 	struct inode ai_inode;
+	/* the first data block, of the first run for an extent list */
 	unsigned long ai_block;
+	/* the runs of a file with an extent list, NULL for a single run */
+	struct aufs_extent_info *ai_extents;
+	unsigned ai_extents_count;
+	/* di_size of a directory, i_size covers all its blocks instead */
+	unsigned long ai_dir_size;
+	struct aufs_dirhash __rcu *ai_dirhash;
+	/* Bloom filter of a directory, copied in on the first lookup */
+	u8 *ai_bloom;
 };
 
 static inline struct aufs_inode *AUFS_INODE(struct inode *inode)
@@ -54,13 +280,85 @@ static inline struct aufs_inode *AUFS_INODE(struct inode *inode)
 	return (struct aufs_inode *)inode;
 }
 
+static inline bool aufs_dir_records(struct inode *dir)
+{
+	return AUFS_SB(dir->i_sb)->asb_features & AUFS_FEATURE_DIR_RECORDS;
+}
+
+/* the most names the directory can hold, what in-memory tables and the
+ * Bloom filter are sized for */
+static inline size_t aufs_dir_names_max(struct inode *dir)
+{
+	size_t size = AUFS_INODE(dir)->ai_dir_size;
+
+	if (aufs_dir_records(dir))
+		return size / AUFS_DDR_REC_LEN(1);
+	return size;
+}
+
+struct iomap_ops;
+
+extern const struct iomap_ops aufs_iomap_ops;
 extern const struct address_space_operations aufs_aops;
+extern const struct address_space_operations aufs_verify_aops;
 extern const struct inode_operations aufs_dir_inode_ops;
+extern const struct inode_operations aufs_file_inode_ops;
 extern const struct file_operations aufs_file_ops;
 extern const struct file_operations aufs_dir_ops;
 
+/* inode table blocks of the children one readdir call emits, read
+ * ahead for the stat calls that usually follow */
+#define AUFS_INODE_RA_MAX	32
+
+struct aufs_inode_ra {
+	sector_t air_blocks[AUFS_INODE_RA_MAX];
+	unsigned air_count;
+	unsigned air_issued;
+};
+
 struct inode *aufs_inode_get(struct super_block *sb, unsigned long no);
+bool aufs_extent_find(struct inode *inode, sector_t block,
+			struct aufs_extent_info *ei);
+sector_t aufs_bmap(struct address_space *mapping, sector_t block);
+int aufs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+			u64 start, u64 len);
+void aufs_inode_ra_add(struct super_block *sb, struct aufs_inode_ra *ra,
+			unsigned long no);
+void aufs_inode_ra_issue(struct super_block *sb, struct aufs_inode_ra *ra);
+int aufs_inodes_load(struct super_block *sb);
+void aufs_inodes_free(struct aufs_super_block *asb);
+int aufs_inode_tables_load(struct super_block *sb);
+void aufs_inode_tables_free(struct aufs_super_block *asb);
 struct inode *aufs_inode_alloc(struct super_block *sb);
 void aufs_inode_free(struct inode *inode);
 
+static inline bool aufs_verify_enabled(struct super_block *sb)
+{
+	return AUFS_SB(sb)->asb_opts & AUFS_OPT_VERIFY;
+}
+
+int aufs_csum_load(struct super_block *sb);
+void aufs_csum_free(struct aufs_super_block *asb);
+int aufs_verify_bh(struct super_block *sb, struct buffer_head *bh);
+int aufs_verify_folio(struct inode *inode, struct folio *folio,
+			unsigned blocks);
+int aufs_verify_init(void);
+void aufs_verify_fini(void);
+
+bool aufs_dirhash_wanted(struct inode *dir);
+struct aufs_dirhash *aufs_dirhash_new(struct inode *dir);
+void aufs_dirhash_add(struct aufs_dirhash *dh, u32 hash, size_t pos);
+void aufs_dirhash_discard(struct inode *dir, struct aufs_dirhash *dh);
+void aufs_dirhash_attach(struct inode *dir, struct aufs_dirhash *dh);
+int aufs_dirhash_find(struct inode *dir, u32 hash, size_t *probe,
+			size_t *pos);
+void aufs_dirhash_drop(struct inode *inode);
+int aufs_dirhash_setup(struct super_block *sb);
+void aufs_dirhash_cleanup(struct aufs_super_block *asb);
+
+int aufs_stats_setup(struct super_block *sb);
+void aufs_stats_cleanup(struct aufs_super_block *asb);
+int aufs_stats_init(void);
+void aufs_stats_fini(void);
+
 #endif /*__AUFS_H__*/
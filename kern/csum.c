@@ -0,0 +1,333 @@
+#include <linux/bio.h>
+#include <linux/buffer_head.h>
+#include <linux/crc32c.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "aufs.h"
+
+/* set on buffer heads whose checksum has already been checked */
+enum { BH_AufsVerified = BH_PrivateStart };
+BUFFER_FNS(AufsVerified, aufs_verified);
+
+static struct workqueue_struct *aufs_verify_wq;
+
+int aufs_csum_load(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	unsigned long per_block = asb->asb_block_size / sizeof(__be32);
+	unsigned long i;
+
+	asb->asb_csums = vmalloc(asb->asb_csum_blocks * asb->asb_block_size);
+	if (!asb->asb_csums) {
+		pr_err("aufs cannot allocate checksum table\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i != asb->asb_csum_blocks; ++i)
+		sb_breadahead(sb, asb->asb_csum_first + i);
+
+	for (i = 0; i != asb->asb_csum_blocks; ++i) {
+		struct buffer_head *bh = sb_bread(sb, asb->asb_csum_first + i);
+
+		if (!bh) {
+			pr_err("cannot read checksum block %lu\n",
+				asb->asb_csum_first + i);
+			aufs_csum_free(asb);
+			return -EIO;
+		}
+		memcpy(asb->asb_csums + i * per_block, bh->b_data,
+			asb->asb_block_size);
+		brelse(bh);
+	}
+	asb->asb_csums_count = asb->asb_csum_blocks * per_block;
+
+	pr_debug("aufs loaded %lu checksums\n", asb->asb_csums_count);
+
+	return 0;
+}
+
+void aufs_csum_free(struct aufs_super_block *asb)
+{
+	vfree(asb->asb_csums);
+	asb->asb_csums = NULL;
+	asb->asb_csums_count = 0;
+}
+
+static int aufs_verify_block(struct super_block *sb, sector_t block,
+			const void *data)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	u32 expected, actual;
+
+	if (block >= asb->asb_csums_count) {
+		pr_err("aufs block %lu has no checksum\n",
+			(unsigned long)block);
+		return -EIO;
+	}
+
+	expected = be32_to_cpu(asb->asb_csums[block]);
+	actual = ~crc32c(~0, data, asb->asb_block_size);
+	if (expected != actual) {
+		pr_err("aufs checksum mismatch in block %lu: %08x != %08x\n",
+			(unsigned long)block, actual, expected);
+		return -EIO;
+	}
+	return 0;
+}
+
+int aufs_verify_bh(struct super_block *sb, struct buffer_head *bh)
+{
+	int err;
+
+	if (!aufs_verify_enabled(sb) || buffer_aufs_verified(bh))
+		return 0;
+
+	err = aufs_verify_block(sb, bh->b_blocknr, bh->b_data);
+	if (!err)
+		set_buffer_aufs_verified(bh);
+	return err;
+}
+
+/* checks the first blocks blocks of the folio against the blocks of the
+ * inode runs they were read from */
+int aufs_verify_folio(struct inode *inode, struct folio *folio,
+			unsigned blocks)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned bits = inode->i_blkbits;
+	sector_t first = folio_pos(folio) >> bits;
+	struct aufs_extent_info ei;
+	unsigned i;
+	int err = 0;
+
+	for (i = 0; i != blocks && !err; ++i) {
+		char *kaddr;
+
+		if (!aufs_extent_find(inode, first + i, &ei))
+			return -EIO;
+
+		kaddr = kmap_local_folio(folio, (size_t)i << bits);
+		err = aufs_verify_block(sb, ei.ei_first + first + i -
+					ei.ei_logical, kaddr);
+		kunmap_local(kaddr);
+	}
+	return err;
+}
+
+/* the blocks of the folio that hold file data, the rest reads as zeros */
+static unsigned aufs_folio_blocks(struct inode *inode, struct folio *folio)
+{
+	unsigned bits = inode->i_blkbits;
+	sector_t first = folio_pos(folio) >> bits;
+	sector_t last = (i_size_read(inode) + (1 << bits) - 1) >> bits;
+
+	last = min_t(sector_t, last, inode->i_blocks);
+	if (first >= last)
+		return 0;
+	return min_t(sector_t, last - first, folio_size(folio) >> bits);
+}
+
+/* one read of a folio or of a readahead batch, checked by one work item
+ * once the last bio of its chain completes */
+struct aufs_read_ctx {
+	struct work_struct	work;
+	struct bio		*bio;
+	unsigned		count;
+	struct folio		*folios[];
+};
+
+static void aufs_read_done(struct aufs_read_ctx *ctx, bool uptodate)
+{
+	struct inode *inode = ctx->folios[0]->mapping->host;
+	unsigned i;
+
+	for (i = 0; i != ctx->count; ++i) {
+		struct folio *folio = ctx->folios[i];
+
+		if (uptodate && !aufs_verify_folio(inode, folio,
+					aufs_folio_blocks(inode, folio)))
+			folio_mark_uptodate(folio);
+		folio_unlock(folio);
+	}
+	bio_put(ctx->bio);
+	kfree(ctx);
+}
+
+static void aufs_verify_work(struct work_struct *work)
+{
+	aufs_read_done(container_of(work, struct aufs_read_ctx, work), true);
+}
+
+/* may run in interrupt context, so the checksums are left to a worker */
+static void aufs_verify_end_io(struct bio *bio)
+{
+	struct aufs_read_ctx *ctx = bio->bi_private;
+
+	if (bio->bi_status) {
+		aufs_read_done(ctx, false);
+		return;
+	}
+	queue_work(aufs_verify_wq, &ctx->work);
+}
+
+/* Zeroes what the folio has past the data and returns the blocks to
+ * read, a folio with none is done with right away. */
+static unsigned aufs_folio_prepare(struct inode *inode, struct folio *folio)
+{
+	unsigned blocks = aufs_folio_blocks(inode, folio);
+	size_t bytes = (size_t)blocks << inode->i_blkbits;
+
+	if (bytes != folio_size(folio))
+		folio_zero_segment(folio, bytes, folio_size(folio));
+	if (!blocks) {
+		folio_mark_uptodate(folio);
+		folio_unlock(folio);
+	}
+	return blocks;
+}
+
+/*
+ * Adds the blocks of the folio to the chain that ends with bio and returns
+ * the new end of it. Blocks that follow the end of the last bio on the
+ * device go into it, so a readahead batch over one run is a single bio. A
+ * new bio is chained to the previous one, which is submitted then: the
+ * last bio completes once all of them have.
+ */
+static struct bio *aufs_read_add(struct inode *inode, struct bio *bio,
+			struct folio *folio, unsigned blocks, unsigned vecs)
+{
+	unsigned bits = inode->i_blkbits;
+	sector_t first = folio_pos(folio) >> bits;
+	struct aufs_extent_info ei;
+	unsigned done;
+
+	for (done = 0; done != blocks; ) {
+		sector_t block = first + done;
+		sector_t sector;
+		size_t len;
+		unsigned run;
+
+		/* blocks is within i_blocks, so there is always a run */
+		aufs_extent_find(inode, block, &ei);
+		run = min_t(sector_t, blocks - done,
+				ei.ei_logical + ei.ei_blocks - block);
+		sector = (sector_t)(ei.ei_first + block - ei.ei_logical) <<
+				(bits - SECTOR_SHIFT);
+		len = (size_t)run << bits;
+
+		if (!bio || bio_end_sector(bio) != sector ||
+				!bio_add_folio(bio, folio, len,
+					(size_t)done << bits)) {
+			/* backed by a mempool, does not fail with GFP_NOFS */
+			struct bio *next = bio_alloc(inode->i_sb->s_bdev, vecs,
+						REQ_OP_READ, GFP_NOFS);
+
+			if (bio) {
+				bio_chain(bio, next);
+				submit_bio(bio);
+			}
+			bio = next;
+			bio->bi_iter.bi_sector = sector;
+			bio_add_folio_nofail(bio, folio, len,
+					(size_t)done << bits);
+		}
+		done += run;
+	}
+	return bio;
+}
+
+static void aufs_read_submit(struct aufs_read_ctx *ctx, struct bio *bio)
+{
+	INIT_WORK(&ctx->work, aufs_verify_work);
+	ctx->bio = bio;
+	bio->bi_end_io = aufs_verify_end_io;
+	bio->bi_private = ctx;
+	submit_bio(bio);
+}
+
+/* The folio stays locked until its blocks are checked, so nobody can see
+ * the data before that. */
+static int aufs_verify_read_folio(struct file *file, struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+	struct aufs_read_ctx *ctx;
+	unsigned blocks;
+
+	ctx = kmalloc(struct_size(ctx, folios, 1), GFP_NOFS);
+	if (!ctx) {
+		folio_unlock(folio);
+		return -ENOMEM;
+	}
+
+	blocks = aufs_folio_prepare(inode, folio);
+	if (!blocks) {
+		kfree(ctx);
+		return 0;
+	}
+
+	ctx->count = 1;
+	ctx->folios[0] = folio;
+	aufs_read_submit(ctx, aufs_read_add(inode, NULL, folio, blocks, 1));
+	return 0;
+}
+
+/* The whole readahead batch is read with one bio chain and checked by one
+ * work item. Folios left in rac when the context cannot be allocated are
+ * unlocked by the caller and read one by one later. */
+static void aufs_verify_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	unsigned pages = readahead_count(rac);
+	unsigned vecs = bio_max_segs(pages);
+	struct aufs_read_ctx *ctx;
+	struct folio *folio;
+	struct bio *bio = NULL;
+
+	ctx = kmalloc(struct_size(ctx, folios, pages), GFP_NOFS);
+	if (!ctx)
+		return;
+
+	aufs_stat_add(inode->i_sb, AUFS_STAT_READAHEAD_PAGES, pages);
+	ctx->count = 0;
+	while ((folio = readahead_folio(rac))) {
+		unsigned blocks = aufs_folio_prepare(inode, folio);
+
+		if (!blocks)
+			continue;
+		bio = aufs_read_add(inode, bio, folio, blocks, vecs);
+		ctx->folios[ctx->count++] = folio;
+	}
+
+	if (!bio) {
+		kfree(ctx);
+		return;
+	}
+	aufs_read_submit(ctx, bio);
+}
+
+const struct address_space_operations aufs_verify_aops = {
+	.read_folio = aufs_verify_read_folio,
+	.readahead = aufs_verify_readahead,
+	.bmap = aufs_bmap,
+};
+
+/* the worker unlocks the folios of verified reads and reclaim may wait
+ * on them, so it needs a rescuer to make progress without memory */
+int aufs_verify_init(void)
+{
+	aufs_verify_wq = alloc_workqueue("aufs_verify",
+			WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if (!aufs_verify_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+void aufs_verify_fini(void)
+{
+	destroy_workqueue(aufs_verify_wq);
+	aufs_verify_wq = NULL;
+}
@@ -1,31 +1,71 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/pagemap.h>
+#include <linux/vmalloc.h>
 
 #include "aufs.h"
+#include "trace.h"
 
 static size_t aufs_dir_offset(size_t idx)
 {
 	return idx * sizeof(struct aufs_disk_dir_entry);
 }
 
+/* the bytes taken by the entries or records */
+static size_t aufs_dir_bytes(struct inode *dir)
+{
+	size_t size = AUFS_INODE(dir)->ai_dir_size;
+
+	return aufs_dir_records(dir) ? size : aufs_dir_offset(size);
+}
+
 static size_t aufs_dir_pages(struct inode *inode)
 {
-	size_t size = aufs_dir_offset(inode->i_size);
+	size_t size = aufs_dir_bytes(inode);
 
-	return (size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	return (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
 }
 
 static size_t aufs_dir_entry_page(size_t idx)
 {
-	return aufs_dir_offset(idx) >> PAGE_CACHE_SHIFT;
+	return aufs_dir_offset(idx) >> PAGE_SHIFT;
 }
 
 static inline size_t aufs_dir_entry_offset(size_t idx)
 {
 	return aufs_dir_offset(idx) -
-			(aufs_dir_entry_page(idx) << PAGE_CACHE_SHIFT);
+			(aufs_dir_entry_page(idx) << PAGE_SHIFT);
+}
+
+static void aufs_put_page(struct page *page)
+{
+	kunmap(page);
+	put_page(page);
+}
+
+/* with "verify" every page is checked once, PG_checked remembers that */
+static int aufs_check_page(struct inode *inode, struct page *page)
+{
+	unsigned shift = PAGE_SHIFT - inode->i_blkbits;
+	sector_t first = (sector_t)page->index << shift;
+	unsigned blocks;
+	int err;
+
+	if (!aufs_verify_enabled(inode->i_sb) || PageChecked(page))
+		return 0;
+
+	if (first >= inode->i_blocks)
+		return 0;
+
+	blocks = min_t(sector_t, inode->i_blocks - first, 1 << shift);
+	err = aufs_verify_folio(inode, page_folio(page), blocks);
+	if (!err)
+		SetPageChecked(page);
+	return err;
 }
 
 static struct page *aufs_get_page(struct inode *inode, size_t n)
@@ -33,54 +73,196 @@ static struct page *aufs_get_page(struct inode *inode, size_t n)
 	struct address_space *mapping = inode->i_mapping;
 	struct page *page = read_mapping_page(mapping, n, NULL);
 
-	if (!IS_ERR(page))
+	if (!IS_ERR(page)) {
 		kmap(page);
+		if (aufs_check_page(inode, page)) {
+			aufs_put_page(page);
+			return ERR_PTR(-EIO);
+		}
+	}
 	return page;
 }
 
-static void aufs_put_page(struct page *page)
+static bool aufs_dir_emit(struct inode *dir, struct dir_context *ctx,
+			struct aufs_disk_dir_entry *de, struct aufs_inode_ra *ra)
 {
-	kunmap(page);
-	put_page(page);
+	unsigned type = DT_UNKNOWN;
+	unsigned len;
+	size_t ino = be32_to_cpu(de->dde_inode);
+
+	if (AUFS_SB(dir->i_sb)->asb_compat_features & AUFS_COMPAT_DIR_TYPES) {
+		type = (unsigned char)AUFS_DDE_TYPE(de);
+		len = strnlen(de->dde_name, AUFS_DDE_MAX_NAME_LEN - 1);
+	} else {
+		len = strlen(de->dde_name);
+	}
+
+	if (!dir_emit(ctx, de->dde_name, len, ino, type))
+		return false;
+	if (ra)
+		aufs_inode_ra_add(dir->i_sb, ra, ino);
+	return true;
 }
 
-static int aufs_dir_emit(struct dir_context *ctx,
-			struct aufs_disk_dir_entry *de)
+/* a sane record with room bytes left in its block */
+static bool aufs_dir_rec_ok(struct aufs_disk_dir_rec *dr, size_t room)
 {
-	unsigned type = DT_UNKNOWN;
-	unsigned len = strlen(de->dde_name);
-	size_t ino = be32_to_cpu(de->dde_inode);
+	unsigned rec_len = be16_to_cpu(dr->ddr_rec_len);
+
+	return rec_len % AUFS_DDR_ALIGN == 0 && dr->ddr_name_len &&
+		rec_len >= AUFS_DDR_REC_LEN(dr->ddr_name_len) &&
+		rec_len <= room;
+}
+
+/*
+ * Returns the record at byte pos of the directory, NULL if the records of
+ * its block end before pos. *page is the mapped page, it is swapped when
+ * pos is on another one and must be released by the caller.
+ */
+static struct aufs_disk_dir_rec *aufs_dir_rec_get(struct inode *dir,
+			loff_t pos, struct page **page)
+{
+	size_t blocksize = 1 << dir->i_blkbits;
+	loff_t end = min_t(loff_t, aufs_dir_bytes(dir),
+				(pos | (blocksize - 1)) + 1);
+	pgoff_t pidx = pos >> PAGE_SHIFT;
+	struct aufs_disk_dir_rec *dr;
+
+	if ((pos & (AUFS_DDR_ALIGN - 1)) || pos >= end ||
+			end - pos < sizeof(struct aufs_disk_dir_rec))
+		goto corrupted;
+
+	if (!*page || (*page)->index != pidx) {
+		if (*page)
+			aufs_put_page(*page);
+		*page = aufs_get_page(dir, pidx);
+		if (IS_ERR(*page)) {
+			pr_err("cannot access page %lu in %lu",
+				(unsigned long)pidx,
+				(unsigned long)dir->i_ino);
+			dr = ERR_CAST(*page);
+			*page = NULL;
+			return dr;
+		}
+	}
+
+	dr = (struct aufs_disk_dir_rec *)((char *)page_address(*page) +
+				(pos & ~PAGE_MASK));
+	if (!dr->ddr_rec_len)
+		return NULL;
+	if (aufs_dir_rec_ok(dr, end - pos))
+		return dr;
+
+corrupted:
+	pr_err("bad record at %llu in %lu", (unsigned long long)pos,
+				(unsigned long)dir->i_ino);
+	return ERR_PTR(-EIO);
+}
+
+/* readdir positions are record offsets, the zero padding at the end of
+ * a block is skipped over */
+static int aufs_iterate_records(struct inode *inode, struct dir_context *ctx,
+			struct aufs_inode_ra *ra)
+{
+	bool types = AUFS_SB(inode->i_sb)->asb_compat_features &
+				AUFS_COMPAT_DIR_TYPES;
+	size_t blocksize = 1 << inode->i_blkbits;
+	loff_t size = aufs_dir_bytes(inode);
+	struct page *page = NULL;
+	pgoff_t counted = ULONG_MAX;
+	int err = 0;
+
+	/* a position from lseek may point anywhere, so the walk starts at
+	 * the block and skips what is before the position */
+	loff_t pos = ctx->pos & ~(loff_t)(blocksize - 1);
+
+	while (pos < size) {
+		struct aufs_disk_dir_rec *dr =
+				aufs_dir_rec_get(inode, pos, &page);
+
+		if (IS_ERR(dr)) {
+			err = PTR_ERR(dr);
+			break;
+		}
+		if (ra && page->index != counted) {
+			counted = page->index;
+			aufs_stat_add(inode->i_sb, AUFS_STAT_READDIR_PAGES, 1);
+		}
+
+		if (!dr) {
+			pos = (pos | (blocksize - 1)) + 1;
+		} else {
+			if (pos >= ctx->pos) {
+				ctx->pos = pos;
+				if (!dir_emit(ctx, dr->ddr_name,
+						dr->ddr_name_len,
+						be32_to_cpu(dr->ddr_inode),
+						types ? dr->ddr_type :
+							DT_UNKNOWN))
+					break;
+				if (ra)
+					aufs_inode_ra_add(inode->i_sb, ra,
+						be32_to_cpu(dr->ddr_inode));
+			}
+			pos += be16_to_cpu(dr->ddr_rec_len);
+		}
+		if (pos > ctx->pos)
+			ctx->pos = pos;
+		/* reads for the children of a page start before the next
+		 * page is touched */
+		if (ra && !(pos & ~PAGE_MASK))
+			aufs_inode_ra_issue(inode->i_sb, ra);
+	}
 
-	return dir_emit(ctx, de->dde_name, len, ino, type);
+	if (ra)
+		aufs_inode_ra_issue(inode->i_sb, ra);
+	if (page)
+		aufs_put_page(page);
+	return err;
 }
 
-static int aufs_iterate(struct inode *inode, struct dir_context *ctx)
+/* ra collects the inode table blocks of the emitted children, NULL for
+ * the walks done by lookups */
+static int aufs_iterate(struct inode *inode, struct dir_context *ctx,
+			struct aufs_inode_ra *ra)
 {
 	size_t pages = aufs_dir_pages(inode);
 	size_t pidx = aufs_dir_entry_page(ctx->pos);
 	size_t off = aufs_dir_entry_offset(ctx->pos);
 
+	if (aufs_dir_records(inode))
+		return aufs_iterate_records(inode, ctx, ra);
+
 	for ( ; pidx < pages; ++pidx, off = 0) {
 		struct page *page = aufs_get_page(inode, pidx);
 		struct aufs_disk_dir_entry *de;
 		char *kaddr;
 
 		if (IS_ERR(page)) {
-			pr_err("cannot access page %u in %lu", pidx,
+			pr_err("cannot access page %lu in %lu",
+						(unsigned long)pidx,
 						(unsigned long)inode->i_ino);
 			return PTR_ERR(page);
 		}
+		if (ra)
+			aufs_stat_add(inode->i_sb, AUFS_STAT_READDIR_PAGES, 1);
 
 		kaddr = page_address(page);
 		de = (struct aufs_disk_dir_entry *)(kaddr + off);
-		while (off < PAGE_CACHE_SIZE && ctx->pos < inode->i_size) {
-			if (!aufs_dir_emit(ctx, de)) {
+		while (off < PAGE_SIZE &&
+				ctx->pos < AUFS_INODE(inode)->ai_dir_size) {
+			if (!aufs_dir_emit(inode, ctx, de, ra)) {
+				if (ra)
+					aufs_inode_ra_issue(inode->i_sb, ra);
 				aufs_put_page(page);
 				return 0;
 			}
 			++ctx->pos;
 			++de;
+			off += sizeof(*de);
 		}
+		if (ra)
+			aufs_inode_ra_issue(inode->i_sb, ra);
 		aufs_put_page(page);
 	}
 	return 0;
@@ -88,13 +270,19 @@ static int aufs_iterate(struct inode *inode, struct dir_context *ctx)
 
 static int aufs_readdir(struct file *file, struct dir_context *ctx)
 {
-	return aufs_iterate(file_inode(file), ctx);
+	struct aufs_inode_ra ra = { .air_count = 0 };
+	loff_t start = ctx->pos;
+	int err;
+
+	err = aufs_iterate(file_inode(file), ctx, &ra);
+	trace_aufs_readdir(file_inode(file), start, ctx->pos, err);
+	return err;
 }
 
 const struct file_operations aufs_dir_ops = {
 	.llseek = generic_file_llseek,
 	.read = generic_read_dir,
-	.iterate = aufs_readdir,
+	.iterate_shared = aufs_readdir,
 };
 
 struct aufs_filename_match {
@@ -102,57 +290,509 @@ struct aufs_filename_match {
 	ino_t ino;
 	const char *name;
 	int len;
+	u64 scanned;
 };
 
-static int aufs_match(struct dir_context *ctx, const char *name, int len,
+/* returns false to stop the walk once the name is found */
+static bool aufs_match(struct dir_context *ctx, const char *name, int len,
 			loff_t off, u64 ino, unsigned type)
 {
 	struct aufs_filename_match *match = (struct aufs_filename_match *)ctx;
 
+	++match->scanned;
 	if (len != match->len)
-		return 0;
+		return true;
 
 	if (memcmp(match->name, name, len) == 0) {
 		match->ino = ino;
-		return 1;
+		return false;
+	}
+	return true;
+}
+
+static int aufs_dir_cmp(struct aufs_disk_dir_entry const *de,
+			struct qstr const *name)
+{
+	size_t len = strnlen(de->dde_name, AUFS_DDE_MAX_NAME_LEN);
+	int cmp = memcmp(de->dde_name, name->name, min_t(size_t, len,
+				name->len));
+
+	if (cmp)
+		return cmp;
+	if (len == name->len)
+		return 0;
+	return len < name->len ? -1 : 1;
+}
+
+/* Binary search over the entries of a sorted directory: only the pages
+ * on the search path are touched, and consecutive probes mostly land on
+ * the page that is already mapped. */
+static int aufs_inode_by_name_sorted(struct inode *dir,
+			struct qstr *child, ino_t *ino)
+{
+	size_t lo = 0, hi = AUFS_INODE(dir)->ai_dir_size;
+	struct page *page = NULL;
+	size_t pidx = 0;
+
+	*ino = 0;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct aufs_disk_dir_entry *de;
+		int cmp;
+
+		if (!page || pidx != aufs_dir_entry_page(mid)) {
+			if (page)
+				aufs_put_page(page);
+			pidx = aufs_dir_entry_page(mid);
+			page = aufs_get_page(dir, pidx);
+			if (IS_ERR(page)) {
+				pr_err("cannot access page %lu in %lu",
+					(unsigned long)pidx,
+					(unsigned long)dir->i_ino);
+				return PTR_ERR(page);
+			}
+		}
+
+		de = (struct aufs_disk_dir_entry *)((char *)page_address(page)
+					+ aufs_dir_entry_offset(mid));
+		aufs_stat_add(dir->i_sb, AUFS_STAT_LOOKUP_SCANNED, 1);
+		cmp = aufs_dir_cmp(de, child);
+		if (!cmp) {
+			*ino = be32_to_cpu(de->dde_inode);
+			break;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+
+	if (page)
+		aufs_put_page(page);
 	return 0;
 }
 
-static ino_t aufs_inode_by_name(struct inode *dir, struct qstr *child)
+static int aufs_dir_rec_cmp(struct aufs_disk_dir_rec const *dr,
+			struct qstr const *name)
+{
+	int cmp = memcmp(dr->ddr_name, name->name, min_t(size_t,
+				dr->ddr_name_len, name->len));
+
+	if (cmp)
+		return cmp;
+	if (dr->ddr_name_len == name->len)
+		return 0;
+	return dr->ddr_name_len < name->len ? -1 : 1;
+}
+
+/* Records cannot be bisected one by one, but every block starts with a
+ * record: a binary search over the first names of the blocks finds the
+ * only block that may hold the name, then that block is scanned. */
+static int aufs_inode_by_name_records(struct inode *dir,
+			struct qstr *child, ino_t *ino)
+{
+	unsigned bits = dir->i_blkbits;
+	sector_t lo = 0, hi = (aufs_dir_bytes(dir) + (1 << bits) - 1) >> bits;
+	struct aufs_disk_dir_rec *dr;
+	struct page *page = NULL;
+	loff_t pos, end;
+	int cmp, err = 0;
+
+	*ino = 0;
+
+	while (lo < hi) {
+		sector_t mid = lo + (hi - lo) / 2;
+
+		dr = aufs_dir_rec_get(dir, (loff_t)mid << bits, &page);
+		if (!dr)
+			dr = ERR_PTR(-EIO);
+		if (IS_ERR(dr)) {
+			err = PTR_ERR(dr);
+			goto out;
+		}
+
+		aufs_stat_add(dir->i_sb, AUFS_STAT_LOOKUP_SCANNED, 1);
+		cmp = aufs_dir_rec_cmp(dr, child);
+		if (!cmp) {
+			*ino = be32_to_cpu(dr->ddr_inode);
+			goto out;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo)
+		goto out;
+
+	pos = (loff_t)(lo - 1) << bits;
+	end = min_t(loff_t, pos + (1 << bits), aufs_dir_bytes(dir));
+	while (pos < end) {
+		dr = aufs_dir_rec_get(dir, pos, &page);
+		if (IS_ERR(dr)) {
+			err = PTR_ERR(dr);
+			break;
+		}
+		if (!dr)
+			break;
+
+		aufs_stat_add(dir->i_sb, AUFS_STAT_LOOKUP_SCANNED, 1);
+		cmp = aufs_dir_rec_cmp(dr, child);
+		if (!cmp)
+			*ino = be32_to_cpu(dr->ddr_inode);
+		if (cmp >= 0)
+			break;
+		pos += be16_to_cpu(dr->ddr_rec_len);
+	}
+
+out:
+	if (page)
+		aufs_put_page(page);
+	return err;
+}
+
+/* 32-bit FNV-1a, mkfs.aufs hashes the names the same way */
+static u32 aufs_name_hash(const char *name, unsigned len)
+{
+	u32 hash = 2166136261u;
+
+	while (len--)
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+	return hash;
+}
+
+static sector_t aufs_dir_entry_blocks(struct inode *dir)
+{
+	unsigned bits = dir->i_blkbits;
+
+	return (aufs_dir_bytes(dir) + (1 << bits) - 1) >> bits;
+}
+
+/* at least 16 bits per name, a power of two bytes */
+static size_t aufs_bloom_bytes(size_t entries)
+{
+	size_t bytes = 64;
+
+	while (bytes < 2 * entries)
+		bytes <<= 1;
+	return bytes;
+}
+
+/* a directory tail, the blocks after the entries, starts with the Bloom
+ * filter; zero if the directory has none */
+static sector_t aufs_dir_bloom_blocks(struct inode *dir)
+{
+	unsigned bits = dir->i_blkbits;
+
+	if (!(AUFS_SB(dir->i_sb)->asb_features & AUFS_FEATURE_DIR_BLOOM) ||
+			dir->i_blocks <= aufs_dir_entry_blocks(dir))
+		return 0;
+	return (aufs_bloom_bytes(aufs_dir_names_max(dir)) + (1 << bits) - 1) >>
+				bits;
+}
+
+/* the index fills the rest of the tail, rounded down to a power of two
+ * slots; zero if the directory has no index */
+static size_t aufs_dir_index_slots(struct inode *dir)
+{
+	sector_t first = aufs_dir_entry_blocks(dir) + aufs_dir_bloom_blocks(dir);
+	size_t bytes;
+
+	if (!(AUFS_SB(dir->i_sb)->asb_features & AUFS_FEATURE_DIR_INDEX) ||
+			dir->i_blocks <= first)
+		return 0;
+
+	bytes = (dir->i_blocks - first) << dir->i_blkbits;
+	if (bytes < sizeof(struct aufs_disk_dir_slot))
+		return 0;
+	return rounddown_pow_of_two(bytes / sizeof(struct aufs_disk_dir_slot));
+}
+
+static u8 *aufs_dir_bloom_load(struct inode *dir)
+{
+	loff_t off = (loff_t)aufs_dir_entry_blocks(dir) << dir->i_blkbits;
+	size_t bytes = aufs_bloom_bytes(aufs_dir_names_max(dir));
+	size_t done = 0;
+	u8 *bloom;
+
+	bloom = kvmalloc(bytes, GFP_NOFS);
+	if (!bloom)
+		return NULL;
+
+	while (done != bytes) {
+		pgoff_t pidx = (off + done) >> PAGE_SHIFT;
+		size_t offset = (off + done) & ~PAGE_MASK;
+		size_t len = min_t(size_t, bytes - done,
+					PAGE_SIZE - offset);
+		struct page *page = aufs_get_page(dir, pidx);
+
+		if (IS_ERR(page)) {
+			pr_err("cannot access page %lu in %lu",
+				(unsigned long)pidx,
+				(unsigned long)dir->i_ino);
+			kvfree(bloom);
+			return NULL;
+		}
+		memcpy(bloom + done, (char *)page_address(page) + offset, len);
+		aufs_put_page(page);
+		done += len;
+	}
+
+	/* lookups run under a shared i_rwsem and may race here, the first
+	 * copy wins */
+	if (cmpxchg(&AUFS_INODE(dir)->ai_bloom, NULL, bloom)) {
+		kvfree(bloom);
+		bloom = AUFS_INODE(dir)->ai_bloom;
+	}
+	return bloom;
+}
+
+/* false if the name is surely not in the directory; the filter is kept
+ * in memory, so this touches no directory page after the first call */
+static bool aufs_dir_may_contain(struct inode *dir, u32 hash)
+{
+	u8 *bloom = READ_ONCE(AUFS_INODE(dir)->ai_bloom);
+	u32 step = (((hash >> 17) | (hash << 15)) * 0x9e3779b1u) | 1;
+	u32 mask;
+	int i;
+
+	if (!aufs_dir_bloom_blocks(dir))
+		return true;
+	if (!bloom)
+		bloom = aufs_dir_bloom_load(dir);
+	if (!bloom)
+		return true;
+
+	mask = aufs_bloom_bytes(aufs_dir_names_max(dir)) * 8 - 1;
+	for (i = 0; i != AUFS_BLOOM_HASHES; ++i) {
+		u32 bit = (hash + i * step) & mask;
+
+		if (!(bloom[bit / 8] & (1 << (bit % 8))))
+			return false;
+	}
+	return true;
+}
+
+/* *ino is left alone unless the entry at readdir position idx is the
+ * child */
+static int aufs_dir_entry_ino(struct inode *dir, size_t idx,
+			struct qstr *child, ino_t *ino)
+{
+	struct aufs_disk_dir_entry *de;
+	struct page *page = NULL;
+
+	aufs_stat_add(dir->i_sb, AUFS_STAT_LOOKUP_SCANNED, 1);
+	if (aufs_dir_records(dir)) {
+		struct aufs_disk_dir_rec *dr =
+				aufs_dir_rec_get(dir, idx, &page);
+		int err = 0;
+
+		if (IS_ERR(dr))
+			err = PTR_ERR(dr);
+		else if (dr && !aufs_dir_rec_cmp(dr, child))
+			*ino = be32_to_cpu(dr->ddr_inode);
+		if (page)
+			aufs_put_page(page);
+		return err;
+	}
+
+	page = aufs_get_page(dir, aufs_dir_entry_page(idx));
+
+	if (IS_ERR(page)) {
+		pr_err("cannot access page %lu in %lu",
+			(unsigned long)aufs_dir_entry_page(idx),
+			(unsigned long)dir->i_ino);
+		return PTR_ERR(page);
+	}
+
+	de = (struct aufs_disk_dir_entry *)((char *)page_address(page)
+				+ aufs_dir_entry_offset(idx));
+	if (!aufs_dir_cmp(de, child))
+		*ino = be32_to_cpu(de->dde_inode);
+	aufs_put_page(page);
+	return 0;
+}
+
+/* Hashed lookup: a probe chain rarely leaves its page and the table is
+ * at most half full, so a lookup maps one index page and the page of
+ * the matching entry however large the directory is. */
+static int aufs_inode_by_name_indexed(struct inode *dir,
+			struct qstr *child, u32 hash, size_t slots, ino_t *ino)
+{
+	loff_t base = (loff_t)(aufs_dir_entry_blocks(dir) +
+				aufs_dir_bloom_blocks(dir)) << dir->i_blkbits;
+	struct page *page = NULL;
+	pgoff_t pidx = 0;
+	int err = 0;
+	size_t i;
+
+	*ino = 0;
+	for (i = 0; i != slots && !*ino && !err; ++i) {
+		loff_t off = base + ((hash + i) & (slots - 1)) *
+					sizeof(struct aufs_disk_dir_slot);
+		struct aufs_disk_dir_slot *ds;
+		size_t pos;
+
+		if (!page || pidx != off >> PAGE_SHIFT) {
+			if (page)
+				aufs_put_page(page);
+			pidx = off >> PAGE_SHIFT;
+			page = aufs_get_page(dir, pidx);
+			if (IS_ERR(page)) {
+				pr_err("cannot access page %lu in %lu",
+					(unsigned long)pidx,
+					(unsigned long)dir->i_ino);
+				return PTR_ERR(page);
+			}
+		}
+
+		ds = (struct aufs_disk_dir_slot *)((char *)page_address(page)
+					+ (off & ~PAGE_MASK));
+		pos = be32_to_cpu(ds->dds_pos);
+		if (!pos || pos > AUFS_INODE(dir)->ai_dir_size)
+			break;
+		if (be32_to_cpu(ds->dds_hash) == hash)
+			err = aufs_dir_entry_ino(dir, pos - 1, child, ino);
+	}
+
+	if (page)
+		aufs_put_page(page);
+	return err;
+}
+
+struct aufs_dirhash_fill {
+	struct dir_context ctx;
+	struct aufs_dirhash *dh;
+};
+
+static bool aufs_dirhash_fill(struct dir_context *ctx, const char *name,
+			int len, loff_t off, u64 ino, unsigned type)
+{
+	struct aufs_dirhash_fill *fill = (struct aufs_dirhash_fill *)ctx;
+
+	aufs_dirhash_add(fill->dh, aufs_name_hash(name, len), off);
+	return true;
+}
+
+/* one pass over the directory, the same a single lookup miss costs */
+static void aufs_dirhash_build(struct inode *dir)
+{
+	struct aufs_dirhash_fill fill = { { &aufs_dirhash_fill, 0 }, NULL };
+	int err;
+
+	fill.dh = aufs_dirhash_new(dir);
+	if (!fill.dh)
+		return;
+
+	err = aufs_iterate(dir, &fill.ctx, NULL);
+	if (err) {
+		aufs_dirhash_discard(dir, fill.dh);
+		return;
+	}
+	aufs_dirhash_attach(dir, fill.dh);
+}
+
+/* returns 1 if the directory has no hash, the caller scans then */
+static int aufs_inode_by_name_hashed(struct inode *dir, struct qstr *child,
+			u32 hash, ino_t *ino)
+{
+	size_t probe = 0, pos;
+	int ret = 0, err = 0;
+
+	*ino = 0;
+	while (!*ino && !err &&
+			(ret = aufs_dirhash_find(dir, hash, &probe, &pos)) > 0)
+		if (pos < AUFS_INODE(dir)->ai_dir_size)
+			err = aufs_dir_entry_ino(dir, pos, child, ino);
+
+	if (err)
+		return err;
+	return *ino || ret >= 0 ? 0 : 1;
+}
+
+/* *ino is 0 if there is no such name, errors are only for failed reads */
+static int aufs_inode_by_name(struct inode *dir, struct qstr *child,
+			ino_t *ino)
 {
 	struct aufs_filename_match match = {
-		{ &aufs_match, 0 }, 0, child->name, child->len
+		{ &aufs_match, 0 }, 0, child->name, child->len, 0
 	};
+	u32 hash = aufs_name_hash(child->name, child->len);
+	size_t slots;
+	int err;
 
-	int err = aufs_iterate(dir, &match.ctx);
+	*ino = 0;
+	if (!aufs_dir_may_contain(dir, hash))
+		return 0;
 
-	if (err)
+	slots = aufs_dir_index_slots(dir);
+	if (slots)
+		return aufs_inode_by_name_indexed(dir, child, hash, slots, ino);
+
+	if (aufs_dirhash_wanted(dir)) {
+		err = aufs_inode_by_name_hashed(dir, child, hash, ino);
+		if (err <= 0)
+			return err;
+		aufs_dirhash_build(dir);
+		err = aufs_inode_by_name_hashed(dir, child, hash, ino);
+		if (err <= 0)
+			return err;
+	}
+
+	if ((AUFS_SB(dir->i_sb)->asb_features & AUFS_FEATURE_SORTED_DIRS) &&
+			aufs_dir_records(dir))
+		return aufs_inode_by_name_records(dir, child, ino);
+	if (AUFS_SB(dir->i_sb)->asb_features & AUFS_FEATURE_SORTED_DIRS)
+		return aufs_inode_by_name_sorted(dir, child, ino);
+
+	err = aufs_iterate(dir, &match.ctx, NULL);
+	aufs_stat_add(dir->i_sb, AUFS_STAT_LOOKUP_SCANNED, match.scanned);
+	if (err) {
 		pr_err("Cannot find dir entry, error = %d", err);
-	return match.ino;
+		return err;
+	}
+	*ino = match.ino;
+	return 0;
 }
 
 static struct dentry *aufs_lookup(struct inode *dir, struct dentry *dentry,
 			unsigned flags)
 {
+	u64 start = ktime_get_ns();
 	struct inode *inode = NULL;
 	ino_t ino;
+	int err;
 
-	if (dentry->d_name.len >= AUFS_DDE_MAX_NAME_LEN)
+	if (dentry->d_name.len > (aufs_dir_records(dir) ?
+			AUFS_DDR_MAX_NAME_LEN : AUFS_DDE_MAX_NAME_LEN - 1))
 		return ERR_PTR(-ENAMETOOLONG);
 
-	ino = aufs_inode_by_name(dir, &dentry->d_name);
+	err = aufs_inode_by_name(dir, &dentry->d_name, &ino);
+	trace_aufs_lookup(dir, &dentry->d_name, ino, err);
+	if (err)
+		return ERR_PTR(err);
+
 	if (ino) {
 		inode = aufs_inode_get(dir->i_sb, ino);
 		if (IS_ERR(inode)) {
 			pr_err("Cannot read inode %lu", (unsigned long)ino);
 			return ERR_PTR(PTR_ERR(inode));
 		}
-		d_add(dentry, inode);
 	}
+
+	aufs_stat_add(dir->i_sb, ino ? AUFS_STAT_LOOKUP_HITS :
+				AUFS_STAT_LOOKUP_MISSES, 1);
+	aufs_hist_add(dir->i_sb, AUFS_HIST_LOOKUP, start);
+
+	/* a miss is cached as a negative dentry, the image never changes
+	 * so the name stays missing until the dentry is reclaimed */
+	d_add(dentry, inode);
 	return NULL;
 }
 
 const struct inode_operations aufs_dir_inode_ops = {
 	.lookup = aufs_lookup,
+	.fiemap = aufs_fiemap,
 };
@@ -0,0 +1,276 @@
+#include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
+#include "aufs.h"
+
+/*
+ * In-memory name hash for large directories of images that have no
+ * on-disk index and no sorted directories, which a binary search already
+ * serves without extra memory. It is built by one pass over the directory on the first
+ * lookup and maps a name hash to the entry position, so later lookups
+ * read only the page of the candidate entry. Hashes of a super block
+ * share a memory cap and sit on an LRU list that the shrinker trims.
+ */
+
+struct aufs_dirhash_slot {
+	u32 dhs_hash;
+	u32 dhs_pos;	/* entry index + 1, 0 if the slot is free */
+};
+
+struct aufs_dirhash {
+	struct rcu_head dh_rcu;
+	struct list_head dh_lru;
+	struct aufs_inode *dh_owner;
+	size_t dh_bytes;
+	size_t dh_mask;
+	int dh_referenced;
+	struct aufs_dirhash_slot dh_slots[];
+};
+
+static void aufs_dirhash_free_rcu(struct rcu_head *head)
+{
+	kvfree(container_of(head, struct aufs_dirhash, dh_rcu));
+}
+
+/* called with asb_dirhash_lock held */
+static void aufs_dirhash_unlink(struct aufs_super_block *asb,
+			struct aufs_dirhash *dh)
+{
+	RCU_INIT_POINTER(dh->dh_owner->ai_dirhash, NULL);
+	list_del(&dh->dh_lru);
+	asb->asb_dirhash_bytes -= dh->dh_bytes;
+	--asb->asb_dirhash_count;
+	call_rcu(&dh->dh_rcu, aufs_dirhash_free_rcu);
+}
+
+static size_t aufs_dirhash_slots(struct inode *dir)
+{
+	return roundup_pow_of_two(2 * aufs_dir_names_max(dir));
+}
+
+static size_t aufs_dirhash_size(size_t slots)
+{
+	return sizeof(struct aufs_dirhash) +
+			slots * sizeof(struct aufs_dirhash_slot);
+}
+
+/* a hash larger than dirhash_maxmem is never built, so lookups of such a
+ * directory do not try it again every time */
+bool aufs_dirhash_wanted(struct inode *dir)
+{
+	struct aufs_super_block *asb = AUFS_SB(dir->i_sb);
+
+	if (asb->asb_features & AUFS_FEATURE_SORTED_DIRS)
+		return false;
+	return asb->asb_dirhash_min &&
+			aufs_dir_names_max(dir) >= asb->asb_dirhash_min &&
+			aufs_dirhash_size(aufs_dirhash_slots(dir)) <=
+			asb->asb_dirhash_maxmem;
+}
+
+struct aufs_dirhash *aufs_dirhash_new(struct inode *dir)
+{
+	struct aufs_super_block *asb = AUFS_SB(dir->i_sb);
+	size_t slots = aufs_dirhash_slots(dir);
+	size_t bytes = aufs_dirhash_size(slots);
+	struct aufs_dirhash *dh;
+
+	/* it would not fit even alone, keep the hashes of other directories */
+	if (bytes > asb->asb_dirhash_maxmem)
+		return NULL;
+
+	/* make room by dropping the least recently used hashes */
+	spin_lock(&asb->asb_dirhash_lock);
+	while (asb->asb_dirhash_bytes + bytes > asb->asb_dirhash_maxmem &&
+			!list_empty(&asb->asb_dirhash_lru))
+		aufs_dirhash_unlink(asb, list_first_entry(
+			&asb->asb_dirhash_lru, struct aufs_dirhash, dh_lru));
+	if (asb->asb_dirhash_bytes + bytes > asb->asb_dirhash_maxmem) {
+		spin_unlock(&asb->asb_dirhash_lock);
+		return NULL;
+	}
+	asb->asb_dirhash_bytes += bytes;
+	spin_unlock(&asb->asb_dirhash_lock);
+
+	dh = kvzalloc(bytes, GFP_NOFS);
+	if (!dh) {
+		spin_lock(&asb->asb_dirhash_lock);
+		asb->asb_dirhash_bytes -= bytes;
+		spin_unlock(&asb->asb_dirhash_lock);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&dh->dh_lru);
+	dh->dh_owner = AUFS_INODE(dir);
+	dh->dh_bytes = bytes;
+	dh->dh_mask = slots - 1;
+	return dh;
+}
+
+void aufs_dirhash_add(struct aufs_dirhash *dh, u32 hash, size_t pos)
+{
+	size_t slot = hash & dh->dh_mask;
+
+	while (dh->dh_slots[slot].dhs_pos)
+		slot = (slot + 1) & dh->dh_mask;
+	dh->dh_slots[slot].dhs_hash = hash;
+	dh->dh_slots[slot].dhs_pos = pos + 1;
+}
+
+void aufs_dirhash_discard(struct inode *dir, struct aufs_dirhash *dh)
+{
+	struct aufs_super_block *asb = AUFS_SB(dir->i_sb);
+
+	spin_lock(&asb->asb_dirhash_lock);
+	asb->asb_dirhash_bytes -= dh->dh_bytes;
+	spin_unlock(&asb->asb_dirhash_lock);
+	kvfree(dh);
+}
+
+/* lookups hold the i_rwsem of the directory shared, so two of them may
+ * build a hash at once; the first one attached stays, the other is
+ * dropped */
+void aufs_dirhash_attach(struct inode *dir, struct aufs_dirhash *dh)
+{
+	struct aufs_super_block *asb = AUFS_SB(dir->i_sb);
+
+	spin_lock(&asb->asb_dirhash_lock);
+	if (rcu_access_pointer(AUFS_INODE(dir)->ai_dirhash)) {
+		asb->asb_dirhash_bytes -= dh->dh_bytes;
+		spin_unlock(&asb->asb_dirhash_lock);
+		kvfree(dh);
+		return;
+	}
+	list_add_tail(&dh->dh_lru, &asb->asb_dirhash_lru);
+	++asb->asb_dirhash_count;
+	rcu_assign_pointer(AUFS_INODE(dir)->ai_dirhash, dh);
+	spin_unlock(&asb->asb_dirhash_lock);
+}
+
+/*
+ * Finds the next entry whose name hash is hash, *probe keeps the place
+ * between calls and must start at zero. Returns 1 and the entry index in
+ * *pos for a candidate, 0 when there are no more candidates and -ENOENT
+ * if the directory has no hash (anymore).
+ */
+int aufs_dirhash_find(struct inode *dir, u32 hash, size_t *probe,
+			size_t *pos)
+{
+	struct aufs_dirhash *dh;
+	int ret = 0;
+
+	rcu_read_lock();
+	dh = rcu_dereference(AUFS_INODE(dir)->ai_dirhash);
+	if (!dh) {
+		rcu_read_unlock();
+		return -ENOENT;
+	}
+
+	if (!READ_ONCE(dh->dh_referenced))
+		WRITE_ONCE(dh->dh_referenced, 1);
+
+	while (*probe <= dh->dh_mask) {
+		struct aufs_dirhash_slot *slot =
+			&dh->dh_slots[(hash + *probe) & dh->dh_mask];
+
+		++*probe;
+		if (!slot->dhs_pos)
+			break;
+		if (slot->dhs_hash == hash) {
+			*pos = slot->dhs_pos - 1;
+			ret = 1;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return ret;
+}
+
+void aufs_dirhash_drop(struct inode *inode)
+{
+	struct aufs_super_block *asb = AUFS_SB(inode->i_sb);
+	struct aufs_dirhash *dh;
+
+	if (!rcu_access_pointer(AUFS_INODE(inode)->ai_dirhash))
+		return;
+
+	spin_lock(&asb->asb_dirhash_lock);
+	dh = rcu_dereference_protected(AUFS_INODE(inode)->ai_dirhash,
+				lockdep_is_held(&asb->asb_dirhash_lock));
+	if (dh)
+		aufs_dirhash_unlink(asb, dh);
+	spin_unlock(&asb->asb_dirhash_lock);
+}
+
+static unsigned long aufs_dirhash_count(struct shrinker *shrink,
+			struct shrink_control *sc)
+{
+	struct aufs_super_block *asb = shrink->private_data;
+
+	return asb->asb_dirhash_count;
+}
+
+/* the LRU order is only refreshed here: recently used hashes get a
+ * second chance instead of being moved on every lookup */
+static unsigned long aufs_dirhash_scan(struct shrinker *shrink,
+			struct shrink_control *sc)
+{
+	struct aufs_super_block *asb = shrink->private_data;
+	unsigned long freed = 0;
+	unsigned long scanned;
+
+	spin_lock(&asb->asb_dirhash_lock);
+	for (scanned = 0; scanned != sc->nr_to_scan &&
+			!list_empty(&asb->asb_dirhash_lru); ++scanned) {
+		struct aufs_dirhash *dh = list_first_entry(
+			&asb->asb_dirhash_lru, struct aufs_dirhash, dh_lru);
+
+		if (READ_ONCE(dh->dh_referenced)) {
+			WRITE_ONCE(dh->dh_referenced, 0);
+			list_move_tail(&dh->dh_lru, &asb->asb_dirhash_lru);
+			continue;
+		}
+		aufs_dirhash_unlink(asb, dh);
+		++freed;
+	}
+	spin_unlock(&asb->asb_dirhash_lock);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+int aufs_dirhash_setup(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	struct shrinker *shrinker;
+
+	spin_lock_init(&asb->asb_dirhash_lock);
+	INIT_LIST_HEAD(&asb->asb_dirhash_lru);
+
+	shrinker = shrinker_alloc(0, "aufs-dirhash:%s", sb->s_id);
+	if (!shrinker) {
+		pr_err("aufs cannot register dirhash shrinker\n");
+		return -ENOMEM;
+	}
+
+	shrinker->count_objects = aufs_dirhash_count;
+	shrinker->scan_objects = aufs_dirhash_scan;
+	shrinker->seeks = DEFAULT_SEEKS;
+	shrinker->private_data = asb;
+	shrinker_register(shrinker);
+	asb->asb_dirhash_shrinker = shrinker;
+	return 0;
+}
+
+/* all the inodes are evicted by now, so the hashes are gone already */
+void aufs_dirhash_cleanup(struct aufs_super_block *asb)
+{
+	shrinker_free(asb->asb_dirhash_shrinker);
+	asb->asb_dirhash_shrinker = NULL;
+	WARN_ON(asb->asb_dirhash_count);
+}
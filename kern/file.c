@@ -1,9 +1,94 @@
 #include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/uio.h>
+
+#include "aufs.h"
+#include "trace.h"
+
+/* runs for synchronous and asynchronous reads alike */
+static int aufs_dio_end_io(struct kiocb *iocb, ssize_t size, int error,
+			unsigned flags)
+{
+	if (!error && size > 0)
+		aufs_stat_add(file_inode(iocb->ki_filp)->i_sb,
+				AUFS_STAT_DIRECT_BYTES, size);
+	return error;
+}
+
+static const struct iomap_dio_ops aufs_dio_ops = {
+	.end_io = aufs_dio_end_io,
+};
+
+/* The image never changes, so direct reads need neither i_rwsem nor a
+ * page cache flush. iomap submits bios for whole extents and completes
+ * them asynchronously for AIO and io_uring callers, polled with
+ * IOCB_HIPRI. */
+static ssize_t aufs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	loff_t pos = iocb->ki_pos;
+	size_t count;
+	ssize_t ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT)) {
+		ret = generic_file_read_iter(iocb, to);
+		if (ret > 0)
+			aufs_stat_add(file_inode(iocb->ki_filp)->i_sb,
+					AUFS_STAT_BUFFERED_BYTES, ret);
+		return ret;
+	}
+	count = iov_iter_count(to);
+	if (!count)
+		return 0;
+	ret = iomap_dio_rw(iocb, to, &aufs_iomap_ops, &aufs_dio_ops, 0,
+				NULL, 0);
+	trace_aufs_dio_read(iocb, pos, count, ret);
+	return ret;
+}
+
+/* Every block of a file is mapped, so SEEK_HOLE finds only the one at
+ * i_size, but the answers come off the same mapping reads use. */
+static loff_t aufs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
+
+	switch (whence) {
+	case SEEK_DATA:
+		offset = iomap_seek_data(inode, offset, &aufs_iomap_ops);
+		break;
+	case SEEK_HOLE:
+		offset = iomap_seek_hole(inode, offset, &aufs_iomap_ops);
+		break;
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/* iomap_begin never blocks, so io_uring may issue reads inline */
+static int aufs_file_open(struct inode *inode, struct file *file)
+{
+	file->f_mode |= FMODE_NOWAIT;
+	return generic_file_open(inode, file);
+}
 
 const struct file_operations aufs_file_ops = {
-	.llseek = generic_file_llseek,
-	.read = new_sync_read,
-	.read_iter = generic_file_read_iter,
+	.open = aufs_file_open,
+	.llseek = aufs_file_llseek,
+	.read_iter = aufs_file_read_iter,
 	.mmap = generic_file_mmap,
-	.splice_read = generic_file_splice_read
+	.splice_read = filemap_splice_read
+};
+
+/* one extent per run, the extent list block itself is not reported */
+int aufs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+			u64 start, u64 len)
+{
+	return iomap_fiemap(inode, fieinfo, start, len, &aufs_iomap_ops);
+}
+
+const struct inode_operations aufs_file_inode_ops = {
+	.fiemap = aufs_fiemap,
 };
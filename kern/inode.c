@@ -1,24 +1,71 @@
-#include <linux/aio.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
-#include <linux/mpage.h>
+#include <linux/iomap.h>
+#include <linux/pagemap.h>
 #include <linux/slab.h>
 
 #include "aufs.h"
+#include "trace.h"
+
+/* decodes inode no stored at raw, a wide or a compact inode as the
+ * image has them */
+static int aufs_inode_decode(struct aufs_super_block const *asb,
+			struct aufs_inode_info *ii, ino_t no, void const *raw)
+{
+	struct aufs_disk_compact_inode const *dci = raw;
+	struct aufs_disk_inode const *di = raw;
+	struct aufs_disk_inode_attr const *dia;
+	unsigned long attr, time;
+
+	if (!(asb->asb_features & AUFS_FEATURE_COMPACT_INODES)) {
+		ii->ii_first = be32_to_cpu(di->di_first);
+		ii->ii_blocks = be32_to_cpu(di->di_blocks);
+		ii->ii_size = be32_to_cpu(di->di_size);
+		ii->ii_gid = be32_to_cpu(di->di_gid);
+		ii->ii_uid = be32_to_cpu(di->di_uid);
+		ii->ii_mode = be32_to_cpu(di->di_mode);
+		ii->ii_ctime = be64_to_cpu(di->di_ctime);
+		return 0;
+	}
+
+	attr = be16_to_cpu(dci->dci_attr);
+	time = be16_to_cpu(dci->dci_time);
+	if (attr >= asb->asb_attrs_count || time >= asb->asb_times_count) {
+		pr_err("aufs inode %lu refers to attribute %lu and time %lu, "
+			"out of the tables\n", (unsigned long)no, attr, time);
+		return -EIO;
+	}
+
+	dia = &asb->asb_attrs[attr];
+	ii->ii_first = be32_to_cpu(dci->dci_first);
+	ii->ii_blocks = be32_to_cpu(dci->dci_blocks);
+	ii->ii_size = be32_to_cpu(dci->dci_size);
+	ii->ii_gid = be32_to_cpu(dia->dia_gid);
+	ii->ii_uid = be32_to_cpu(dia->dia_uid);
+	ii->ii_mode = be32_to_cpu(dia->dia_mode);
+	ii->ii_ctime = be64_to_cpu(asb->asb_times[time]);
+	return 0;
+}
 
 static void aufs_inode_fill(struct aufs_inode *ai,
-			struct aufs_disk_inode const *di)
+			struct aufs_inode_info const *ii)
 {
-	ai->ai_block = be32_to_cpu(di->di_first);
-	ai->ai_inode.i_mode = be32_to_cpu(di->di_mode);
-	ai->ai_inode.i_size = be32_to_cpu(di->di_size);
-	ai->ai_inode.i_blocks = be32_to_cpu(di->di_blocks);
-	ai->ai_inode.i_ctime.tv_sec = be64_to_cpu(di->di_ctime);
-	ai->ai_inode.i_mtime.tv_sec = ai->ai_inode.i_atime.tv_sec =
-				ai->ai_inode.i_ctime.tv_sec;
-	ai->ai_inode.i_mtime.tv_nsec = ai->ai_inode.i_atime.tv_nsec =
-				ai->ai_inode.i_ctime.tv_nsec = 0;
-	i_uid_write(&ai->ai_inode, (uid_t)be32_to_cpu(di->di_uid));
-	i_gid_write(&ai->ai_inode, (gid_t)be32_to_cpu(di->di_gid));
+	ai->ai_block = ii->ii_first;
+	ai->ai_inode.i_mode = ii->ii_mode;
+	ai->ai_inode.i_size = ii->ii_size;
+	ai->ai_inode.i_blocks = ii->ii_blocks;
+	/* the page cache reads nothing past i_size, and directory tails
+	 * lie beyond what di_size counts */
+	if (S_ISDIR(ai->ai_inode.i_mode)) {
+		ai->ai_dir_size = ai->ai_inode.i_size;
+		ai->ai_inode.i_size = (loff_t)ai->ai_inode.i_blocks <<
+					ai->ai_inode.i_blkbits;
+	}
+	inode_set_ctime(&ai->ai_inode, ii->ii_ctime, 0);
+	inode_set_mtime(&ai->ai_inode, ii->ii_ctime, 0);
+	inode_set_atime(&ai->ai_inode, ii->ii_ctime, 0);
+	i_uid_write(&ai->ai_inode, (uid_t)ii->ii_uid);
+	i_gid_write(&ai->ai_inode, (gid_t)ii->ii_gid);
 }
 
 static inline sector_t aufs_inode_block(struct aufs_super_block const *asb,
@@ -30,67 +77,378 @@ static inline sector_t aufs_inode_block(struct aufs_super_block const *asb,
 static size_t aufs_inode_offset(struct aufs_super_block const *asb,
 			ino_t inode_no)
 {
-	return sizeof(struct aufs_disk_inode) *
-				(inode_no % asb->asb_inodes_in_block);
+	return aufs_inode_size(asb) * (inode_no % asb->asb_inodes_in_block);
 }
 
-struct inode *aufs_inode_get(struct super_block *sb, ino_t no)
+/* reads count entries of size bytes from block first on */
+static void *aufs_inode_table_load(struct super_block *sb,
+			unsigned long first, unsigned long count, size_t size)
 {
 	struct aufs_super_block *asb = AUFS_SB(sb);
-	struct buffer_head *bh;
-	struct aufs_disk_inode *di;
-	struct aufs_inode *ai;
-	struct inode *inode;
-	size_t block, offset;
+	size_t bytes = count * size;
+	unsigned long blocks = DIV_ROUND_UP(bytes, asb->asb_block_size);
+	unsigned long i;
+	char *table;
 
-	inode = iget_locked(sb, no);
-	if (!inode)
+	if (!first || !count || count > AUFS_COMPACT_TABLE_MAX) {
+		pr_err("aufs bad inode table of %lu entries at block %lu\n",
+			count, first);
+		return ERR_PTR(-EINVAL);
+	}
+
+	table = kvmalloc(bytes, GFP_KERNEL);
+	if (!table) {
+		pr_err("aufs cannot allocate inode table\n");
 		return ERR_PTR(-ENOMEM);
+	}
 
-	if (!(inode->i_state & I_NEW))
-		return inode;
+	for (i = 0; i != blocks; ++i)
+		sb_breadahead(sb, first + i);
+
+	for (i = 0; i != blocks; ++i) {
+		struct buffer_head *bh = sb_bread(sb, first + i);
+		size_t offset = i * asb->asb_block_size;
+
+		if (!bh) {
+			pr_err("cannot read block %lu\n", first + i);
+			kvfree(table);
+			return ERR_PTR(-EIO);
+		}
+		if (aufs_verify_bh(sb, bh)) {
+			brelse(bh);
+			kvfree(table);
+			return ERR_PTR(-EIO);
+		}
+		memcpy(table + offset, bh->b_data,
+			min_t(size_t, bytes - offset, asb->asb_block_size));
+		brelse(bh);
+	}
+	return table;
+}
+
+/* compact inodes share these two tables, which are small: an image made
+ * by mkfs has a handful of distinct owners, modes and times */
+int aufs_inode_tables_load(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	void *table;
+
+	table = aufs_inode_table_load(sb, asb->asb_attrs_first,
+				asb->asb_attrs_count,
+				sizeof(struct aufs_disk_inode_attr));
+	if (IS_ERR(table))
+		return PTR_ERR(table);
+	asb->asb_attrs = table;
+
+	table = aufs_inode_table_load(sb, asb->asb_times_first,
+				asb->asb_times_count, sizeof(__be64));
+	if (IS_ERR(table)) {
+		aufs_inode_tables_free(asb);
+		return PTR_ERR(table);
+	}
+	asb->asb_times = table;
+
+	pr_debug("aufs loaded %lu inode attributes and %lu times\n",
+		asb->asb_attrs_count, asb->asb_times_count);
+
+	return 0;
+}
+
+void aufs_inode_tables_free(struct aufs_super_block *asb)
+{
+	kvfree(asb->asb_attrs);
+	asb->asb_attrs = NULL;
+	kvfree(asb->asb_times);
+	asb->asb_times = NULL;
+}
+
+/* Reads the inode table in one pass: the readahead requests of a plug
+ * are merged into large sequential I/Os before any block is waited on.
+ * Lookups then never block on the table. The inodes are kept as they are
+ * on disk and decoded when loaded, so the table takes as much memory as
+ * it takes blocks: 16 bytes a compact inode, whose owner, mode and time
+ * stay indexes into the shared tables. */
+int aufs_inodes_load(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	unsigned long per_block = asb->asb_inodes_in_block;
+	size_t bytes = per_block * aufs_inode_size(asb);
+	struct aufs_inode_info ii;
+	struct blk_plug plug;
+	unsigned long i, j;
+
+	asb->asb_inodes = kvmalloc_array(asb->asb_inode_blocks, bytes,
+				GFP_KERNEL);
+	if (!asb->asb_inodes) {
+		pr_err("aufs cannot allocate inode table\n");
+		return -ENOMEM;
+	}
+
+	blk_start_plug(&plug);
+	for (i = 0; i != asb->asb_inode_blocks; ++i)
+		sb_breadahead(sb, aufs_inode_block(asb, i * per_block));
+	blk_finish_plug(&plug);
+
+	for (i = 0; i != asb->asb_inode_blocks; ++i) {
+		sector_t block = aufs_inode_block(asb, i * per_block);
+		struct buffer_head *bh = sb_bread(sb, block);
+
+		if (!bh) {
+			pr_err("cannot read block %lu\n", (unsigned long)block);
+			aufs_inodes_free(asb);
+			return -EIO;
+		}
+		if (aufs_verify_bh(sb, bh)) {
+			brelse(bh);
+			aufs_inodes_free(asb);
+			return -EIO;
+		}
+
+		/* free inodes are all zero and decode fine, so a bad
+		 * one is damage and fails the mount */
+		for (j = 0; j != per_block; ++j) {
+			unsigned long no = i * per_block + j;
+
+			if (aufs_inode_decode(asb, &ii, no,
+					bh->b_data + j * aufs_inode_size(asb))) {
+				brelse(bh);
+				aufs_inodes_free(asb);
+				return -EIO;
+			}
+		}
+		memcpy((char *)asb->asb_inodes + i * bytes, bh->b_data, bytes);
+		brelse(bh);
+	}
+	asb->asb_inodes_count = asb->asb_inode_blocks * per_block;
+
+	pr_debug("aufs preloaded %lu inodes\n", asb->asb_inodes_count);
+
+	return 0;
+}
+
+void aufs_inodes_free(struct aufs_super_block *asb)
+{
+	kvfree(asb->asb_inodes);
+	asb->asb_inodes = NULL;
+	asb->asb_inodes_count = 0;
+}
+
+/* Remembers the table block of inode no, at most AUFS_INODE_RA_MAX
+ * distinct ones per call. Children are mostly allocated together, so
+ * many of them share a block. */
+void aufs_inode_ra_add(struct super_block *sb, struct aufs_inode_ra *ra,
+			ino_t no)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	sector_t block;
+	unsigned i;
+
+	if (asb->asb_inodes || ra->air_count == AUFS_INODE_RA_MAX ||
+			no / asb->asb_inodes_in_block >= asb->asb_inode_blocks)
+		return;
 
-	ai = AUFS_INODE(inode);
 	block = aufs_inode_block(asb, no);
-	offset = aufs_inode_offset(asb, no);
+	for (i = ra->air_count; i; --i)
+		if (ra->air_blocks[i - 1] == block)
+			return;
+	ra->air_blocks[ra->air_count++] = block;
+}
+
+/* starts reads of the blocks added since the last call, without waiting
+ * for them; blocks already in the buffer cache cost no I/O */
+void aufs_inode_ra_issue(struct super_block *sb, struct aufs_inode_ra *ra)
+{
+	struct blk_plug plug;
 
-	pr_debug("aufs reads inode %lu from %lu block with offset %lu\n",
-		(unsigned long)no, (unsigned long)block, (unsigned long)offset);
+	if (ra->air_issued == ra->air_count)
+		return;
+
+	blk_start_plug(&plug);
+	for ( ; ra->air_issued != ra->air_count; ++ra->air_issued)
+		sb_breadahead(sb, ra->air_blocks[ra->air_issued]);
+	blk_finish_plug(&plug);
+}
+
+/* the inode from the preloaded table or, without one, from its block */
+static int aufs_inode_read(struct super_block *sb, ino_t no,
+			struct aufs_inode_info *ii)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	struct buffer_head *bh;
+	size_t block, offset;
+	int err;
+
+	if (asb->asb_inodes) {
+		if (no >= asb->asb_inodes_count) {
+			pr_err("aufs inode %lu is out of the table\n",
+				(unsigned long)no);
+			return -EIO;
+		}
+		return aufs_inode_decode(asb, ii, no, (char *)asb->asb_inodes +
+					no * aufs_inode_size(asb));
+	}
+
+	block = aufs_inode_block(asb, no);
+	offset = aufs_inode_offset(asb, no);
 
 	bh = sb_bread(sb, block);
 	if (!bh) {
 		pr_err("cannot read block %lu\n", (unsigned long)block);
-		goto read_error;
+		return -EIO;
 	}
+	aufs_stat_add(sb, AUFS_STAT_INODE_READS, 1);
 
-	di = (struct aufs_disk_inode *)(bh->b_data + offset);
-	aufs_inode_fill(ai, di);
+	if (aufs_verify_bh(sb, bh)) {
+		brelse(bh);
+		return -EIO;
+	}
+
+	err = aufs_inode_decode(asb, ii, no, bh->b_data + offset);
 	brelse(bh);
+	return err;
+}
+
+/* reads the extent list of a file; the runs must add up to i_blocks */
+static int aufs_extents_load(struct inode *inode, sector_t list)
+{
+	struct super_block *sb = inode->i_sb;
+	struct aufs_inode *ai = AUFS_INODE(inode);
+	struct aufs_disk_extent_header *deh;
+	struct aufs_disk_extent *de;
+	struct buffer_head *bh;
+	unsigned count, max, i;
+	u32 logical = 0;
+	int err = -EIO;
+
+	bh = sb_bread(sb, list);
+	if (!bh) {
+		pr_err("cannot read block %lu\n", (unsigned long)list);
+		return -EIO;
+	}
+	if (aufs_verify_bh(sb, bh))
+		goto out;
+
+	deh = (struct aufs_disk_extent_header *)bh->b_data;
+	de = (struct aufs_disk_extent *)(deh + 1);
+	count = be32_to_cpu(deh->deh_count);
+	max = (sb->s_blocksize - sizeof(*deh)) / sizeof(*de);
+	if (!count || count > max) {
+		pr_err("aufs inode %lu has %u runs\n", inode->i_ino, count);
+		goto out;
+	}
+
+	ai->ai_extents = kmalloc_array(count, sizeof(*ai->ai_extents),
+				GFP_NOFS);
+	if (!ai->ai_extents) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i != count; ++i) {
+		struct aufs_extent_info *ei = &ai->ai_extents[i];
+
+		ei->ei_logical = logical;
+		ei->ei_first = be32_to_cpu(de[i].de_first);
+		ei->ei_blocks = be32_to_cpu(de[i].de_blocks);
+		if (!ei->ei_blocks)
+			break;
+		logical += ei->ei_blocks;
+	}
+	if (i != count || logical != inode->i_blocks) {
+		pr_err("aufs runs of inode %lu do not add up to %lu blocks\n",
+			inode->i_ino, (unsigned long)inode->i_blocks);
+		kfree(ai->ai_extents);
+		ai->ai_extents = NULL;
+		goto out;
+	}
+
+	ai->ai_extents_count = count;
+	ai->ai_block = ai->ai_extents[0].ei_first;
+	err = 0;
+out:
+	brelse(bh);
+	return err;
+}
+
+/* Finds the run holding file block block, false past the last one. A
+ * list fills at most one block, its runs are binary searched by their
+ * first file block. */
+bool aufs_extent_find(struct inode *inode, sector_t block,
+			struct aufs_extent_info *ei)
+{
+	struct aufs_inode *ai = AUFS_INODE(inode);
+	unsigned lo = 0, hi = ai->ai_extents_count;
+
+	if (block >= inode->i_blocks)
+		return false;
+
+	if (!ai->ai_extents) {
+		ei->ei_logical = 0;
+		ei->ei_first = ai->ai_block;
+		ei->ei_blocks = inode->i_blocks;
+		return true;
+	}
+
+	/* the last run starting at or before block */
+	while (hi - lo > 1) {
+		unsigned mid = lo + (hi - lo) / 2;
+
+		if (ai->ai_extents[mid].ei_logical <= block)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	*ei = ai->ai_extents[lo];
+	return true;
+}
+
+struct inode *aufs_inode_get(struct super_block *sb, ino_t no)
+{
+	u64 start = ktime_get_ns();
+	struct aufs_inode_info ii;
+	struct aufs_inode *ai;
+	struct inode *inode;
+
+	inode = iget_locked(sb, no);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+
+	if (!(inode->i_state & I_NEW)) {
+		aufs_hist_add(sb, AUFS_HIST_INODE_GET, start);
+		return inode;
+	}
+
+	ai = AUFS_INODE(inode);
+	if (aufs_inode_read(sb, no, &ii))
+		goto read_error;
+	aufs_inode_fill(ai, &ii);
+
+	if ((AUFS_SB(sb)->asb_features & AUFS_FEATURE_EXTENTS) &&
+			(ii.ii_first & AUFS_EXTENT_LIST)) {
+		/* directory code maps blocks straight off ai_block */
+		if (!S_ISREG(inode->i_mode) || aufs_extents_load(inode,
+					ii.ii_first & ~AUFS_EXTENT_LIST))
+			goto read_error;
+	}
 
 	inode->i_mapping->a_ops = &aufs_aops;
 	if (S_ISREG(inode->i_mode)) {
+		if (aufs_verify_enabled(sb))
+			inode->i_mapping->a_ops = &aufs_verify_aops;
+		/* directory code maps single pages, so only files get
+		 * large folios */
+		mapping_set_large_folios(inode->i_mapping);
+		inode->i_op = &aufs_file_inode_ops;
 		inode->i_fop = &aufs_file_ops;
 	} else {
 		inode->i_op = &aufs_dir_inode_ops;
 		inode->i_fop = &aufs_dir_ops;
 	}
 
-	pr_debug("aufs inode %lu info:\n"
-		"\tsize   = %lu\n"
-		"\tblock  = %lu\n"
-		"\tblocks = %lu\n"
-		"\tuid    = %lu\n"
-		"\tgid    = %lu\n"
-		"\tmode   = %lo\n",
-				(unsigned long)inode->i_ino,
-				(unsigned long)inode->i_size,
-				(unsigned long)ai->ai_block,
-				(unsigned long)inode->i_blocks,
-				(unsigned long)i_uid_read(inode),
-				(unsigned long)i_gid_read(inode),
-				(unsigned long)inode->i_mode);
+	trace_aufs_inode_load(inode, ai->ai_block, ai->ai_extents_count);
 
 	unlock_new_inode(inode);
+	aufs_hist_add(sb, AUFS_HIST_INODE_GET, start);
 
 	return inode;
 
@@ -101,34 +459,64 @@ read_error:
 	return ERR_PTR(-EIO);
 }
 
-static int aufs_get_block(struct inode *inode, sector_t iblock,
-			struct buffer_head *bh_result, int create)
+/* A whole run is one mapping, so iomap reads as much of it as the
+ * folios or the direct I/O request at hand cover in a single bio. Past
+ * the last run is a hole. */
+static int aufs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+			unsigned flags, struct iomap *iomap, struct iomap *srcmap)
 {
-	map_bh(bh_result, inode->i_sb, iblock + AUFS_INODE(inode)->ai_block);
+	unsigned bits = inode->i_blkbits;
+	struct aufs_extent_info ei;
+
+	aufs_stat_add(inode->i_sb, AUFS_STAT_IOMAP_BEGIN, 1);
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->flags = 0;
+	if (!aufs_extent_find(inode, pos >> bits, &ei)) {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->offset = pos;
+		iomap->length = length;
+	} else {
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = (u64)ei.ei_first << bits;
+		iomap->offset = (loff_t)ei.ei_logical << bits;
+		iomap->length = (loff_t)ei.ei_blocks << bits;
+	}
+	trace_aufs_iomap_begin(inode, pos, length, flags, iomap);
 	return 0;
 }
 
-static int aufs_readpage(struct file *file, struct page *page)
+const struct iomap_ops aufs_iomap_ops = {
+	.iomap_begin = aufs_iomap_begin,
+};
+
+static int aufs_read_folio(struct file *file, struct folio *folio)
 {
-	return mpage_readpage(page, aufs_get_block);
+	return iomap_read_folio(folio, &aufs_iomap_ops);
 }
 
-static int aufs_readpages(struct file *file, struct address_space *mapping,
-			struct list_head *pages, unsigned nr_pages)
+/* FIBMAP, the block may be read straight off the device */
+sector_t aufs_bmap(struct address_space *mapping, sector_t block)
 {
-	return mpage_readpages(mapping, pages, nr_pages, aufs_get_block);
+	return iomap_bmap(mapping, block, &aufs_iomap_ops);
 }
 
-static ssize_t aufs_direct_io(int rw, struct kiocb *iocb,
-			struct iov_iter *iter, loff_t off)
+static void aufs_readahead(struct readahead_control *rac)
 {
-	struct inode *inode = file_inode(iocb->ki_filp);
-
-	return blockdev_direct_IO(rw, iocb, inode, iter, off, aufs_get_block);
+	aufs_stat_add(rac->mapping->host->i_sb, AUFS_STAT_READAHEAD_PAGES,
+				readahead_count(rac));
+	iomap_readahead(rac, &aufs_iomap_ops);
 }
 
 const struct address_space_operations aufs_aops = {
-	.readpage = aufs_readpage,
-	.readpages = aufs_readpages,
-	.direct_IO = aufs_direct_io
+	.read_folio = aufs_read_folio,
+	.readahead = aufs_readahead,
+	.bmap = aufs_bmap,
+	.release_folio = iomap_release_folio,
+	.invalidate_folio = iomap_invalidate_folio,
+	.is_partially_uptodate = iomap_is_partially_uptodate,
+	.migrate_folio = filemap_migrate_folio,
+	/* direct reads go through aufs_file_read_iter, this only lets
+	 * O_DIRECT opens through */
+	.direct_IO = noop_direct_IO
 };
@@ -0,0 +1,170 @@
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/percpu.h>
+#include <linux/sysfs.h>
+
+#include "aufs.h"
+
+/*
+ * Per mount counters under /sys/fs/aufs/<device>/. The hot paths bump a
+ * per-CPU copy without any locking, a read sums the copies, so a value
+ * may be a little behind a concurrent update but never torn. A latency
+ * file holds AUFS_HIST_BUCKETS counts: the first bucket is below a
+ * microsecond, bucket i is [2^(i-1), 2^i) microseconds and the last one
+ * takes everything slower.
+ */
+
+static struct kset *aufs_kset;
+
+struct aufs_stat_attr {
+	struct attribute asa_attr;
+	int asa_stat;
+	bool asa_hist;
+};
+
+#define AUFS_STAT_ATTR(name, stat) \
+	static struct aufs_stat_attr aufs_stat_attr_##name = { \
+		.asa_attr = { .name = #name, .mode = 0444 }, \
+		.asa_stat = stat, \
+	}
+
+#define AUFS_HIST_ATTR(name, hist) \
+	static struct aufs_stat_attr aufs_stat_attr_##name = { \
+		.asa_attr = { .name = #name, .mode = 0444 }, \
+		.asa_stat = hist, \
+		.asa_hist = true, \
+	}
+
+AUFS_STAT_ATTR(lookup_hits, AUFS_STAT_LOOKUP_HITS);
+AUFS_STAT_ATTR(lookup_misses, AUFS_STAT_LOOKUP_MISSES);
+AUFS_STAT_ATTR(lookup_entries_scanned, AUFS_STAT_LOOKUP_SCANNED);
+AUFS_STAT_ATTR(readdir_pages, AUFS_STAT_READDIR_PAGES);
+AUFS_STAT_ATTR(inode_table_reads, AUFS_STAT_INODE_READS);
+AUFS_STAT_ATTR(iomap_begin_calls, AUFS_STAT_IOMAP_BEGIN);
+AUFS_STAT_ATTR(readahead_pages, AUFS_STAT_READAHEAD_PAGES);
+AUFS_STAT_ATTR(buffered_read_bytes, AUFS_STAT_BUFFERED_BYTES);
+AUFS_STAT_ATTR(direct_read_bytes, AUFS_STAT_DIRECT_BYTES);
+AUFS_HIST_ATTR(inode_get_latency, AUFS_HIST_INODE_GET);
+AUFS_HIST_ATTR(lookup_latency, AUFS_HIST_LOOKUP);
+
+static struct attribute *aufs_stat_attrs[] = {
+	&aufs_stat_attr_lookup_hits.asa_attr,
+	&aufs_stat_attr_lookup_misses.asa_attr,
+	&aufs_stat_attr_lookup_entries_scanned.asa_attr,
+	&aufs_stat_attr_readdir_pages.asa_attr,
+	&aufs_stat_attr_inode_table_reads.asa_attr,
+	&aufs_stat_attr_iomap_begin_calls.asa_attr,
+	&aufs_stat_attr_readahead_pages.asa_attr,
+	&aufs_stat_attr_buffered_read_bytes.asa_attr,
+	&aufs_stat_attr_direct_read_bytes.asa_attr,
+	&aufs_stat_attr_inode_get_latency.asa_attr,
+	&aufs_stat_attr_lookup_latency.asa_attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(aufs_stat);
+
+static u64 aufs_counter_sum(struct aufs_super_block *asb, int stat)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(asb->asb_stats, cpu)->as_counters[stat];
+	return sum;
+}
+
+static u64 aufs_bucket_sum(struct aufs_super_block *asb, int hist,
+			unsigned bucket)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(asb->asb_stats, cpu)->as_hist[hist][bucket];
+	return sum;
+}
+
+static ssize_t aufs_stat_show(struct kobject *kobj, struct attribute *attr,
+			char *buf)
+{
+	struct aufs_super_block *asb = container_of(kobj,
+				struct aufs_super_block, asb_kobj);
+	struct aufs_stat_attr *asa = container_of(attr,
+				struct aufs_stat_attr, asa_attr);
+	ssize_t len = 0;
+	unsigned i;
+
+	if (!asa->asa_hist)
+		return sysfs_emit(buf, "%llu\n",
+				aufs_counter_sum(asb, asa->asa_stat));
+
+	for (i = 0; i != AUFS_HIST_BUCKETS; ++i)
+		len += sysfs_emit_at(buf, len, "%llu%c",
+				aufs_bucket_sum(asb, asa->asa_stat, i),
+				i + 1 == AUFS_HIST_BUCKETS ? '\n' : ' ');
+	return len;
+}
+
+static const struct sysfs_ops aufs_stat_sysfs_ops = {
+	.show = aufs_stat_show,
+};
+
+static void aufs_stat_release(struct kobject *kobj)
+{
+	struct aufs_super_block *asb = container_of(kobj,
+				struct aufs_super_block, asb_kobj);
+
+	complete(&asb->asb_kobj_released);
+}
+
+static const struct kobj_type aufs_stat_ktype = {
+	.default_groups = aufs_stat_groups,
+	.sysfs_ops = &aufs_stat_sysfs_ops,
+	.release = aufs_stat_release,
+};
+
+int aufs_stats_setup(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	int err;
+
+	asb->asb_stats = alloc_percpu(struct aufs_stats);
+	if (!asb->asb_stats) {
+		pr_err("aufs cannot allocate counters\n");
+		return -ENOMEM;
+	}
+
+	init_completion(&asb->asb_kobj_released);
+	asb->asb_kobj.kset = aufs_kset;
+	err = kobject_init_and_add(&asb->asb_kobj, &aufs_stat_ktype, NULL,
+				"%s", sb->s_id);
+	if (err)
+		pr_err("aufs cannot add %s to sysfs\n", sb->s_id);
+	return err;
+}
+
+/* a reader may still hold the kobject, asb is freed only after that */
+void aufs_stats_cleanup(struct aufs_super_block *asb)
+{
+	if (asb->asb_kobj.state_initialized) {
+		kobject_put(&asb->asb_kobj);
+		wait_for_completion(&asb->asb_kobj_released);
+	}
+	free_percpu(asb->asb_stats);
+	asb->asb_stats = NULL;
+}
+
+int aufs_stats_init(void)
+{
+	aufs_kset = kset_create_and_add("aufs", NULL, fs_kobj);
+	if (!aufs_kset)
+		return -ENOMEM;
+	return 0;
+}
+
+void aufs_stats_fini(void)
+{
+	kset_unregister(aufs_kset);
+	aufs_kset = NULL;
+}
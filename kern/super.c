@@ -1,24 +1,47 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/parser.h>
 #include <linux/slab.h>
 
 #include "aufs.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 static void aufs_put_super(struct super_block *sb)
 {
 	struct aufs_super_block *asb = AUFS_SB(sb);
 
-	if (asb)
+	if (asb) {
+		aufs_dirhash_cleanup(asb);
+		aufs_inodes_free(asb);
+		aufs_inode_tables_free(asb);
+		aufs_csum_free(asb);
+		aufs_stats_cleanup(asb);
 		kfree(asb);
+	}
 	sb->s_fs_info = NULL;
 	pr_debug("aufs super block destroyed\n");
 }
 
+static void aufs_evict_inode(struct inode *inode)
+{
+	truncate_inode_pages_final(&inode->i_data);
+	clear_inode(inode);
+	aufs_dirhash_drop(inode);
+	kvfree(AUFS_INODE(inode)->ai_bloom);
+	AUFS_INODE(inode)->ai_bloom = NULL;
+	kfree(AUFS_INODE(inode)->ai_extents);
+	AUFS_INODE(inode)->ai_extents = NULL;
+}
+
 static struct super_operations const aufs_super_ops = {
 	.alloc_inode = aufs_inode_alloc,
 	.destroy_inode = aufs_inode_free,
+	.evict_inode = aufs_evict_inode,
 	.put_super = aufs_put_super,
 };
 
@@ -29,8 +52,15 @@ static inline void aufs_super_block_fill(struct aufs_super_block *asb,
 	asb->asb_inode_blocks = be32_to_cpu(dsb->dsb_inode_blocks);
 	asb->asb_block_size = be32_to_cpu(dsb->dsb_block_size);
 	asb->asb_root_inode = be32_to_cpu(dsb->dsb_root_inode);
-	asb->asb_inodes_in_block =
-		asb->asb_block_size / sizeof(struct aufs_disk_inode);
+	asb->asb_features = be32_to_cpu(dsb->dsb_features);
+	asb->asb_inodes_in_block = asb->asb_block_size / aufs_inode_size(asb);
+	asb->asb_csum_first = be32_to_cpu(dsb->dsb_csum_first);
+	asb->asb_csum_blocks = be32_to_cpu(dsb->dsb_csum_blocks);
+	asb->asb_compat_features = be32_to_cpu(dsb->dsb_compat_features);
+	asb->asb_attrs_first = be32_to_cpu(dsb->dsb_attrs_first);
+	asb->asb_attrs_count = be32_to_cpu(dsb->dsb_attrs_count);
+	asb->asb_times_first = be32_to_cpu(dsb->dsb_times_first);
+	asb->asb_times_count = be32_to_cpu(dsb->dsb_times_count);
 }
 
 static struct aufs_super_block *aufs_super_block_read(struct super_block *sb)
@@ -61,17 +91,27 @@ static struct aufs_super_block *aufs_super_block_read(struct super_block *sb)
 		goto free_memory;
 	}
 
+	if (asb->asb_features & ~AUFS_FEATURES_SUPPORTED) {
+		pr_err("unsupported features %lx\n",
+			asb->asb_features & ~AUFS_FEATURES_SUPPORTED);
+		goto free_memory;
+	}
+
 	pr_debug("aufs super block info:\n"
 		"\tmagic           = %lu\n"
 		"\tinode blocks    = %lu\n"
 		"\tblock size      = %lu\n"
 		"\troot inode      = %lu\n"
-		"\tinodes in block = %lu\n",
+		"\tinodes in block = %lu\n"
+		"\tfeatures        = %lx\n"
+		"\tcompat features = %lx\n",
 		(unsigned long)asb->asb_magic,
 		(unsigned long)asb->asb_inode_blocks,
 		(unsigned long)asb->asb_block_size,
 		(unsigned long)asb->asb_root_inode,
-		(unsigned long)asb->asb_inodes_in_block);
+		(unsigned long)asb->asb_inodes_in_block,
+		(unsigned long)asb->asb_features,
+		(unsigned long)asb->asb_compat_features);
 
 	return asb;
 
@@ -80,10 +120,103 @@ free_memory:
 	return NULL;
 }
 
+enum {
+	AUFS_OPT_TOKEN_VERIFY,
+	AUFS_OPT_TOKEN_PRELOAD_INODES,
+	AUFS_OPT_TOKEN_DIRHASH_MIN,
+	AUFS_OPT_TOKEN_DIRHASH_MAXMEM,
+	AUFS_OPT_TOKEN_ERROR
+};
+
+static const match_table_t aufs_opt_tokens = {
+	{ AUFS_OPT_TOKEN_VERIFY, "verify" },
+	{ AUFS_OPT_TOKEN_PRELOAD_INODES, "preload_inodes" },
+	{ AUFS_OPT_TOKEN_DIRHASH_MIN, "dirhash_min=%u" },
+	{ AUFS_OPT_TOKEN_DIRHASH_MAXMEM, "dirhash_maxmem=%u" },
+	{ AUFS_OPT_TOKEN_ERROR, NULL }
+};
+
+/* directories with at least that many entries get a lookup hash */
+static const unsigned long AUFS_DIRHASH_MIN = 256;
+/* memory all the lookup hashes of a mount may take, in KiB */
+static const unsigned long AUFS_DIRHASH_MAXMEM = 4096;
+
+static int aufs_parse_options(struct aufs_super_block *asb, char *options)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int value;
+
+	asb->asb_dirhash_min = AUFS_DIRHASH_MIN;
+	asb->asb_dirhash_maxmem = AUFS_DIRHASH_MAXMEM << 10;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, aufs_opt_tokens, args)) {
+		case AUFS_OPT_TOKEN_VERIFY:
+			asb->asb_opts |= AUFS_OPT_VERIFY;
+			break;
+		case AUFS_OPT_TOKEN_PRELOAD_INODES:
+			asb->asb_opts |= AUFS_OPT_PRELOAD_INODES;
+			break;
+		case AUFS_OPT_TOKEN_DIRHASH_MIN:
+			if (match_int(args, &value) || value < 0)
+				goto bad_value;
+			asb->asb_dirhash_min = value;
+			break;
+		case AUFS_OPT_TOKEN_DIRHASH_MAXMEM:
+			if (match_int(args, &value) || value < 0)
+				goto bad_value;
+			asb->asb_dirhash_maxmem = (unsigned long)value << 10;
+			break;
+		default:
+			pr_err("unknown mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+
+bad_value:
+	pr_err("bad value in mount option \"%s\"\n", p);
+	return -EINVAL;
+}
+
+/* loads the checksum table and checks the super block against it */
+static int aufs_verify_setup(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	struct buffer_head *bh;
+	int err;
+
+	if (!(asb->asb_features & AUFS_FEATURE_CSUM)) {
+		pr_err("aufs image has no checksums to verify\n");
+		return -EINVAL;
+	}
+
+	err = aufs_csum_load(sb);
+	if (err)
+		return err;
+
+	bh = sb_bread(sb, 0);
+	if (!bh) {
+		pr_err("cannot read 0 block\n");
+		return -EIO;
+	}
+	err = aufs_verify_bh(sb, bh);
+	brelse(bh);
+	return err;
+}
+
 static int aufs_fill_sb(struct super_block *sb, void *data, int silent)
 {
 	struct aufs_super_block *asb = aufs_super_block_read(sb);
 	struct inode *root;
+	int err;
 
 	if (!asb)
 		return -EINVAL;
@@ -92,23 +225,65 @@ static int aufs_fill_sb(struct super_block *sb, void *data, int silent)
 	sb->s_fs_info = asb;
 	sb->s_op = &aufs_super_ops;
 
+	/* ->put_super is not called when we fail here */
+	err = aufs_parse_options(asb, data);
+	if (err)
+		goto free_super;
+
 	if (sb_set_blocksize(sb, asb->asb_block_size) == 0) {
 		pr_err("device does not support block size %lu\n",
 			(unsigned long)asb->asb_block_size);
-		return -EINVAL;
+		err = -EINVAL;
+		goto free_super;
+	}
+
+	/* before anything that reads inodes bumps the counters */
+	err = aufs_stats_setup(sb);
+	if (err)
+		goto free_super;
+
+	if (aufs_verify_enabled(sb)) {
+		err = aufs_verify_setup(sb);
+		if (err)
+			goto free_super;
+	}
+
+	/* after the checksums are loaded, the tables are verified as read */
+	if (asb->asb_features & AUFS_FEATURE_COMPACT_INODES) {
+		err = aufs_inode_tables_load(sb);
+		if (err)
+			goto free_super;
+	}
+
+	if (asb->asb_opts & AUFS_OPT_PRELOAD_INODES) {
+		err = aufs_inodes_load(sb);
+		if (err)
+			goto free_super;
 	}
 
+	err = aufs_dirhash_setup(sb);
+	if (err)
+		goto free_super;
+
 	root = aufs_inode_get(sb, asb->asb_root_inode);
-	if (IS_ERR(root))
-		return PTR_ERR(root);
+	if (IS_ERR(root)) {
+		err = PTR_ERR(root);
+		goto free_super;
+	}
 
 	sb->s_root = d_make_root(root);
 	if (!sb->s_root) {
 		pr_err("aufs cannot create root\n");
-		return -ENOMEM;
+		err = -ENOMEM;
+		goto free_super;
 	}
 
+	trace_aufs_mount(sb, asb->asb_features, asb->asb_opts);
 	return 0;
+
+free_super:
+	aufs_put_super(sb);
+	return err;
 }
 
 static struct dentry *aufs_mount(struct file_system_type *type, int flags,
@@ -118,8 +293,6 @@ static struct dentry *aufs_mount(struct file_system_type *type, int flags,
 
 	if (IS_ERR(entry))
 		pr_err("aufs mounting failed\n");
-	else
-		pr_debug("aufs mounted\n");
 	return entry;
 }
 
@@ -140,6 +313,10 @@ struct inode *aufs_inode_alloc(struct super_block *sb)
 
 	if (!inode)
 		return NULL;
+	RCU_INIT_POINTER(inode->ai_dirhash, NULL);
+	inode->ai_bloom = NULL;
+	inode->ai_extents = NULL;
+	inode->ai_extents_count = 0;
 	return &inode->ai_inode;
 }
 
@@ -147,7 +324,6 @@ static void aufs_free_callback(struct rcu_head *head)
 {
 	struct inode *inode = container_of(head, struct inode, i_rcu);
 
-	pr_debug("freeing inode %lu\n", (unsigned long)inode->i_ino);
 	kmem_cache_free(aufs_inode_cache, AUFS_INODE(inode));
 }
 
@@ -167,7 +343,7 @@ static int aufs_inode_cache_create(void)
 {
 	aufs_inode_cache = kmem_cache_create("aufs_inode",
 		sizeof(struct aufs_inode), 0,
-		(SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD), aufs_inode_init_once);
+		(SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT), aufs_inode_init_once);
 	if (aufs_inode_cache == NULL)
 		return -ENOMEM;
 	return 0;
@@ -189,8 +365,25 @@ static int __init aufs_init(void)
 		return ret;
 	}
 
+	ret = aufs_verify_init();
+	if (ret != 0) {
+		aufs_inode_cache_destroy();
+		pr_err("cannot create verify workqueue\n");
+		return ret;
+	}
+
+	ret = aufs_stats_init();
+	if (ret != 0) {
+		aufs_verify_fini();
+		aufs_inode_cache_destroy();
+		pr_err("cannot create /sys/fs/aufs\n");
+		return ret;
+	}
+
 	ret = register_filesystem(&aufs_type);
 	if (ret != 0) {
+		aufs_stats_fini();
+		aufs_verify_fini();
 		aufs_inode_cache_destroy();
 		pr_err("cannot register filesystem\n");
 		return ret;
@@ -208,6 +401,8 @@ static void __exit aufs_fini(void)
 	if (ret != 0)
 		pr_err("cannot unregister filesystem\n");
 
+	aufs_stats_fini();
+	aufs_verify_fini();
 	aufs_inode_cache_destroy();
 
 	pr_debug("aufs module unloaded\n");
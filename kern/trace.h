@@ -0,0 +1,206 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aufs
+
+#if !defined(_AUFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AUFS_TRACE_H
+
+#include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+/* 6.10 dropped the source argument, the string is taken from __string() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define aufs_assign_str(field, src)	__assign_str(field)
+#else
+#define aufs_assign_str(field, src)	__assign_str(field, src)
+#endif
+
+/*
+ * Events under /sys/kernel/tracing/events/aufs/, a disabled event costs a
+ * static branch. Devices are printed as major,minor like the ext4 events
+ * so perf and ftrace filters on dev work the same way.
+ */
+
+TRACE_EVENT(aufs_mount,
+	TP_PROTO(struct super_block *sb, unsigned long features,
+		unsigned long opts),
+	TP_ARGS(sb, features, opts),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, block_size)
+		__field(unsigned long, features)
+		__field(unsigned long, opts)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->block_size = sb->s_blocksize;
+		__entry->features = features;
+		__entry->opts = opts;
+	),
+
+	TP_printk("dev %d,%d block_size %lu features 0x%lx opts 0x%lx",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->block_size,
+		__entry->features, __entry->opts)
+);
+
+TRACE_EVENT(aufs_inode_load,
+	TP_PROTO(struct inode *inode, unsigned long first,
+		unsigned extents),
+	TP_ARGS(inode, first, extents),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(umode_t, mode)
+		__field(loff_t, size)
+		__field(unsigned long, first)
+		__field(blkcnt_t, blocks)
+		__field(unsigned, extents)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->mode = inode->i_mode;
+		__entry->size = inode->i_size;
+		__entry->first = first;
+		__entry->blocks = inode->i_blocks;
+		__entry->extents = extents;
+	),
+
+	TP_printk("dev %d,%d ino %lu mode 0%o size %lld first %lu blocks %llu extents %u",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		(unsigned long)__entry->ino, __entry->mode, __entry->size,
+		__entry->first, (unsigned long long)__entry->blocks,
+		__entry->extents)
+);
+
+TRACE_EVENT(aufs_lookup,
+	TP_PROTO(struct inode *dir, const struct qstr *name, ino_t ino,
+		int err),
+	TP_ARGS(dir, name, ino, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, dir)
+		__field(ino_t, ino)
+		__field(int, err)
+		__string(name, name->name)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->err = err;
+		aufs_assign_str(name, name->name);
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s ino %lu err %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		(unsigned long)__entry->dir, __get_str(name),
+		(unsigned long)__entry->ino, __entry->err)
+);
+
+TRACE_EVENT(aufs_readdir,
+	TP_PROTO(struct inode *dir, loff_t start, loff_t end, int err),
+	TP_ARGS(dir, start, end, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, dir)
+		__field(loff_t, start)
+		__field(loff_t, end)
+		__field(int, err)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->start = start;
+		__entry->end = end;
+		__entry->err = err;
+	),
+
+	TP_printk("dev %d,%d dir %lu pos %lld..%lld err %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		(unsigned long)__entry->dir, __entry->start, __entry->end,
+		__entry->err)
+);
+
+/* the block mapping of one iomap iteration, buffered and direct alike */
+TRACE_EVENT(aufs_iomap_begin,
+	TP_PROTO(struct inode *inode, loff_t pos, loff_t length,
+		unsigned flags, const struct iomap *iomap),
+	TP_ARGS(inode, pos, length, flags, iomap),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(loff_t, pos)
+		__field(loff_t, length)
+		__field(unsigned, flags)
+		__field(u16, type)
+		__field(u64, addr)
+		__field(loff_t, offset)
+		__field(u64, map_length)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->length = length;
+		__entry->flags = flags;
+		__entry->type = iomap->type;
+		__entry->addr = iomap->addr;
+		__entry->offset = iomap->offset;
+		__entry->map_length = iomap->length;
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld length %lld flags 0x%x type %u addr %llu offset %lld map_length %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		(unsigned long)__entry->ino, __entry->pos, __entry->length,
+		__entry->flags, __entry->type, __entry->addr, __entry->offset,
+		__entry->map_length)
+);
+
+/* ret is -EIOCBQUEUED for a read that completes asynchronously */
+TRACE_EVENT(aufs_dio_read,
+	TP_PROTO(struct kiocb *iocb, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(iocb, pos, count, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(int, flags)
+		__field(ssize_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = file_inode(iocb->ki_filp)->i_sb->s_dev;
+		__entry->ino = file_inode(iocb->ki_filp)->i_ino;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->flags = iocb->ki_flags;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld count %zu flags 0x%x ret %zd",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		(unsigned long)__entry->ino, __entry->pos, __entry->count,
+		__entry->flags, __entry->ret)
+);
+
+#endif /* _AUFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -0,0 +1,384 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+
+namespace
+{
+
+std::string JsonEscape(std::string const &str)
+{
+	std::ostringstream out;
+
+	for (unsigned char c : str) {
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if (c < 0x20)
+			out << "\\u00" << "0123456789abcdef"[c >> 4]
+				<< "0123456789abcdef"[c & 15];
+		else
+			out << c;
+	}
+	return out.str();
+}
+
+uint64_t Distance(uint64_t from, uint64_t to) noexcept
+{ return from > to ? from - to : to - from; }
+
+/* Replays block reads the way a cold page cache would see them: blocks
+ * read once are not read again, adjacent reads merge into one I/O and
+ * every I/O that does not start where the previous one ended is a seek. */
+class IoModel {
+public:
+	explicit IoModel(uint32_t blocks)
+		: m_cached(blocks, false)
+	{ }
+
+	void Read(uint32_t first, uint32_t count)
+	{
+		uint64_t const end = std::min<uint64_t>(
+				static_cast<uint64_t>(first) + count,
+				m_cached.size());
+
+		for (uint64_t block = first; block < end; ++block) {
+			if (m_cached[block])
+				continue;
+			m_cached[block] = true;
+			++m_blocks;
+
+			if (m_ios && block == m_next) {
+				++m_next;
+				continue;
+			}
+
+			if (m_ios) {
+				m_seek += Distance(m_next, block);
+				++m_seeks;
+			}
+			++m_ios;
+			m_next = block + 1;
+		}
+	}
+
+	uint64_t Ios() const noexcept
+	{ return m_ios; }
+
+	uint64_t Seeks() const noexcept
+	{ return m_seeks; }
+
+	uint64_t SeekDistance() const noexcept
+	{ return m_seek; }
+
+	uint64_t Blocks() const noexcept
+	{ return m_blocks; }
+
+private:
+	std::vector<bool>	m_cached;
+	uint64_t		m_next = 0;
+	uint64_t		m_ios = 0;
+	uint64_t		m_seeks = 0;
+	uint64_t		m_seek = 0;
+	uint64_t		m_blocks = 0;
+};
+
+class Analyzer {
+public:
+	explicit Analyzer(Image const &image, bool verbose)
+		: m_image(image)
+		, m_verbose(verbose)
+		, m_per_block(image.InodesPerBlock())
+	{ }
+
+	void ReportDirs() const
+	{
+		uint64_t dirs = 0, children = 0, inode_blocks = 0;
+		uint64_t span = 0, distance = 0, max_distance = 0;
+
+		for (uint32_t no = 1; no < m_image.Inodes(); ++no) {
+			InodeView const dir = m_image.GetInode(no);
+
+			if (!dir || !dir.IsDir())
+				continue;
+
+			std::vector<uint32_t> blocks;
+			uint64_t dist = 0, max_dist = 0, count = 0;
+
+			for (DirEntryView const entry : m_image.Entries(dir)) {
+				InodeView const child = m_image.GetInode(
+					entry.InodeNo());
+
+				if (!child)
+					continue;
+
+				uint64_t const d = Distance(dir.FirstBlock(),
+						m_image.Extent(child, 0).m_first);
+
+				blocks.push_back(InodeBlock(child.InodeNo()));
+				dist += d;
+				max_dist = std::max(max_dist, d);
+				++count;
+			}
+
+			std::sort(blocks.begin(), blocks.end());
+			blocks.erase(std::unique(blocks.begin(), blocks.end()),
+					blocks.end());
+			uint64_t const spread = blocks.empty() ? 0 :
+					blocks.back() - blocks.front() + 1;
+
+			++dirs;
+			children += count;
+			inode_blocks += blocks.size();
+			span += spread;
+			distance += dist;
+			max_distance = std::max(max_distance, max_dist);
+
+			if (m_verbose)
+				std::cout << "{\"dir\":" << no
+					<< ",\"children\":" << count
+					<< ",\"inode_blocks\":" << blocks.size()
+					<< ",\"inode_span\":" << spread
+					<< ",\"avg_child_distance\":"
+					<< (count ? double(dist) / count : 0.0)
+					<< ",\"max_child_distance\":"
+					<< max_dist << "}" << std::endl;
+		}
+
+		std::cout << "{\"report\":\"dirs\",\"dirs\":" << dirs
+			<< ",\"children\":" << children
+			<< ",\"avg_inode_blocks\":"
+			<< (dirs ? double(inode_blocks) / dirs : 0.0)
+			<< ",\"avg_inode_span\":"
+			<< (dirs ? double(span) / dirs : 0.0)
+			<< ",\"avg_child_distance\":"
+			<< (children ? double(distance) / children : 0.0)
+			<< ",\"max_child_distance\":" << max_distance << "}"
+			<< std::endl;
+	}
+
+	void ReportFreeSpace() const
+	{
+		Span<uint8_t const> const map = m_image.BlockMap();
+		std::vector<uint64_t> histogram(33, 0);
+		uint64_t free = 0, extents = 0, largest = 0, run = 0;
+
+		for (uint32_t block = 0; block <= m_image.Blocks(); ++block) {
+			bool const is_free = block < m_image.Blocks() &&
+				(map[block / 8] & (1u << (block % 8)));
+
+			if (is_free) {
+				++run;
+				continue;
+			}
+			if (!run)
+				continue;
+
+			free += run;
+			++extents;
+			largest = std::max(largest, run);
+			++histogram[Log2(run)];
+			run = 0;
+		}
+
+		std::cout << "{\"report\":\"free\",\"free_blocks\":" << free
+			<< ",\"free_extents\":" << extents
+			<< ",\"largest_free_extent\":" << largest
+			<< ",\"fragmentation\":"
+			<< (free ? 1.0 - double(largest) / free : 0.0)
+			<< ",\"extents_by_size\":{";
+		bool first = true;
+		for (size_t i = 0; i != histogram.size(); ++i) {
+			if (!histogram[i])
+				continue;
+			std::cout << (first ? "" : ",") << "\"" << (1ull << i)
+				<< "\":" << histogram[i];
+			first = false;
+		}
+		std::cout << "}}" << std::endl;
+	}
+
+	/* Every line is either an absolute path, resolved and read the way
+	 * the kernel module does it, or "block FIRST [COUNT]". */
+	void Replay(std::istream &trace) const
+	{
+		IoModel io(m_image.Blocks());
+		uint64_t lines = 0, missing = 0;
+		std::string line;
+
+		while (std::getline(trace, line)) {
+			if (line.empty() || line[0] == '#')
+				continue;
+
+			++lines;
+			if (line[0] == '/') {
+				if (!ReplayPath(io, line))
+					++missing;
+				continue;
+			}
+
+			std::istringstream in(line);
+			std::string kind;
+			uint64_t first = 0, count = 1;
+
+			if (!(in >> kind >> first) || kind != "block") {
+				std::cerr << "WARNING: cannot parse \"" << line
+					<< "\"" << std::endl;
+				continue;
+			}
+			in >> count;
+			if (first < m_image.Blocks())
+				io.Read(first, std::min<uint64_t>(count,
+						m_image.Blocks() - first));
+		}
+
+		std::cout << "{\"report\":\"trace\",\"records\":" << lines
+			<< ",\"missing\":" << missing
+			<< ",\"blocks\":" << io.Blocks()
+			<< ",\"ios\":" << io.Ios()
+			<< ",\"discontiguous_ios\":" << io.Seeks()
+			<< ",\"seek_distance\":" << io.SeekDistance()
+			<< "}" << std::endl;
+	}
+
+private:
+	static uint32_t Log2(uint64_t v) noexcept
+	{ return 63 - __builtin_clzll(v); }
+
+	uint32_t InodeBlock(uint32_t no) const noexcept
+	{ return 3 + no / m_per_block; }
+
+	void ReadInode(IoModel &io, InodeView inode) const
+	{ io.Read(InodeBlock(inode.InodeNo()), 1); }
+
+	/* a lookup scans the directory up to the block with the entry */
+	uint32_t ReadLookup(IoModel &io, InodeView dir, std::string const &name)
+		const
+	{
+		DirEntries const entries = m_image.Entries(dir);
+		uint32_t const block_size = m_image.BlockSize();
+
+		for (DirEntries::Iterator it = entries.begin();
+				it != entries.end(); ++it) {
+			DirEntryView const entry = *it;
+
+			if (name.size() != entry.NameLen() ||
+					name.compare(0, name.size(), entry.Name(),
+						entry.NameLen()))
+				continue;
+
+			io.Read(dir.FirstBlock(), it.Offset() / block_size + 1);
+			return entry.InodeNo();
+		}
+
+		io.Read(dir.FirstBlock(), (entries.Bytes() + block_size - 1) /
+					block_size);
+		return 0;
+	}
+
+	bool ReplayPath(IoModel &io, std::string const &path) const
+	{
+		InodeView inode = m_image.GetInode(m_image.RootInode());
+		std::istringstream in(path);
+		std::string name;
+
+		if (!inode)
+			return false;
+		ReadInode(io, inode);
+
+		while (std::getline(in, name, '/')) {
+			if (name.empty())
+				continue;
+			if (!inode.IsDir())
+				return false;
+
+			inode = m_image.GetInode(ReadLookup(io, inode, name));
+			if (!inode)
+				return false;
+			ReadInode(io, inode);
+		}
+
+		if (uint32_t const list = m_image.ExtentListBlock(inode))
+			io.Read(list, 1);
+		for (size_t i = 0; i != m_image.ExtentsCount(inode); ++i) {
+			FileExtent const extent = m_image.Extent(inode, i);
+
+			io.Read(extent.m_first, extent.m_blocks);
+		}
+		return true;
+	}
+
+	Image const &	m_image;
+	bool		m_verbose;
+	uint32_t	m_per_block;
+};
+
+void PrintHelp()
+{
+	std::cout << "Usage:" << std::endl
+		<< "\taufs-layout [(--trace | -t) TRACE] [--verbose | -v] IMAGE"
+		<< std::endl << std::endl
+		<< "Where:" << std::endl
+		<< "\tTRACE   - file with one access per line: an absolute path or \"block FIRST [COUNT]\"." << std::endl
+		<< "\t-v      - also print a line for every directory." << std::endl
+		<< "\tIMAGE   - aufs image or device." << std::endl << std::endl
+		<< "Reports are printed as one JSON object per line." << std::endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	std::string image_path, trace_path;
+	bool verbose = false;
+
+	--argc;
+	++argv;
+	while (argc--) {
+		std::string const arg(*argv++);
+		if ((arg == "--trace" || arg == "-t") && argc) {
+			trace_path = *argv++;
+			--argc;
+		} else if (arg == "--verbose" || arg == "-v") {
+			verbose = true;
+		} else if (arg == "--help" || arg == "-h") {
+			PrintHelp();
+			return 0;
+		} else {
+			image_path = arg;
+		}
+	}
+
+	try {
+		if (image_path.empty())
+			throw std::runtime_error("Image name expected");
+
+		Image const image(image_path);
+		Analyzer const analyzer(image, verbose);
+
+		std::cout << "{\"image\":\"" << JsonEscape(image_path)
+			<< "\",\"block_size\":" << image.BlockSize()
+			<< ",\"blocks\":" << image.Blocks()
+			<< ",\"inodes\":" << image.Inodes() << "}" << std::endl;
+		analyzer.ReportDirs();
+		analyzer.ReportFreeSpace();
+
+		if (!trace_path.empty()) {
+			std::ifstream trace(trace_path);
+			if (!trace)
+				throw std::runtime_error("Cannot open " +
+							trace_path);
+			analyzer.Replay(trace);
+		}
+
+		return 0;
+	} catch (std::exception const & e) {
+		std::cout << "ERROR: " << e.what() << std::endl;
+		PrintHelp();
+	}
+
+	return 1;
+}
@@ -8,11 +8,38 @@
 static uint32_t const AUFS_MAGIC = 0x13131313;
 static uint32_t const AUFS_NAME_MAXLEN = 28;
 
+/* asb_features bits */
+static uint32_t const AUFS_FEATURE_CSUM = 0x00000001;
+static uint32_t const AUFS_FEATURE_SORTED_DIRS = 0x00000002;
+static uint32_t const AUFS_FEATURE_DIR_INDEX = 0x00000004;
+static uint32_t const AUFS_FEATURE_DIR_BLOOM = 0x00000008;
+static uint32_t const AUFS_FEATURE_DIR_RECORDS = 0x00000010;
+static uint32_t const AUFS_FEATURE_COMPACT_INODES = 0x00000020;
+static uint32_t const AUFS_FEATURE_EXTENTS = 0x00000040;
+static uint32_t const AUFS_FEATURES_KNOWN = AUFS_FEATURE_CSUM |
+					AUFS_FEATURE_SORTED_DIRS |
+					AUFS_FEATURE_DIR_INDEX |
+					AUFS_FEATURE_DIR_BLOOM |
+					AUFS_FEATURE_DIR_RECORDS |
+					AUFS_FEATURE_COMPACT_INODES |
+					AUFS_FEATURE_EXTENTS;
+
+/* asb_compat_features bits, readers may ignore the ones they do not know */
+static uint32_t const AUFS_COMPAT_DIR_TYPES = 0x00000001;
+
 struct aufs_super_block {
 	uint32_t	asb_magic;
 	uint32_t	asb_block_size;
 	uint32_t	asb_root_inode;
 	uint32_t	asb_inode_blocks;
+	uint32_t	asb_features;
+	uint32_t	asb_csum_first;
+	uint32_t	asb_csum_blocks;
+	uint32_t	asb_compat_features;
+	uint32_t	asb_attrs_first;
+	uint32_t	asb_attrs_count;
+	uint32_t	asb_times_first;
+	uint32_t	asb_times_count;
 };
 
 static inline uint32_t & ASB_MAGIC(struct aufs_super_block *asb)
@@ -27,6 +54,30 @@ static inline uint32_t & ASB_ROOT_INODE(struct aufs_super_block *asb)
 static inline uint32_t & ASB_INODE_BLOCKS(struct aufs_super_block *asb)
 { return asb->asb_inode_blocks; }
 
+static inline uint32_t & ASB_FEATURES(struct aufs_super_block *asb)
+{ return asb->asb_features; }
+
+static inline uint32_t & ASB_CSUM_FIRST(struct aufs_super_block *asb)
+{ return asb->asb_csum_first; }
+
+static inline uint32_t & ASB_CSUM_BLOCKS(struct aufs_super_block *asb)
+{ return asb->asb_csum_blocks; }
+
+static inline uint32_t & ASB_COMPAT_FEATURES(struct aufs_super_block *asb)
+{ return asb->asb_compat_features; }
+
+static inline uint32_t & ASB_ATTRS_FIRST(struct aufs_super_block *asb)
+{ return asb->asb_attrs_first; }
+
+static inline uint32_t & ASB_ATTRS_COUNT(struct aufs_super_block *asb)
+{ return asb->asb_attrs_count; }
+
+static inline uint32_t & ASB_TIMES_FIRST(struct aufs_super_block *asb)
+{ return asb->asb_times_first; }
+
+static inline uint32_t & ASB_TIMES_COUNT(struct aufs_super_block *asb)
+{ return asb->asb_times_count; }
+
 
 struct aufs_inode {
 	uint32_t	ai_first;
@@ -60,6 +111,95 @@ static inline uint64_t & AI_CTIME(struct aufs_inode *ai)
 { return ai->ai_ctime; }
 
 
+/* With AUFS_FEATURE_COMPACT_INODES the inode table holds these instead
+ * of aufs_inode. Owner and mode come from the attribute table and the
+ * creation time from the time table, the super block locates both; free
+ * inodes are all zero. */
+static uint32_t const AUFS_COMPACT_TABLE_MAX = 65536;
+
+struct aufs_compact_inode {
+	uint32_t	aci_first;
+	uint32_t	aci_blocks;
+	uint32_t	aci_size;
+	uint16_t	aci_attr;
+	uint16_t	aci_time;
+};
+
+static inline uint32_t & ACI_FIRST_BLOCK(struct aufs_compact_inode *aci)
+{ return aci->aci_first; }
+
+static inline uint32_t & ACI_BLOCKS(struct aufs_compact_inode *aci)
+{ return aci->aci_blocks; }
+
+static inline uint32_t & ACI_SIZE(struct aufs_compact_inode *aci)
+{ return aci->aci_size; }
+
+static inline uint16_t & ACI_ATTR(struct aufs_compact_inode *aci)
+{ return aci->aci_attr; }
+
+static inline uint16_t & ACI_TIME(struct aufs_compact_inode *aci)
+{ return aci->aci_time; }
+
+/* an attribute table entry; the time table is plain 64-bit times */
+struct aufs_inode_attr {
+	uint32_t	aia_uid;
+	uint32_t	aia_gid;
+	uint32_t	aia_mode;
+	uint32_t	aia_reserved;
+};
+
+static inline uint32_t & AIA_UID(struct aufs_inode_attr *aia)
+{ return aia->aia_uid; }
+
+static inline uint32_t & AIA_GID(struct aufs_inode_attr *aia)
+{ return aia->aia_gid; }
+
+static inline uint32_t & AIA_MODE(struct aufs_inode_attr *aia)
+{ return aia->aia_mode; }
+
+static inline uint32_t AufsInodeSize(uint32_t features) noexcept
+{
+	if (features & AUFS_FEATURE_COMPACT_INODES)
+		return sizeof(struct aufs_compact_inode);
+	return sizeof(struct aufs_inode);
+}
+
+
+/* With AUFS_FEATURE_EXTENTS a regular file may keep its blocks in several
+ * runs. Its first block then has AUFS_EXTENT_LIST set and the rest of it
+ * is the block of the extent list: a header and the runs in file order.
+ * The inode blocks count only the data blocks, directories are always a
+ * single run. Runs are never kept in the inode itself: the inode has no
+ * room for them, so even a file of two runs takes a list block. */
+static uint32_t const AUFS_EXTENT_LIST = 0x80000000;
+
+struct aufs_extent_header {
+	uint32_t	aeh_count;
+	uint32_t	aeh_reserved;
+};
+
+struct aufs_extent {
+	uint32_t	ae_first;
+	uint32_t	ae_blocks;
+};
+
+static inline uint32_t & AEH_COUNT(struct aufs_extent_header *aeh)
+{ return aeh->aeh_count; }
+
+static inline uint32_t & AE_FIRST_BLOCK(struct aufs_extent *ae)
+{ return ae->ae_first; }
+
+static inline uint32_t & AE_BLOCKS(struct aufs_extent *ae)
+{ return ae->ae_blocks; }
+
+/* the most runs an extent list block holds */
+static inline uint32_t AufsExtentsMax(uint32_t block_size) noexcept
+{
+	return (block_size - sizeof(struct aufs_extent_header)) /
+		sizeof(struct aufs_extent);
+}
+
+
 struct aufs_dir_entry {
 	char 		ade_name[AUFS_NAME_MAXLEN];
 	uint32_t	ade_inode;
@@ -74,4 +214,121 @@ static inline char const * ADE_NAME(struct aufs_dir_entry const *ade)
 static inline char * ADE_NAME(struct aufs_dir_entry *ade)
 { return ade->ade_name; }
 
+/* With AUFS_COMPAT_DIR_TYPES names are at most AUFS_NAME_MAXLEN - 2 bytes
+ * and the last byte of the name field holds the DT_* type of the child,
+ * so readers unaware of it still see a null terminated name. Images
+ * without the flag always have 0 there, that is DT_UNKNOWN. */
+static inline uint8_t & ADE_TYPE(struct aufs_dir_entry *ade)
+{ return reinterpret_cast<uint8_t &>(ade->ade_name[AUFS_NAME_MAXLEN - 1]); }
+
+static inline uint8_t ADE_TYPE(struct aufs_dir_entry const *ade)
+{ return static_cast<uint8_t>(ade->ade_name[AUFS_NAME_MAXLEN - 1]); }
+
+
+/* With AUFS_FEATURE_DIR_RECORDS directories hold variable length records
+ * instead of aufs_dir_entry: this header, then the name, which is not null
+ * terminated, padded to a multiple of AUFS_REC_ALIGN bytes. Records never
+ * cross a block, a zero record length ends the records of a block. The
+ * directory size is the offset right past its last record, and readers
+ * use record offsets as entry positions. */
+static uint32_t const AUFS_REC_NAME_MAXLEN = 255;
+static uint32_t const AUFS_REC_ALIGN = 8;
+
+struct aufs_dir_rec {
+	uint32_t	adr_inode;
+	uint16_t	adr_rec_len;
+	uint8_t		adr_name_len;
+	uint8_t		adr_type;	/* as ADE_TYPE */
+};
+
+static inline uint32_t & ADR_INODE(struct aufs_dir_rec *adr)
+{ return adr->adr_inode; }
+
+static inline uint16_t & ADR_REC_LEN(struct aufs_dir_rec *adr)
+{ return adr->adr_rec_len; }
+
+static inline char const * ADR_NAME(struct aufs_dir_rec const *adr)
+{ return reinterpret_cast<char const *>(adr + 1); }
+
+static inline char * ADR_NAME(struct aufs_dir_rec *adr)
+{ return reinterpret_cast<char *>(adr + 1); }
+
+static inline uint32_t AufsRecLen(uint32_t name_len) noexcept
+{
+	return (sizeof(struct aufs_dir_rec) + name_len + AUFS_REC_ALIGN - 1) &
+			~(AUFS_REC_ALIGN - 1);
+}
+
+/* bytes taken by the entries of a directory of the given size */
+static inline uint64_t AufsDirEntryBytes(uint32_t size, uint32_t features)
+	noexcept
+{
+	if (features & AUFS_FEATURE_DIR_RECORDS)
+		return size;
+	return static_cast<uint64_t>(size) * sizeof(struct aufs_dir_entry);
+}
+
+/* the most names a directory of the given size can hold, the number its
+ * Bloom filter is sized for */
+static inline uint32_t AufsDirNamesMax(uint32_t size, uint32_t features)
+	noexcept
+{
+	if (features & AUFS_FEATURE_DIR_RECORDS)
+		return size / AufsRecLen(1);
+	return size;
+}
+
+
+/* The blocks of a directory past its entries are its tail. With
+ * AUFS_FEATURE_DIR_BLOOM a tail starts with a Bloom filter of the names,
+ * AufsBloomBytes(AufsDirNamesMax()) long and padded to whole blocks. With
+ * AUFS_FEATURE_DIR_INDEX the rest of the tail holds a hash table of
+ * slots, probed linearly from hash & (slots - 1); the table is the
+ * largest power of two slots that fits those blocks. */
+struct aufs_dir_slot {
+	uint32_t	ads_hash;
+	uint32_t	ads_pos;	/* entry position + 1, 0 if free */
+};
+
+static inline uint32_t & ADS_HASH(struct aufs_dir_slot *ads)
+{ return ads->ads_hash; }
+
+static inline uint32_t & ADS_POS(struct aufs_dir_slot *ads)
+{ return ads->ads_pos; }
+
+/* 32-bit FNV-1a, the kernel module computes the same */
+static inline uint32_t AufsNameHash(char const *name, size_t len) noexcept
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i != len; ++i)
+		hash = (hash ^ static_cast<uint8_t>(name[i])) * 16777619u;
+	return hash;
+}
+
+/* the filter has at least 16 bits per name and AUFS_BLOOM_HASHES bits
+ * set for each, at hash + i * AufsBloomStep(hash); bits are LSB first */
+static uint32_t const AUFS_BLOOM_HASHES = 8;
+
+static inline uint32_t AufsBloomBytes(uint32_t entries) noexcept
+{
+	uint32_t bytes = 64;
+
+	while (bytes < 2 * static_cast<uint64_t>(entries))
+		bytes *= 2;
+	return bytes;
+}
+
+static inline uint32_t AufsBloomStep(uint32_t hash) noexcept
+{ return (((hash >> 17) | (hash << 15)) * 0x9e3779b1u) | 1; }
+
+static inline uint32_t AufsIndexSlots(uint64_t bytes) noexcept
+{
+	uint64_t slots = bytes / sizeof(struct aufs_dir_slot);
+
+	while (slots & (slots - 1))
+		slots &= slots - 1;
+	return static_cast<uint32_t>(slots);
+}
+
 #endif /*__AUFS_HPP__*/
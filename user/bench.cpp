@@ -0,0 +1,380 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bit_iterator.hpp"
+#include "crc32c.hpp"
+#include "format.hpp"
+
+namespace
+{
+
+template <typename T>
+void DoNotOptimize(T const &value)
+{ __asm__ __volatile__("" : : "g"(&value) : "memory"); }
+
+class Bench {
+public:
+	using Setup = std::function<void ()>;
+	using Op = std::function<void (size_t)>;
+
+	explicit Bench(size_t warmup, size_t reps, std::string filter)
+		: m_warmup(warmup)
+		, m_reps(reps)
+		, m_filter(filter)
+	{ }
+
+	void Header() const
+	{
+		std::cout << std::left << std::setw(32) << "benchmark"
+			<< std::right << std::setw(14) << "ns/op"
+			<< std::setw(14) << "min ns/op"
+			<< std::setw(14) << "MB/s" << std::endl;
+	}
+
+	void Run(std::string const &name, size_t ops, size_t bytes,
+			Setup setup, Op op) const
+	{
+		if (name.find(m_filter) == std::string::npos)
+			return;
+
+		std::vector<double> samples;
+		for (size_t rep = 0; rep != m_warmup + m_reps; ++rep) {
+			setup();
+
+			auto const start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i != ops; ++i)
+				op(i);
+			auto const finish = std::chrono::steady_clock::now();
+
+			std::chrono::duration<double, std::nano> const elapsed =
+				finish - start;
+			if (rep >= m_warmup)
+				samples.push_back(elapsed.count() / ops);
+		}
+
+		std::sort(samples.begin(), samples.end());
+		double const median = samples[samples.size() / 2];
+
+		std::cout << std::left << std::setw(32) << name
+			<< std::right << std::fixed << std::setprecision(1)
+			<< std::setw(14) << median
+			<< std::setw(14) << samples.front()
+			<< std::setw(14);
+		if (bytes)
+			std::cout << bytes * 1e3 / median << std::endl;
+		else
+			std::cout << "-" << std::endl;
+	}
+
+private:
+	size_t		m_warmup;
+	size_t		m_reps;
+	std::string	m_filter;
+};
+
+class Image {
+public:
+	explicit Image(uint32_t block_size)
+		: m_path("/tmp/aufs-bench-XXXXXX")
+	{
+		int const fd = mkstemp(&m_path[0]);
+		if (fd < 0)
+			throw std::runtime_error("cannot create image");
+
+		off_t const size = static_cast<off_t>(block_size) *
+					block_size * 8;
+		int const ret = ftruncate(fd, size);
+		close(fd);
+		if (ret)
+			throw std::runtime_error("cannot resize image");
+
+		m_config = std::make_shared<Configuration>(m_path, "",
+					block_size * 8, block_size);
+	}
+
+	~Image()
+	{ unlink(m_path.c_str()); }
+
+	Image(Image const &) = delete;
+	Image & operator=(Image const &) = delete;
+
+	ConfigurationConstPtr Config() const noexcept
+	{ return m_config; }
+
+private:
+	std::string		m_path;
+	ConfigurationConstPtr	m_config;
+};
+
+void BenchBitmap(Bench const &bench, uint32_t block_size)
+{
+	std::vector<BitType> bitmap(block_size);
+	BitIterator const b(bitmap.data(), 0);
+	BitIterator const e(bitmap.data() + bitmap.size(), 0);
+
+	bench.Run("bitmap/find-set", 1000, block_size,
+		[&] {
+			std::fill(b, e, false);
+			*(e - 1) = true;
+		},
+		[&] (size_t) { DoNotOptimize(std::find(b, e, true)); });
+
+	bench.Run("bitmap/find-clear", 1000, block_size,
+		[&] {
+			std::fill(b, e, true);
+			*(e - 1) = false;
+		},
+		[&] (size_t) { DoNotOptimize(std::find(b, e, false)); });
+
+	bench.Run("bitmap/fill", 1000, block_size,
+		[] { },
+		[&] (size_t i) {
+			std::fill(b, e, (i & 1) != 0);
+			DoNotOptimize(bitmap.front());
+		});
+}
+
+template <uint32_t BlockSize>
+void BenchAllocateBlocks(Bench const &bench, ConfigurationConstPtr config)
+{
+	BlocksCache cache(config);
+	SuperBlock<BlockSize> super(cache);
+
+	BlockPtr const map = cache.GetBlock(1);
+	std::vector<uint8_t> const pristine(map->Data(),
+					map->Data() + map->Size());
+	std::vector<uint8_t> pattern;
+
+	BitIterator const b(map->Data(), 0);
+	size_t const first = 3 + config->InodeBlocks();
+	size_t const last = config->Blocks();
+	size_t const runs = 64;
+
+	auto const restore = [&] {
+		std::copy(pattern.begin(), pattern.end(), map->Data());
+	};
+
+	pattern = pristine;
+	bench.Run("alloc/blocks-empty", runs, 0, restore,
+		[&] (size_t) { DoNotOptimize(super.AllocateBlocks(1)); });
+
+	/* every other block is used, so no 2-block run exists in the first
+	 * half of the map and each allocation scans all of it */
+	std::copy(pristine.begin(), pristine.end(), map->Data());
+	for (size_t i = first; i < first + (last - first) / 2; i += 2)
+		b[i] = false;
+	pattern.assign(map->Data(), map->Data() + map->Size());
+	bench.Run("alloc/blocks-checkerboard", runs, 0, restore,
+		[&] (size_t) { DoNotOptimize(super.AllocateBlocks(2)); });
+
+	std::mt19937 rng(42);
+	std::copy(pristine.begin(), pristine.end(), map->Data());
+	for (size_t i = first; i < last; ++i)
+		b[i] = (rng() & 1) != 0;
+	pattern.assign(map->Data(), map->Data() + map->Size());
+	bench.Run("alloc/blocks-random", runs, 0, restore,
+		[&] (size_t) { DoNotOptimize(super.AllocateBlocks(4)); });
+
+	std::copy(pristine.begin(), pristine.end(), map->Data());
+}
+
+template <uint32_t BlockSize>
+void BenchAllocateInode(Bench const &bench, ConfigurationConstPtr config)
+{
+	BlocksCache cache(config);
+	SuperBlock<BlockSize> super(cache);
+
+	BlockPtr const map = cache.GetBlock(2);
+	std::vector<uint8_t> const pristine(map->Data(),
+					map->Data() + map->Size());
+	std::vector<uint8_t> pattern;
+
+	BitIterator const b(map->Data(), 0);
+	BitIterator const e(map->Data() + map->Size(), 0);
+	size_t const inodes = std::find(b + 1, e, false) - b;
+	size_t const allocs = std::min<size_t>(256, inodes / 2);
+
+	auto const restore = [&] {
+		std::copy(pattern.begin(), pattern.end(), map->Data());
+	};
+
+	pattern = pristine;
+	bench.Run("alloc/inode-empty", allocs, 0, restore,
+		[&] (size_t) { DoNotOptimize(super.AllocateInode()); });
+
+	std::copy(pristine.begin(), pristine.end(), map->Data());
+	std::fill(b, b + inodes - allocs, false);
+	pattern.assign(map->Data(), map->Data() + map->Size());
+	bench.Run("alloc/inode-full", allocs, 0, restore,
+		[&] (size_t) { DoNotOptimize(super.AllocateInode()); });
+
+	std::copy(pristine.begin(), pristine.end(), map->Data());
+}
+
+void BenchBlocksCache(Bench const &bench, ConfigurationConstPtr config)
+{
+	BlocksCache cache(config);
+	size_t const size = config->BlockSize();
+	size_t const blocks = config->Blocks();
+
+	bench.Run("cache/hit", 100000, size,
+		[&] { DoNotOptimize(cache.GetBlock(3)); },
+		[&] (size_t) { DoNotOptimize(cache.GetBlock(3)); });
+
+	size_t next = 0;
+	bench.Run("cache/miss", 2048, size,
+		[&] { cache.Sync(); },
+		[&] (size_t) {
+			DoNotOptimize(cache.GetBlock(next));
+			next = (next + 1) % blocks;
+		});
+}
+
+template <uint32_t BlockSize>
+void BenchInode(Bench const &bench, ConfigurationConstPtr config)
+{
+	BlocksCache cache(config);
+	Inode<BlockSize> inode(cache, 1);
+	size_t const size = sizeof(struct aufs_inode);
+
+	bench.Run("inode/get", 1000000, size, [] { },
+		[&] (size_t) {
+			DoNotOptimize(inode.FirstBlock());
+			DoNotOptimize(inode.BlocksCount());
+			DoNotOptimize(inode.Size());
+			DoNotOptimize(inode.Gid());
+			DoNotOptimize(inode.Uid());
+			DoNotOptimize(inode.Mode());
+			DoNotOptimize(inode.CreateTime());
+		});
+
+	bench.Run("inode/set", 1000000, size, [] { },
+		[&] (size_t i) {
+			uint32_t const value = static_cast<uint32_t>(i);
+
+			inode.SetFirstBlock(value);
+			inode.SetBlocksCount(value);
+			inode.SetSize(value);
+			inode.SetGid(value);
+			inode.SetUid(value);
+			inode.SetMode(value);
+		});
+
+	BlockPtr const block = cache.GetBlock(Layout<BlockSize>::InodeBlock(1));
+	std::vector<struct aufs_inode> inodes(
+				Layout<BlockSize>::InodesPerBlock);
+
+	bench.Run("inode/decode-block", 100000, BlockSize, [] { },
+		[&] (size_t) {
+			DecodeInodeBlock<BlockSize>(block->Data(),
+						inodes.data());
+			DoNotOptimize(inodes.front());
+		});
+}
+
+void BenchChecksum(Bench const &bench, uint32_t block_size)
+{
+	std::vector<uint8_t> block(block_size);
+	std::mt19937 rand(42);
+
+	for (uint8_t &byte : block)
+		byte = static_cast<uint8_t>(rand());
+
+	bench.Run("crc32c/block", 100000, block_size, [] { },
+		[&] (size_t) {
+			DoNotOptimize(Crc32c(0, block.data(), block.size()));
+		});
+
+	bench.Run("crc32c/block-portable", 100000, block_size, [] { },
+		[&] (size_t) {
+			DoNotOptimize(Crc32cPortable(0, block.data(),
+						block.size()));
+		});
+}
+
+struct RunBenchmarks {
+	Bench const &		m_bench;
+	ConfigurationConstPtr	m_config;
+
+	template <uint32_t BlockSize>
+	void Run() const
+	{
+		BenchBitmap(m_bench, BlockSize);
+		BenchAllocateBlocks<BlockSize>(m_bench, m_config);
+		BenchAllocateInode<BlockSize>(m_bench, m_config);
+		BenchBlocksCache(m_bench, m_config);
+		BenchInode<BlockSize>(m_bench, m_config);
+		BenchChecksum(m_bench, BlockSize);
+	}
+};
+
+void PrintHelp()
+{
+	std::cout << "Usage:" << std::endl
+		<< "\taufs-bench [(--block_size | -s) SIZE] [(--repetitions | -r) REPS] [(--warmup | -w) WARMUP] [FILTER]"
+		<< std::endl << std::endl
+		<< "Where:" << std::endl
+		<< "\tSIZE    - block size. Default is 4096 bytes." << std::endl
+		<< "\tREPS    - measured repetitions per benchmark. Default is 10." << std::endl
+		<< "\tWARMUP  - discarded repetitions per benchmark. Default is 2." << std::endl
+		<< "\tFILTER  - run only benchmarks whose name contains FILTER." << std::endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t block_size = 4096u;
+	size_t reps = 10, warmup = 2;
+	std::string filter;
+
+	--argc;
+	++argv;
+	while (argc--) {
+		std::string const arg(*argv++);
+		if ((arg == "--block_size" || arg == "-s") && argc) {
+			block_size = std::stoi(*argv++);
+			--argc;
+		} else if ((arg == "--repetitions" || arg == "-r") && argc) {
+			reps = std::stoi(*argv++);
+			--argc;
+		} else if ((arg == "--warmup" || arg == "-w") && argc) {
+			warmup = std::stoi(*argv++);
+			--argc;
+		} else if (arg == "--help" || arg == "-h") {
+			PrintHelp();
+			return 0;
+		} else {
+			filter = arg;
+		}
+	}
+
+	try {
+		if (!reps)
+			throw std::runtime_error("Wrong number of repetitions");
+
+		Bench const bench(warmup, reps, filter);
+		Image const image(block_size);
+
+		bench.Header();
+		DispatchBlockSize(block_size,
+			RunBenchmarks{bench, image.Config()});
+
+		return 0;
+	} catch (std::exception const & e) {
+		std::cout << "ERROR: " << e.what() << std::endl;
+		PrintHelp();
+	}
+
+	return 1;
+}
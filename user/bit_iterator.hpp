@@ -39,22 +39,24 @@ struct BitReference {
 	{ *m_word ^= m_mask; }
 };
 
-bool operator==(BitReference const & l, BitReference const & r) noexcept
+inline bool operator==(BitReference const & l,
+		BitReference const & r) noexcept
 { return bool(l) == bool(r); }
 
-bool operator==(BitReference const & l, bool r) noexcept
+inline bool operator==(BitReference const & l, bool r) noexcept
 { return bool(l) == r; }
 
-bool operator==(bool l, BitReference const & r) noexcept
+inline bool operator==(bool l, BitReference const & r) noexcept
 { return r == l; }
 
-bool operator!=(BitReference const & l, BitReference const & r) noexcept
+inline bool operator!=(BitReference const & l,
+		BitReference const & r) noexcept
 { return !(l == r); }
 
-bool operator!=(BitReference const & l, bool r) noexcept
+inline bool operator!=(BitReference const & l, bool r) noexcept
 { return !(l == r); }
 
-bool operator!=(bool l, BitReference const & r) noexcept
+inline bool operator!=(bool l, BitReference const & r) noexcept
 { return !(l == r); }
 
 struct BitIteratorBase
@@ -85,12 +87,13 @@ struct BitIteratorBase
 
 	void advance(ptrdiff_t d) noexcept
 	{
+		ptrdiff_t const bits = Bits;
 		ptrdiff_t n = m_offset + d;
-		m_data += n / Bits;
-		n = n % Bits;
+		m_data += n / bits;
+		n = n % bits;
 
 		if (n < 0) {
-			n += Bits;
+			n += bits;
 			--m_data;
 		}
 
@@ -119,7 +122,8 @@ struct BitIteratorBase
 	{ return !(*this < it); }
 };
 
-ptrdiff_t operator-(BitIteratorBase const & l, BitIteratorBase const & r) noexcept
+inline ptrdiff_t operator-(BitIteratorBase const & l,
+		BitIteratorBase const & r) noexcept
 { return Bits * (l.m_data - r.m_data) + l.m_offset - r.m_offset; }
 
 struct BitIterator : public BitIteratorBase
@@ -193,7 +197,7 @@ struct BitIterator : public BitIteratorBase
 	{ return *(*this + d); }
 };
 
-BitIterator operator+(ptrdiff_t d, BitIterator const & it) noexcept
+inline BitIterator operator+(ptrdiff_t d, BitIterator const & it) noexcept
 { return it + d; }
 
 struct BitConstIterator : public BitIteratorBase
@@ -269,7 +273,8 @@ struct BitConstIterator : public BitIteratorBase
 	{ return *(*this + d); }
 };
 
-BitConstIterator operator+(ptrdiff_t d, BitConstIterator const & it) noexcept
+inline BitConstIterator operator+(ptrdiff_t d,
+		BitConstIterator const & it) noexcept
 { return it + d; }
 
 #endif /*__BIT_ITERATOR_HPP__*/
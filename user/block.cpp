@@ -1,10 +1,12 @@
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
 
 #include "block.hpp"
 
-BlocksCache::BlocksCache(ConfigurationConstPtr config)
+BlocksCache::BlocksCache(ConfigurationConstPtr config, bool readonly)
 	: m_config(config)
+	, m_readonly(readonly)
 { }
 
 BlocksCache::~BlocksCache()
@@ -42,13 +44,16 @@ BlockPtr BlocksCache::GetBlock(size_t no)
 
 void BlocksCache::Sync()
 {
-	std::fstream out(Config()->Device().c_str(),
-		std::ios::out | std::ios::in | std::ios::binary);
+	std::fstream out;
+	if (!m_readonly)
+		out.open(Config()->Device().c_str(),
+			std::ios::out | std::ios::in | std::ios::binary);
 
 	std::map<size_t, BlockPtr>::iterator it(std::begin(m_cache));
 	std::map<size_t, BlockPtr>::iterator const e(std::end(m_cache));
 	while (it != e) {
-		WriteBlock(out, it->second);
+		if (!m_readonly)
+			WriteBlock(out, it->second);
 		if (it->second.unique())
 			it = m_cache.erase(it);
 		else
@@ -56,6 +61,17 @@ void BlocksCache::Sync()
 	}
 }
 
+void BlocksCache::ReadBlocks(size_t first, size_t count, uint8_t *data) const
+{
+	size_t const size = Config()->BlockSize();
+	std::ifstream in(Config()->Device().c_str(),
+		std::ios::in | std::ios::binary);
+
+	in.seekg(first * size);
+	if (!in.read(reinterpret_cast<char *>(data), count * size))
+		throw std::runtime_error("Cannot read blocks from device");
+}
+
 BlockPtr BlocksCache::ReadBlock(std::istream &in, size_t no)
 {
 	BlockPtr block = std::make_shared<Block>(Config(), no);
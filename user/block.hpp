@@ -1,6 +1,7 @@
 #ifndef __BLOCK_HPP__
 #define __BLOCK_HPP__
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <istream>
@@ -17,12 +18,24 @@ public:
 	explicit Configuration(std::string device,
 			std::string dir,
 			uint32_t blocks,
-			uint32_t block_size) noexcept
+			uint32_t block_size,
+			bool checksums = false,
+			uint32_t index_threshold = 0,
+			uint32_t bloom_threshold = 0,
+			bool compact_inodes = false,
+			bool extents = false,
+			uint32_t max_run = 0) noexcept
 		: m_device(device)
 		, m_dir(dir)
 		, m_device_blocks(blocks)
 		, m_block_size(block_size)
+		, m_compact_inodes(compact_inodes)
+		, m_extents(extents || max_run)
+		, m_max_run(max_run)
 		, m_inode_blocks(CountInodeBlocks())
+		, m_csum_blocks(checksums ? CountChecksumBlocks() : 0)
+		, m_index_threshold(index_threshold)
+		, m_bloom_threshold(bloom_threshold)
 	{ }
 
 	std::string const & Device() const noexcept
@@ -40,6 +53,51 @@ public:
 	uint32_t BlockSize() const noexcept
 	{ return m_block_size; }
 
+	/* the checksum table follows the inode table, zero if disabled */
+	uint32_t ChecksumBlocks() const noexcept
+	{ return m_csum_blocks; }
+
+	/* directories with at least that many entries get a hash index,
+	 * zero if disabled */
+	uint32_t IndexThreshold() const noexcept
+	{ return m_index_threshold; }
+
+	/* directories with at least that many entries, or with an index,
+	 * get a Bloom filter of their names; zero if disabled */
+	uint32_t BloomThreshold() const noexcept
+	{ return m_bloom_threshold; }
+
+	/* the inode table holds aufs_compact_inode, owners, modes and times
+	 * go to the shared tables */
+	bool CompactInodes() const noexcept
+	{ return m_compact_inodes; }
+
+	/* files that find no free run large enough are split over several,
+	 * rather than failing to allocate */
+	bool Extents() const noexcept
+	{ return m_extents; }
+
+	/* no run of a file is longer than that, zero if unlimited; larger
+	 * files are split on purpose, which images that have free space
+	 * never need, so the multi-run paths of the readers can be tried */
+	uint32_t MaxRun() const noexcept
+	{ return m_max_run; }
+
+	/* mkfs always stores the child types in directory entries */
+	uint32_t CompatFeatures() const noexcept
+	{ return AUFS_COMPAT_DIR_TYPES; }
+
+	/* mkfs always writes directory records sorted by name */
+	uint32_t Features() const noexcept
+	{
+		return AUFS_FEATURE_SORTED_DIRS | AUFS_FEATURE_DIR_RECORDS |
+			(m_csum_blocks ? AUFS_FEATURE_CSUM : 0) |
+			(m_index_threshold ? AUFS_FEATURE_DIR_INDEX : 0) |
+			(m_bloom_threshold ? AUFS_FEATURE_DIR_BLOOM : 0) |
+			(m_compact_inodes ? AUFS_FEATURE_COMPACT_INODES : 0) |
+			(m_extents ? AUFS_FEATURE_EXTENTS : 0);
+	}
+
 private:
 	uint32_t CountInodeBlocks() const noexcept
 	{
@@ -47,17 +105,32 @@ private:
 
 		uint32_t const bytes = Blocks() * BlockSize();
 		uint32_t const inodes = bytes / BytesPerInode;
-		uint32_t const in_block = BlockSize() /
-						sizeof(struct aufs_inode);
+		uint32_t const in_block = BlockSize() / (m_compact_inodes ?
+					sizeof(struct aufs_compact_inode) :
+					sizeof(struct aufs_inode));
 
 		return (inodes + in_block - 1) / in_block;
 	}
 
+	uint32_t CountChecksumBlocks() const noexcept
+	{
+		uint32_t const blocks = std::min(Blocks(), BlockSize() * 8);
+		uint32_t const in_block = BlockSize() / sizeof(uint32_t);
+
+		return (blocks + in_block - 1) / in_block;
+	}
+
 	std::string	m_device;
 	std::string	m_dir;
 	uint32_t	m_device_blocks;
 	uint32_t	m_block_size;
+	bool		m_compact_inodes;
+	bool		m_extents;
+	uint32_t	m_max_run;
 	uint32_t	m_inode_blocks;
+	uint32_t	m_csum_blocks;
+	uint32_t	m_index_threshold;
+	uint32_t	m_bloom_threshold;
 };
 
 using ConfigurationPtr = std::shared_ptr<Configuration>;
@@ -108,13 +181,18 @@ using BlockConstPtr = std::shared_ptr<Block const>;
 
 class BlocksCache {
 public:
-	explicit BlocksCache(ConfigurationConstPtr config);
+	explicit BlocksCache(ConfigurationConstPtr config,
+			bool readonly = false);
 	~BlocksCache();
 
 	ConfigurationConstPtr Config() const noexcept;
 	BlockPtr GetBlock(size_t no);
 	void Sync();
 
+	/* reads count blocks starting at first straight from the device in
+	 * one request, bypassing the cache; safe to call from many threads */
+	void ReadBlocks(size_t first, size_t count, uint8_t *data) const;
+
 	BlocksCache(BlocksCache &&) = delete;
 	BlocksCache & operator=(BlocksCache &&) = delete;
 
@@ -127,6 +205,7 @@ private:
 
 	ConfigurationConstPtr		m_config;
 	std::map<size_t, BlockPtr>	m_cache;
+	bool				m_readonly;
 };
 
 #endif /*__BLOCK_HPP__*/
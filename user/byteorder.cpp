@@ -0,0 +1,35 @@
+#include "byteorder.hpp"
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 6)
+#define AUFS_TARGET_CLONES \
+	__attribute__((target_clones("default", "ssse3", "avx2")))
+#else
+#define AUFS_TARGET_CLONES
+#endif
+
+namespace
+{
+
+AUFS_TARGET_CLONES
+void SwapWords(uint32_t *words, size_t count) noexcept
+{
+	static size_t const Chunk = 8;
+	size_t i = 0;
+
+	/* the fixed-size inner loop is what lets the compiler turn this
+	 * into pshufb at -O2 */
+	for ( ; i + Chunk <= count; i += Chunk)
+		for (size_t j = 0; j != Chunk; ++j)
+			words[i + j] = __builtin_bswap32(words[i + j]);
+
+	for ( ; i != count; ++i)
+		words[i] = __builtin_bswap32(words[i]);
+}
+
+}
+
+void FromDiskWords(uint32_t *words, size_t count) noexcept
+{
+	if (!HostIsDiskOrder)
+		SwapWords(words, count);
+}
@@ -0,0 +1,40 @@
+#ifndef __BYTEORDER_HPP__
+#define __BYTEORDER_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+/* aufs keeps everything on disk in big-endian byte order; the host byte
+ * order is known at compile time, so conversions either vanish or become
+ * a single bswap */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static bool const HostIsDiskOrder = true;
+#else
+static bool const HostIsDiskOrder = false;
+#endif
+
+static inline uint16_t ToDisk16(uint16_t v) noexcept
+{ return HostIsDiskOrder ? v : __builtin_bswap16(v); }
+
+static inline uint16_t FromDisk16(uint16_t v) noexcept
+{ return ToDisk16(v); }
+
+static inline uint32_t ToDisk32(uint32_t v) noexcept
+{ return HostIsDiskOrder ? v : __builtin_bswap32(v); }
+
+static inline uint32_t FromDisk32(uint32_t v) noexcept
+{ return ToDisk32(v); }
+
+static inline uint64_t ToDisk64(uint64_t v) noexcept
+{ return HostIsDiskOrder ? v : __builtin_bswap64(v); }
+
+static inline uint64_t FromDisk64(uint64_t v) noexcept
+{ return ToDisk64(v); }
+
+/* converts count 32-bit words in place, vectorized where the CPU allows */
+void FromDiskWords(uint32_t *words, size_t count) noexcept;
+
+static inline void ToDiskWords(uint32_t *words, size_t count) noexcept
+{ FromDiskWords(words, count); }
+
+#endif /*__BYTEORDER_HPP__*/
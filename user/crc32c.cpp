@@ -0,0 +1,225 @@
+#include <cstring>
+
+#include "crc32c.hpp"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+
+uint32_t const Poly = 0x82f63b78u;
+
+/* lengths of the interleaved streams, both must be powers of two; three
+ * long streams cover most of a 4K block, short ones pick up the rest */
+size_t const LongLen = 1024;
+size_t const ShortLen = 128;
+
+uint32_t Gf2MatrixTimes(uint32_t const *mat, uint32_t vec) noexcept
+{
+	uint32_t sum = 0;
+
+	for (; vec; vec >>= 1, ++mat)
+		if (vec & 1)
+			sum ^= *mat;
+	return sum;
+}
+
+void Gf2MatrixSquare(uint32_t *square, uint32_t const *mat) noexcept
+{
+	for (int n = 0; n != 32; ++n)
+		square[n] = Gf2MatrixTimes(mat, mat[n]);
+}
+
+/* operator that feeds len (a power of two) zero bytes through the crc */
+void ZerosOperator(uint32_t *even, size_t len) noexcept
+{
+	uint32_t odd[32];
+	uint32_t row = 1;
+
+	odd[0] = Poly;
+	for (int n = 1; n != 32; ++n, row <<= 1)
+		odd[n] = row;
+
+	Gf2MatrixSquare(even, odd);	/* two zero bits */
+	Gf2MatrixSquare(odd, even);	/* four zero bits */
+	for (;;) {
+		Gf2MatrixSquare(even, odd);
+		len >>= 1;
+		if (!len)
+			return;
+		Gf2MatrixSquare(odd, even);
+		len >>= 1;
+		if (!len)
+			break;
+	}
+	memcpy(even, odd, sizeof(odd));
+}
+
+struct Tables {
+	uint32_t	m_slice[8][256];
+	uint32_t	m_long[4][256];
+	uint32_t	m_short[4][256];
+
+	Tables() noexcept
+	{
+		for (uint32_t n = 0; n != 256; ++n) {
+			uint32_t crc = n;
+
+			for (int k = 0; k != 8; ++k)
+				crc = crc & 1 ? (crc >> 1) ^ Poly : crc >> 1;
+			m_slice[0][n] = crc;
+		}
+
+		for (uint32_t n = 0; n != 256; ++n) {
+			uint32_t crc = m_slice[0][n];
+
+			for (int k = 1; k != 8; ++k) {
+				crc = m_slice[0][crc & 0xff] ^ (crc >> 8);
+				m_slice[k][n] = crc;
+			}
+		}
+
+		FillShift(m_long, LongLen);
+		FillShift(m_short, ShortLen);
+	}
+
+	static void FillShift(uint32_t (&table)[4][256], size_t len) noexcept
+	{
+		uint32_t op[32];
+
+		ZerosOperator(op, len);
+		for (uint32_t n = 0; n != 256; ++n) {
+			table[0][n] = Gf2MatrixTimes(op, n);
+			table[1][n] = Gf2MatrixTimes(op, n << 8);
+			table[2][n] = Gf2MatrixTimes(op, n << 16);
+			table[3][n] = Gf2MatrixTimes(op, n << 24);
+		}
+	}
+
+	static uint32_t Shift(uint32_t const (&table)[4][256], uint32_t crc)
+		noexcept
+	{
+		return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+			table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+	}
+};
+
+Tables const &GetTables() noexcept
+{
+	static Tables const tables;
+	return tables;
+}
+
+/* the crc is bit-reflected, so words are consumed in little-endian order */
+uint64_t Load64(uint8_t const *p) noexcept
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+/* slicing-by-8 */
+uint32_t SoftwareCrc(uint32_t crc, uint8_t const *p, size_t size) noexcept
+{
+	Tables const &t = GetTables();
+
+	for (; size >= 8; size -= 8, p += 8) {
+		uint64_t const v = Load64(p) ^ crc;
+
+		crc = t.m_slice[7][v & 0xff] ^
+			t.m_slice[6][(v >> 8) & 0xff] ^
+			t.m_slice[5][(v >> 16) & 0xff] ^
+			t.m_slice[4][(v >> 24) & 0xff] ^
+			t.m_slice[3][(v >> 32) & 0xff] ^
+			t.m_slice[2][(v >> 40) & 0xff] ^
+			t.m_slice[1][(v >> 48) & 0xff] ^
+			t.m_slice[0][v >> 56];
+	}
+
+	for (; size; --size, ++p)
+		crc = t.m_slice[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+uint32_t HardwareCrcRun(uint32_t crc, uint8_t const *p, size_t size)
+	noexcept
+{
+	uint64_t crc64 = crc;
+
+	for (; size >= 8; size -= 8, p += 8)
+		crc64 = _mm_crc32_u64(crc64, Load64(p));
+	crc = static_cast<uint32_t>(crc64);
+	for (; size; --size, ++p)
+		crc = _mm_crc32_u8(crc, *p);
+	return crc;
+}
+
+/* crc32 has a latency of three cycles but a throughput of one, so three
+ * independent streams keep the unit busy; the partial results are then
+ * combined by shifting them over the bytes that follow */
+template <size_t Len>
+__attribute__((target("sse4.2")))
+uint32_t HardwareCrcStreams(uint32_t crc, uint8_t const *&p, size_t &size,
+			uint32_t const (&shift)[4][256]) noexcept
+{
+	while (size >= 3 * Len) {
+		uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+		uint8_t const *const end = p + Len;
+
+		for (; p != end; p += 8) {
+			crc0 = _mm_crc32_u64(crc0, Load64(p));
+			crc1 = _mm_crc32_u64(crc1, Load64(p + Len));
+			crc2 = _mm_crc32_u64(crc2, Load64(p + 2 * Len));
+		}
+
+		crc = Tables::Shift(shift, static_cast<uint32_t>(crc0)) ^
+			static_cast<uint32_t>(crc1);
+		crc = Tables::Shift(shift, crc) ^ static_cast<uint32_t>(crc2);
+		p += 2 * Len;
+		size -= 3 * Len;
+	}
+	return crc;
+}
+
+uint32_t HardwareCrc(uint32_t crc, uint8_t const *p, size_t size) noexcept
+{
+	Tables const &t = GetTables();
+
+	crc = HardwareCrcStreams<LongLen>(crc, p, size, t.m_long);
+	crc = HardwareCrcStreams<ShortLen>(crc, p, size, t.m_short);
+	return HardwareCrcRun(crc, p, size);
+}
+
+bool HaveSse42() noexcept
+{
+	static bool const have = __builtin_cpu_supports("sse4.2");
+	return have;
+}
+
+#endif
+
+}
+
+uint32_t Crc32cPortable(uint32_t crc, void const *data, size_t size)
+	noexcept
+{
+	return ~SoftwareCrc(~crc, static_cast<uint8_t const *>(data), size);
+}
+
+uint32_t Crc32c(uint32_t crc, void const *data, size_t size) noexcept
+{
+#if defined(__x86_64__)
+	if (HaveSse42())
+		return ~HardwareCrc(~crc,
+				static_cast<uint8_t const *>(data), size);
+#endif
+	return Crc32cPortable(crc, data, size);
+}
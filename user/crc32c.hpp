@@ -0,0 +1,16 @@
+#ifndef __CRC32C_HPP__
+#define __CRC32C_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+/* CRC32C (Castagnoli) of size bytes at data. Pass 0 as crc to start a new
+ * checksum, or a previous result to continue it over the next buffer. The
+ * value matches ~crc32c(~0, data, size) of the Linux kernel. SSE4.2 is used
+ * when the CPU has it, a slicing-by-8 table implementation otherwise. */
+uint32_t Crc32c(uint32_t crc, void const *data, size_t size) noexcept;
+
+/* the portable implementation, exposed for testing and benchmarking */
+uint32_t Crc32cPortable(uint32_t crc, void const *data, size_t size) noexcept;
+
+#endif /*__CRC32C_HPP__*/
@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/aio_abi.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+
+std::string ErrnoMessage(std::string const &what, std::string const &path)
+{ return what + " " + path + ": " + strerror(errno); }
+
+class File {
+public:
+	File(std::string const &path, bool direct)
+		: m_path(path)
+		, m_fd(open(path.c_str(), O_RDONLY | (direct ? O_DIRECT : 0)))
+	{
+		if (m_fd < 0)
+			throw std::runtime_error(ErrnoMessage("Cannot open", path));
+	}
+
+	~File()
+	{ close(m_fd); }
+
+	File(File const &) = delete;
+	File & operator=(File const &) = delete;
+
+	int Fd() const noexcept
+	{ return m_fd; }
+
+	std::string const & Path() const noexcept
+	{ return m_path; }
+
+	uint64_t Size() const
+	{
+		struct stat st;
+
+		if (fstat(m_fd, &st))
+			throw std::runtime_error(ErrnoMessage("Cannot stat",
+						m_path));
+		return st.st_size;
+	}
+
+	/* so that buffered passes start cold as well */
+	void DropCache() const noexcept
+	{ posix_fadvise(m_fd, 0, 0, POSIX_FADV_DONTNEED); }
+
+private:
+	std::string	m_path;
+	int		m_fd;
+};
+
+/* O_DIRECT buffers must be aligned to the logical block size of the
+ * device, a page covers any of them */
+class Buffer {
+public:
+	explicit Buffer(size_t size)
+		: m_data(nullptr)
+	{
+		if (posix_memalign(&m_data, 4096, size))
+			throw std::runtime_error("Cannot allocate buffer");
+	}
+
+	~Buffer()
+	{ free(m_data); }
+
+	Buffer(Buffer const &) = delete;
+	Buffer & operator=(Buffer const &) = delete;
+
+	char * Data() const noexcept
+	{ return static_cast<char *>(m_data); }
+
+private:
+	void	*m_data;
+};
+
+/* native AIO through the raw system calls, so there is no libaio
+ * dependency */
+class AioContext {
+public:
+	explicit AioContext(unsigned depth)
+		: m_ctx(0)
+	{
+		if (syscall(SYS_io_setup, depth, &m_ctx))
+			throw std::runtime_error(ErrnoMessage("Cannot set up",
+						"AIO context"));
+	}
+
+	~AioContext()
+	{ syscall(SYS_io_destroy, m_ctx); }
+
+	AioContext(AioContext const &) = delete;
+	AioContext & operator=(AioContext const &) = delete;
+
+	void Submit(struct iocb *cb)
+	{
+		long ret;
+
+		do {
+			ret = syscall(SYS_io_submit, m_ctx, 1, &cb);
+		} while (ret < 0 && errno == EINTR);
+		if (ret != 1)
+			throw std::runtime_error(ErrnoMessage("Cannot submit",
+						"AIO read"));
+	}
+
+	size_t Wait(struct io_event *events, size_t min, size_t max)
+	{
+		long ret;
+
+		do {
+			ret = syscall(SYS_io_getevents, m_ctx, min, max, events,
+					nullptr);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0)
+			throw std::runtime_error(ErrnoMessage("Cannot reap",
+						"AIO reads"));
+		return ret;
+	}
+
+private:
+	aio_context_t	m_ctx;
+};
+
+/* offsets of all the requests of one pass over a file, shuffled with a
+ * fixed seed for random passes so every run reads the same sequence */
+std::vector<uint64_t> Offsets(uint64_t size, size_t request, bool random)
+{
+	std::vector<uint64_t> offsets;
+
+	for (uint64_t off = 0; off < size; off += request)
+		offsets.push_back(off);
+	if (random)
+		std::shuffle(offsets.begin(), offsets.end(),
+				std::mt19937_64(42));
+	return offsets;
+}
+
+uint64_t ReadSync(File const &file, std::vector<uint64_t> const &offsets,
+			size_t request)
+{
+	Buffer const buffer(request);
+	uint64_t bytes = 0;
+
+	for (uint64_t off : offsets) {
+		ssize_t const ret = pread(file.Fd(), buffer.Data(), request, off);
+
+		if (ret < 0)
+			throw std::runtime_error(ErrnoMessage("Cannot read",
+						file.Path()));
+		bytes += ret;
+	}
+	return bytes;
+}
+
+/* keeps depth reads in flight, each completion submits the next one */
+uint64_t ReadAio(File const &file, std::vector<uint64_t> const &offsets,
+			size_t request, unsigned depth)
+{
+	AioContext aio(depth);
+	std::vector<struct iocb> cbs(depth);
+	std::vector<struct io_event> events(depth);
+	Buffer const buffer(request * depth);
+	size_t next = 0, inflight = 0;
+	uint64_t bytes = 0;
+
+	auto const submit = [&] (size_t slot) {
+		struct iocb &cb = cbs[slot];
+
+		memset(&cb, 0, sizeof(cb));
+		cb.aio_data = slot;
+		cb.aio_lio_opcode = IOCB_CMD_PREAD;
+		cb.aio_fildes = file.Fd();
+		cb.aio_buf = reinterpret_cast<uintptr_t>(buffer.Data() +
+					slot * request);
+		cb.aio_nbytes = request;
+		cb.aio_offset = offsets[next++];
+		aio.Submit(&cb);
+		++inflight;
+	};
+
+	for (size_t slot = 0; slot != depth && next != offsets.size(); ++slot)
+		submit(slot);
+
+	while (inflight) {
+		size_t const done = aio.Wait(events.data(), 1, depth);
+
+		for (size_t i = 0; i != done; ++i) {
+			if (events[i].res < 0) {
+				errno = -events[i].res;
+				throw std::runtime_error(ErrnoMessage(
+						"Cannot read", file.Path()));
+			}
+			bytes += events[i].res;
+			--inflight;
+			if (next != offsets.size())
+				submit(events[i].data);
+		}
+	}
+	return bytes;
+}
+
+struct Options {
+	size_t		m_request;
+	unsigned	m_depth;
+	size_t		m_reps;
+	std::string	m_label;
+};
+
+/* prints one JSON line with the median of the repetitions */
+void Measure(Options const &options, File const &file, char const *test,
+		bool random, unsigned depth)
+{
+	std::vector<uint64_t> const offsets = Offsets(file.Size(),
+				options.m_request, random);
+	std::vector<double> seconds;
+	uint64_t bytes = 0;
+
+	for (size_t rep = 0; rep != options.m_reps; ++rep) {
+		file.DropCache();
+
+		auto const start = std::chrono::steady_clock::now();
+		bytes = depth ? ReadAio(file, offsets, options.m_request, depth)
+			: ReadSync(file, offsets, options.m_request);
+		auto const finish = std::chrono::steady_clock::now();
+
+		std::chrono::duration<double> const elapsed = finish - start;
+		seconds.push_back(elapsed.count());
+	}
+
+	std::sort(seconds.begin(), seconds.end());
+	double const median = seconds[seconds.size() / 2];
+
+	std::cout << "{\"fs\":\"" << options.m_label
+		<< "\",\"test\":\"" << test
+		<< "\",\"file\":\"" << file.Path()
+		<< "\",\"request\":" << options.m_request
+		<< ",\"depth\":" << std::max(depth, 1u)
+		<< ",\"bytes\":" << bytes
+		<< ",\"seconds\":" << median
+		<< ",\"iops\":" << offsets.size() / median
+		<< ",\"mb_per_s\":" << bytes / median / 1e6 << "}"
+		<< std::endl;
+}
+
+void Run(Options const &options, std::string const &path)
+{
+	File const buffered(path, false);
+	File const direct(path, true);
+
+	Measure(options, buffered, "buffered-seq", false, 0);
+	Measure(options, direct, "direct-seq", false, 0);
+	Measure(options, direct, "direct-rand", true, 0);
+	Measure(options, direct, "direct-aio-seq", false, options.m_depth);
+	Measure(options, direct, "direct-aio-rand", true, options.m_depth);
+}
+
+void PrintHelp()
+{
+	std::cout << "Usage:" << std::endl
+		<< "\taufs-dio-bench [(--request | -s) SIZE] [(--depth | -d) DEPTH] [(--repetitions | -r) REPS] [(--label | -l) LABEL] FILE..."
+		<< std::endl << std::endl
+		<< "Where:" << std::endl
+		<< "\tSIZE    - bytes per read, a multiple of the device block size. Default is 131072." << std::endl
+		<< "\tDEPTH   - AIO reads kept in flight. Default is 32." << std::endl
+		<< "\tREPS    - passes per test, the median is reported. Default is 3." << std::endl
+		<< "\tLABEL   - \"fs\" field of the report, to tell runs apart. Default is aufs." << std::endl
+		<< "\tFILE    - files on a mounted aufs to read." << std::endl
+		<< std::endl
+		<< "Buffered and direct passes are run over every file, direct ones" << std::endl
+		<< "sequentially and in random order, synchronously and with AIO." << std::endl
+		<< "Compare the kernel module builds by running it with each loaded." << std::endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	Options options = { 128u << 10, 32, 3, "aufs" };
+	std::vector<std::string> paths;
+
+	--argc;
+	++argv;
+	while (argc--) {
+		std::string const arg(*argv++);
+		if ((arg == "--request" || arg == "-s") && argc) {
+			options.m_request = std::stoul(*argv++);
+			--argc;
+		} else if ((arg == "--depth" || arg == "-d") && argc) {
+			options.m_depth = std::stoi(*argv++);
+			--argc;
+		} else if ((arg == "--repetitions" || arg == "-r") && argc) {
+			options.m_reps = std::stoi(*argv++);
+			--argc;
+		} else if ((arg == "--label" || arg == "-l") && argc) {
+			options.m_label = *argv++;
+			--argc;
+		} else if (arg == "--help" || arg == "-h") {
+			PrintHelp();
+			return 0;
+		} else {
+			paths.push_back(arg);
+		}
+	}
+
+	try {
+		if (paths.empty())
+			throw std::runtime_error("File name expected");
+		if (!options.m_request || options.m_request % 512)
+			throw std::runtime_error("Wrong request size");
+		if (!options.m_depth)
+			throw std::runtime_error("Wrong queue depth");
+		if (!options.m_reps)
+			throw std::runtime_error("Wrong number of repetitions");
+
+		for (std::string const &path : paths)
+			Run(options, path);
+
+		return 0;
+	} catch (std::exception const & e) {
+		std::cout << "ERROR: " << e.what() << std::endl;
+		PrintHelp();
+	}
+
+	return 1;
+}
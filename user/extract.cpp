@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.hpp"
+
+namespace
+{
+
+struct CopyJob {
+	uint32_t	m_inode;
+	std::string	m_path;
+};
+
+struct DirJob {
+	uint32_t	m_inode;
+	std::string	m_path;
+};
+
+std::string ErrnoMessage(std::string const &what, std::string const &path)
+{ return what + " " + path + ": " + strerror(errno); }
+
+/* Recreates the directory tree of an image. Directories are created on
+ * the way down; files are collected and written afterwards in the order
+ * of their first block, which turns the reads from the image into one
+ * sequential pass however the tree is shaped. */
+class Extractor {
+public:
+	Extractor(Image const &image, std::string const &dir, size_t threads)
+		: m_image(image)
+		, m_dir(dir)
+		, m_threads(std::max<size_t>(threads, 1))
+		, m_owner(geteuid() == 0)
+		, m_bytes(0)
+	{ }
+
+	void Run()
+	{
+		InodeView const root = m_image.GetInode(m_image.RootInode());
+
+		if (!root || !root.IsDir())
+			throw ImageError("Root inode is not a directory");
+
+		if (mkdir(m_dir.c_str(), 0700) && errno != EEXIST)
+			throw ImageError(ErrnoMessage("Cannot create", m_dir));
+		m_dirs.push_back(DirJob{root.InodeNo(), m_dir});
+		m_seen.assign(m_image.Inodes(), false);
+		m_seen[root.InodeNo()] = true;
+
+		/* Walk() appends to m_dirs, so pass a copy */
+		for (size_t i = 0; i != m_dirs.size(); ++i)
+			Walk(DirJob(m_dirs[i]));
+
+		std::sort(m_files.begin(), m_files.end(),
+			[&] (CopyJob const &l, CopyJob const &r) {
+				InodeView const li = m_image.GetInode(l.m_inode);
+				InodeView const ri = m_image.GetInode(r.m_inode);
+
+				return m_image.Extent(li, 0).m_first <
+					m_image.Extent(ri, 0).m_first;
+			});
+		CopyFiles();
+
+		/* last, so read-only directories do not stop us and the
+		 * times are not bumped by creating their entries */
+		for (auto it = m_dirs.rbegin(); it != m_dirs.rend(); ++it)
+			SetAttributes(it->m_path,
+					m_image.GetInode(it->m_inode));
+	}
+
+	size_t Files() const noexcept
+	{ return m_files.size(); }
+
+	size_t Dirs() const noexcept
+	{ return m_dirs.size(); }
+
+	uint64_t Bytes() const noexcept
+	{ return m_bytes; }
+
+private:
+	void Walk(DirJob const &dir)
+	{
+		for (DirEntryView const view :
+				m_image.Entries(m_image.GetInode(dir.m_inode))) {
+			std::string const name(view.Name(), view.NameLen());
+			InodeView const child = m_image.GetInode(view.InodeNo());
+
+			if (!child || m_seen[child.InodeNo()] || name.empty() ||
+					name == "." || name == ".." ||
+					name.find('/') != std::string::npos) {
+				std::cerr << "WARNING: skipping entry \"" << name
+					<< "\" in " << dir.m_path << std::endl;
+				continue;
+			}
+			m_seen[child.InodeNo()] = true;
+
+			std::string const path = dir.m_path + "/" + name;
+			if (child.IsDir()) {
+				if (mkdir(path.c_str(), 0700) && errno != EEXIST)
+					throw ImageError(ErrnoMessage(
+						"Cannot create", path));
+				m_dirs.push_back(DirJob{child.InodeNo(), path});
+			} else if (child.IsFile()) {
+				m_files.push_back(CopyJob{child.InodeNo(), path});
+			}
+		}
+	}
+
+	void CopyFiles()
+	{
+		std::atomic<size_t> next(0);
+		std::vector<std::thread> workers;
+		std::exception_ptr error;
+		std::mutex lock;
+
+		for (size_t t = 0; t != m_threads; ++t)
+			workers.emplace_back([&] {
+				try {
+					size_t idx;
+					while ((idx = next++) < m_files.size())
+						CopyFile(m_files[idx]);
+				} catch (...) {
+					std::lock_guard<std::mutex> guard(lock);
+					error = std::current_exception();
+					next = m_files.size();
+				}
+			});
+
+		for (std::thread &worker : workers)
+			worker.join();
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	void CopyFile(CopyJob const &job)
+	{
+		InodeView const inode = m_image.GetInode(job.m_inode);
+		size_t const extents = m_image.ExtentsCount(inode);
+		int const fd = open(job.m_path.c_str(),
+				O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+		if (fd < 0)
+			throw ImageError(ErrnoMessage("Cannot create",
+						job.m_path));
+
+		uint64_t bytes = 0;
+		bool copied = true;
+		for (size_t i = 0; copied && i != extents; ++i) {
+			Span<uint8_t const> const data =
+					m_image.ExtentData(inode, i);
+			loff_t const in = static_cast<loff_t>(
+					m_image.Extent(inode, i).m_first) *
+					m_image.BlockSize();
+
+			copied = CopyRange(fd, in, bytes, data);
+			bytes += data.Size();
+		}
+
+		int const err = errno;
+		if (close(fd) || !copied) {
+			if (!copied)
+				errno = err;
+			throw ImageError(ErrnoMessage("Cannot write",
+						job.m_path));
+		}
+
+		m_bytes += bytes;
+		SetAttributes(job.m_path, inode);
+	}
+
+	/* copies data, found at in in the image, to out in fd */
+	bool CopyRange(int fd, loff_t in, loff_t out,
+			Span<uint8_t const> data) const
+	{
+		size_t done = 0;
+
+		while (done != data.Size()) {
+			ssize_t const ret = copy_file_range(m_image.Fd(), &in,
+						fd, &out, data.Size() - done, 0);
+
+			if (ret > 0) {
+				done += ret;
+				continue;
+			}
+
+			if (ret == 0 || errno == EXDEV || errno == ENOSYS ||
+					errno == EINVAL || errno == EOPNOTSUPP)
+				/* no in-kernel copy between these two, write
+				 * from the mapping instead */
+				return WriteAll(fd, data.Data() + done,
+						data.Size() - done, out);
+
+			if (errno != EINTR)
+				return false;
+		}
+		return true;
+	}
+
+	static bool WriteAll(int fd, uint8_t const *data, size_t size,
+			off_t off)
+	{
+		while (size) {
+			ssize_t const ret = pwrite(fd, data, size, off);
+
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				return false;
+			data += ret;
+			size -= ret;
+			off += ret;
+		}
+		return true;
+	}
+
+	void SetAttributes(std::string const &path, InodeView inode) const
+	{
+		struct timespec times[2];
+
+		times[0].tv_sec = times[1].tv_sec =
+			static_cast<time_t>(inode.CreateTime());
+		times[0].tv_nsec = times[1].tv_nsec = 0;
+
+		if (m_owner && lchown(path.c_str(), inode.Uid(), inode.Gid()))
+			std::cerr << "WARNING: " << ErrnoMessage(
+				"cannot change owner of", path) << std::endl;
+		if (chmod(path.c_str(), inode.Mode() & 07777))
+			std::cerr << "WARNING: " << ErrnoMessage(
+				"cannot change mode of", path) << std::endl;
+		utimensat(AT_FDCWD, path.c_str(), times, 0);
+	}
+
+	Image const &			m_image;
+	std::string			m_dir;
+	size_t				m_threads;
+	bool				m_owner;
+	std::vector<bool>		m_seen;
+	std::vector<DirJob>		m_dirs;
+	std::vector<CopyJob>		m_files;
+	std::atomic<uint64_t>		m_bytes;
+};
+
+void PrintHelp()
+{
+	std::cout << "Usage:" << std::endl
+		<< "\taufs-extract [(--threads | -j) THREADS] IMAGE DIR"
+		<< std::endl << std::endl
+		<< "Where:" << std::endl
+		<< "\tTHREADS - number of copying threads. Default is the number of CPUs." << std::endl
+		<< "\tIMAGE   - aufs image or device." << std::endl
+		<< "\tDIR     - where to recreate the tree, created if needed." << std::endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<std::string> paths;
+	size_t threads = std::thread::hardware_concurrency();
+
+	--argc;
+	++argv;
+	while (argc--) {
+		std::string const arg(*argv++);
+		if ((arg == "--threads" || arg == "-j") && argc) {
+			threads = std::stoi(*argv++);
+			--argc;
+		} else if (arg == "--help" || arg == "-h") {
+			PrintHelp();
+			return 0;
+		} else {
+			paths.push_back(arg);
+		}
+	}
+
+	try {
+		if (paths.size() != 2)
+			throw std::runtime_error("Image and directory expected");
+
+		Image const image(paths[0]);
+		Extractor extractor(image, paths[1], threads);
+
+		extractor.Run();
+		std::cout << "{\"dirs\":" << extractor.Dirs()
+			<< ",\"files\":" << extractor.Files()
+			<< ",\"bytes\":" << extractor.Bytes() << "}"
+			<< std::endl;
+
+		return 0;
+	} catch (std::exception const & e) {
+		std::cout << "ERROR: " << e.what() << std::endl;
+		PrintHelp();
+	}
+
+	return 1;
+}
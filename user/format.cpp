@@ -1,90 +1,42 @@
 #include <algorithm>
+#include <cstring>
 #include <ctime>
-#include <arpa/inet.h>
+#include <map>
+#include <tuple>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "bit_iterator.hpp"
+#include "crc32c.hpp"
 #include "format.hpp"
 
-namespace
-{
-
-uint64_t ntohll(uint64_t n)
-{
-	uint64_t test = 1ull;
-	if (*(char *)&test == 1ull)
-		return (static_cast<uint64_t>(htonl(n & 0xffffffff)) << 32u)
-			| static_cast<uint64_t>(htonl(n >> 32u));
-	else
-		return n;
-}
-
-}
-
-Inode::Inode(BlocksCache &cache, uint32_t no)
+template <uint32_t BlockSize>
+Inode<BlockSize>::Inode(BlocksCache &cache, uint32_t no)
 	: m_inode(no)
 	, m_block(nullptr)
 	, m_raw(nullptr)
 { FillInode(cache); }
 
-uint32_t Inode::InodeNo() const noexcept
-{ return m_inode; }
-
-uint32_t Inode::FirstBlock() const noexcept
-{ return ntohl(AI_FIRST_BLOCK(m_raw)); }
-
-void Inode::SetFirstBlock(uint32_t block) noexcept
-{ AI_FIRST_BLOCK(m_raw) = ntohl(block); }
-
-uint32_t Inode::BlocksCount() const noexcept
-{ return ntohl(AI_BLOCKS(m_raw)); }
-
-void Inode::SetBlocksCount(uint32_t count) noexcept
-{ AI_BLOCKS(m_raw) = ntohl(count); }
-
-uint32_t Inode::Size() const noexcept
-{ return ntohl(AI_SIZE(m_raw)); }
-
-void Inode::SetSize(uint32_t size) noexcept
-{ AI_SIZE(m_raw) = ntohl(size); }
-
-uint32_t Inode::Gid() const noexcept
-{ return ntohl(AI_GID(m_raw)); }
-
-void Inode::SetGid(uint32_t gid) noexcept
-{ AI_GID(m_raw) = ntohl(gid); }
-
-uint32_t Inode::Uid() const noexcept
-{ return ntohl(AI_UID(m_raw)); }
-
-void Inode::SetUid(uint32_t uid) noexcept
-{ AI_UID(m_raw) = ntohl(uid); }
-
-uint32_t Inode::Mode() const noexcept
-{ return ntohl(AI_MODE(m_raw)); }
-
-void Inode::SetMode(uint32_t mode) noexcept
-{ AI_MODE(m_raw) = ntohl(mode); }
-
-uint64_t Inode::CreateTime() const noexcept
-{ return ntohll(AI_CTIME(m_raw)); }
-
+template <uint32_t BlockSize>
+Inode<BlockSize>::Inode(struct aufs_inode *raw, uint32_t no) noexcept
+	: m_inode(no)
+	, m_block(nullptr)
+	, m_raw(raw)
+{ AI_CTIME(m_raw) = ToDisk64(time(NULL)); }
 
-void Inode::FillInode(BlocksCache &cache)
+template <uint32_t BlockSize>
+void Inode<BlockSize>::FillInode(BlocksCache &cache)
 {
-	ConfigurationConstPtr const config = cache.Config();
-	size_t const in_block = config->BlockSize() / sizeof(struct aufs_inode);
-	size_t const block = InodeNo() / in_block + 3;
-	size_t const index = InodeNo() % in_block;
-	size_t const offset = index * sizeof(struct aufs_inode);
-
-	m_block = cache.GetBlock(block);
-	m_raw = reinterpret_cast<struct aufs_inode *>(m_block->Data() + offset);
-	AI_CTIME(m_raw) = ntohll(time(NULL));
+	using L = Layout<BlockSize>;
+
+	m_block = cache.GetBlock(L::InodeBlock(InodeNo()));
+	m_raw = reinterpret_cast<struct aufs_inode *>(m_block->Data() +
+				L::InodeOffset(InodeNo()));
+	AI_CTIME(m_raw) = ToDisk64(time(NULL));
 }
 
-SuperBlock::SuperBlock(BlocksCache &cache)
+template <uint32_t BlockSize>
+SuperBlock<BlockSize>::SuperBlock(BlocksCache &cache)
 	: m_super_block(cache.GetBlock(0))
 	, m_block_map(cache.GetBlock(1))
 	, m_inode_map(cache.GetBlock(2))
@@ -94,9 +46,10 @@ SuperBlock::SuperBlock(BlocksCache &cache)
 	FillSuper(cache);
 }
 
-uint32_t SuperBlock::AllocateInode() noexcept
+template <uint32_t BlockSize>
+uint32_t SuperBlock<BlockSize>::AllocateInode()
 {
-	BitIterator const e(m_inode_map->Data() + m_inode_map->Size() * 8, 0);
+	BitIterator const e(m_inode_map->Data() + BlockSize, 0);
 	BitIterator const b(m_inode_map->Data(), 0);
 
 	BitIterator it = std::find(b, e, true);
@@ -110,9 +63,10 @@ uint32_t SuperBlock::AllocateInode() noexcept
 	return 0;
 }
 
-uint32_t SuperBlock::AllocateBlocks(size_t blocks) noexcept
+template <uint32_t BlockSize>
+uint32_t SuperBlock<BlockSize>::AllocateBlocks(size_t blocks)
 {
-	BitIterator const e(m_block_map->Data() + m_block_map->Size() * 8, 0);
+	BitIterator const e(m_block_map->Data() + BlockSize, 0);
 	BitIterator const b(m_block_map->Data(), 0);
 
 	BitIterator it = std::find(b, e, true);
@@ -122,7 +76,7 @@ uint32_t SuperBlock::AllocateBlocks(size_t blocks) noexcept
 			std::fill(it, it + blocks, false);
 			return it - b;
 		}
-		it = jt;
+		it = std::find(jt, e, true);
 	}
 
 	throw std::runtime_error("Cannot allocate blocks");
@@ -130,64 +84,385 @@ uint32_t SuperBlock::AllocateBlocks(size_t blocks) noexcept
 	return 0;
 }
 
-void SuperBlock::SetRootInode(uint32_t root) noexcept
+template <uint32_t BlockSize>
+std::vector<std::pair<uint32_t, uint32_t>>
+SuperBlock<BlockSize>::AllocateExtents(size_t blocks, uint32_t *list,
+			uint32_t max_run)
+{
+	using Run = std::pair<uint32_t, uint32_t>;
+
+	BitIterator const e(m_block_map->Data() + BlockSize, 0);
+	BitIterator const b(m_block_map->Data(), 0);
+	std::vector<Run> runs;
+
+	*list = 0;
+	for (BitIterator it = std::find(b, e, true); it != e; ) {
+		BitIterator jt = std::find(it, e, false);
+		uint32_t const first = it - b, size = jt - it;
+
+		if (size >= blocks && (!max_run || blocks <= max_run)) {
+			std::fill(it, it + blocks, false);
+			return std::vector<Run>(1, Run(first, blocks));
+		}
+		if (!max_run)
+			runs.emplace_back(first, size);
+		for (uint32_t off = 0; max_run && off < size;
+				off += max_run + 1)
+			runs.emplace_back(first + off,
+					std::min(max_run, size - off));
+		it = std::find(jt, e, true);
+	}
+
+	/* the list takes the smallest run, the file the largest ones */
+	std::stable_sort(runs.begin(), runs.end(),
+		[] (Run const &l, Run const &r) { return l.second > r.second; });
+	if (runs.empty())
+		throw std::runtime_error("Cannot allocate blocks");
+
+	*list = runs.back().first;
+	if (!--runs.back().second)
+		runs.pop_back();
+	else
+		++runs.back().first;
+
+	size_t const max = AufsExtentsMax(BlockSize);
+	size_t count = 0, covered = 0;
+	while (covered < blocks && count != std::min(max, runs.size()))
+		covered += runs[count++].second;
+	if (covered < blocks) {
+		*list = 0;
+		throw std::runtime_error("Cannot allocate blocks");
+	}
+
+	runs.resize(count);
+	runs.back().second -= covered - blocks;
+	std::sort(runs.begin(), runs.end());
+
+	*(b + *list) = false;
+	for (Run const &run : runs)
+		std::fill(b + run.first, b + run.first + run.second, false);
+	return runs;
+}
+
+template <uint32_t BlockSize>
+bool SuperBlock<BlockSize>::BlockUsed(uint32_t block) const noexcept
+{
+	BitIterator const it(m_block_map->Data(), 0);
+
+	return !*(it + block);
+}
+
+template <uint32_t BlockSize>
+void SuperBlock<BlockSize>::SetRootInode(uint32_t root) noexcept
 {
 	struct aufs_super_block *sb =
 		reinterpret_cast<struct aufs_super_block *>(
 			m_super_block->Data());
 
-	ASB_ROOT_INODE(sb) = htonl(root);	
+	ASB_ROOT_INODE(sb) = ToDisk32(root);
 }
 
-void SuperBlock::FillSuper(BlocksCache &cache) noexcept
+template <uint32_t BlockSize>
+void SuperBlock<BlockSize>::SetInodeTables(uint32_t attrs_first,
+			uint32_t attrs_count, uint32_t times_first,
+			uint32_t times_count) noexcept
 {
 	struct aufs_super_block *sb =
 		reinterpret_cast<struct aufs_super_block *>(
 			m_super_block->Data());
 
-	ASB_MAGIC(sb) = htonl(AUFS_MAGIC);
-	ASB_BLOCK_SIZE(sb) = htonl(cache.Config()->BlockSize());
+	ASB_ATTRS_FIRST(sb) = ToDisk32(attrs_first);
+	ASB_ATTRS_COUNT(sb) = ToDisk32(attrs_count);
+	ASB_TIMES_FIRST(sb) = ToDisk32(times_first);
+	ASB_TIMES_COUNT(sb) = ToDisk32(times_count);
+}
+
+template <uint32_t BlockSize>
+void SuperBlock<BlockSize>::FillSuper(BlocksCache &cache) noexcept
+{
+	struct aufs_super_block *sb =
+		reinterpret_cast<struct aufs_super_block *>(
+			m_super_block->Data());
+
+	ASB_MAGIC(sb) = ToDisk32(AUFS_MAGIC);
+	ASB_BLOCK_SIZE(sb) = ToDisk32(BlockSize);
 	ASB_ROOT_INODE(sb) = 0;
-	ASB_INODE_BLOCKS(sb) = htonl(cache.Config()->InodeBlocks());
+	ASB_INODE_BLOCKS(sb) = ToDisk32(cache.Config()->InodeBlocks());
+	ASB_FEATURES(sb) = ToDisk32(cache.Config()->Features());
+	ASB_CSUM_FIRST(sb) = 0;
+	ASB_CSUM_BLOCKS(sb) = ToDisk32(cache.Config()->ChecksumBlocks());
+	ASB_COMPAT_FEATURES(sb) = ToDisk32(cache.Config()->CompatFeatures());
+	ASB_ATTRS_FIRST(sb) = 0;
+	ASB_ATTRS_COUNT(sb) = 0;
+	ASB_TIMES_FIRST(sb) = 0;
+	ASB_TIMES_COUNT(sb) = 0;
+	if (cache.Config()->ChecksumBlocks())
+		ASB_CSUM_FIRST(sb) = ToDisk32(
+				Layout<BlockSize>::InodeTableBlock +
+				cache.Config()->InodeBlocks());
 }
 
-void SuperBlock::FillBlockMap(BlocksCache &cache) noexcept
+template <uint32_t BlockSize>
+void SuperBlock<BlockSize>::FillBlockMap(BlocksCache &cache) noexcept
 {
+	using L = Layout<BlockSize>;
+
 	size_t const blocks = std::min(cache.Config()->Blocks(),
-		cache.Config()->BlockSize() * 8);
+					L::BitsPerMap);
 	size_t const inode_blocks = cache.Config()->InodeBlocks();
+	size_t const csum_blocks = cache.Config()->ChecksumBlocks();
+	size_t const reserved = L::InodeTableBlock + inode_blocks + csum_blocks;
 
 	BitIterator const it(m_block_map->Data(), 0);
-	std::fill(it, it + 3 + inode_blocks, false);
-	std::fill(it + 3 + inode_blocks, it + blocks, true);
-	std::fill(it + blocks, it + cache.Config()->BlockSize() * 8, false); 
+	std::fill(it, it + reserved, false);
+	std::fill(it + reserved, it + blocks, true);
+	std::fill(it + blocks, it + L::BitsPerMap, false);
 }
 
-void SuperBlock::FillInodeMap(BlocksCache &cache) noexcept
+template <uint32_t BlockSize>
+void SuperBlock<BlockSize>::FillInodeMap(BlocksCache &cache) noexcept
 {
-	uint32_t const in_block =
-		cache.Config()->BlockSize() / sizeof(struct aufs_inode);
+	using L = Layout<BlockSize>;
+
 	uint32_t const inode_blocks = cache.Config()->InodeBlocks();
-	uint32_t const inodes = std::min(inode_blocks * in_block,
-		cache.Config()->BlockSize() * 8);
+	uint32_t const shift = L::InodeShiftFor(cache.Config()->Features());
+	uint32_t const inodes = std::min(inode_blocks << shift,
+					L::BitsPerMap);
 
 	BitIterator const it(m_inode_map->Data(), 0);
 	std::fill(it, it + 1, false);
 	std::fill(it + 1, it + inodes, true);
-	std::fill(it + inodes, it + cache.Config()->BlockSize() * 8, false);
+	std::fill(it + inodes, it + L::BitsPerMap, false);
+}
+
+template <uint32_t BlockSize>
+Formatter<BlockSize>::Formatter(ConfigurationConstPtr config)
+	: m_config(CheckConfig(config))
+	, m_cache(config)
+	, m_super(m_cache)
+{ }
+
+template <uint32_t BlockSize>
+ConfigurationConstPtr Formatter<BlockSize>::CheckConfig(
+			ConfigurationConstPtr config)
+{
+	if (config->BlockSize() != BlockSize)
+		throw std::logic_error("formatter block size mismatch");
+	return config;
 }
 
-void Formatter::SetRootInode(Inode const &inode) noexcept
+template <uint32_t BlockSize>
+void Formatter<BlockSize>::SetRootInode(InodeType const &inode) noexcept
 {
 	m_super.SetRootInode(inode.InodeNo());
 }
 
-Inode Formatter::MkDir(uint32_t entries)
+template <uint32_t BlockSize>
+typename Formatter<BlockSize>::InodeType Formatter<BlockSize>::NewInode()
+{
+	uint32_t const no = m_super.AllocateInode();
+
+	if (!m_config->CompactInodes())
+		return InodeType(m_cache, no);
+
+	if (m_staged.size() <= no)
+		m_staged.resize(no + 1, aufs_inode());
+	return InodeType(&m_staged[no], no);
+}
+
+template <uint32_t BlockSize>
+uint32_t Formatter<BlockSize>::DataBlock(InodeType const &inode,
+			uint32_t idx)
+{
+	uint32_t const first = inode.FirstBlock();
+
+	if (!(first & AUFS_EXTENT_LIST) ||
+			!(m_config->Features() & AUFS_FEATURE_EXTENTS))
+		return first + idx;
+
+	BlockPtr const lp = m_cache.GetBlock(first & ~AUFS_EXTENT_LIST);
+	struct aufs_extent_header *aeh =
+		reinterpret_cast<struct aufs_extent_header *>(lp->Data());
+	struct aufs_extent *ae = reinterpret_cast<struct aufs_extent *>(
+				aeh + 1);
+
+	for (uint32_t i = 0; i != FromDisk32(AEH_COUNT(aeh)); ++i) {
+		uint32_t const blocks = FromDisk32(AE_BLOCKS(&ae[i]));
+
+		if (idx < blocks)
+			return FromDisk32(AE_FIRST_BLOCK(&ae[i])) + idx;
+		idx -= blocks;
+	}
+	throw std::out_of_range("block is past the file extents");
+}
+
+template <uint32_t BlockSize>
+void Formatter<BlockSize>::WriteInodes()
+{
+	using L = Layout<BlockSize>;
+	using Attr = std::tuple<uint32_t, uint32_t, uint32_t>;
+
+	if (!m_config->CompactInodes())
+		return;
+
+	std::map<Attr, uint32_t> attrs;
+	std::map<uint64_t, uint32_t> times;
+
+	/* free inodes stay all zero, so they need no table entries */
+	for (struct aufs_inode &ai : m_staged) {
+		if (!ai.ai_mode)
+			continue;
+		attrs.emplace(Attr(FromDisk32(AI_UID(&ai)),
+				FromDisk32(AI_GID(&ai)),
+				FromDisk32(AI_MODE(&ai))), attrs.size());
+		times.emplace(FromDisk64(AI_CTIME(&ai)), times.size());
+	}
+
+	if (attrs.size() > AUFS_COMPACT_TABLE_MAX)
+		throw std::runtime_error("Too many distinct inode attributes");
+	if (times.size() > AUFS_COMPACT_TABLE_MAX)
+		throw std::runtime_error("Too many distinct inode times");
+
+	for (uint32_t no = 0; no != m_staged.size(); ++no) {
+		struct aufs_inode &ai = m_staged[no];
+
+		if (!ai.ai_mode)
+			continue;
+
+		BlockPtr bp = m_cache.GetBlock(L::CompactInodeBlock(no));
+		struct aufs_compact_inode *aci =
+			reinterpret_cast<struct aufs_compact_inode *>(
+				bp->Data() + L::CompactInodeOffset(no));
+
+		ACI_FIRST_BLOCK(aci) = AI_FIRST_BLOCK(&ai);
+		ACI_BLOCKS(aci) = AI_BLOCKS(&ai);
+		ACI_SIZE(aci) = AI_SIZE(&ai);
+		ACI_ATTR(aci) = ToDisk16(attrs[Attr(FromDisk32(AI_UID(&ai)),
+					FromDisk32(AI_GID(&ai)),
+					FromDisk32(AI_MODE(&ai)))]);
+		ACI_TIME(aci) = ToDisk16(times[FromDisk64(AI_CTIME(&ai))]);
+	}
+
+	std::vector<struct aufs_inode_attr> attr_table(attrs.size());
+	for (std::pair<Attr const, uint32_t> const &attr : attrs) {
+		struct aufs_inode_attr *aia = &attr_table[attr.second];
+
+		AIA_UID(aia) = ToDisk32(std::get<0>(attr.first));
+		AIA_GID(aia) = ToDisk32(std::get<1>(attr.first));
+		AIA_MODE(aia) = ToDisk32(std::get<2>(attr.first));
+	}
+
+	std::vector<uint64_t> time_table(times.size());
+	for (std::pair<uint64_t const, uint32_t> const &time : times)
+		time_table[time.second] = ToDisk64(time.first);
+
+	uint32_t const attrs_first = WriteTable(attr_table.data(),
+			attr_table.size() * sizeof(struct aufs_inode_attr));
+	uint32_t const times_first = WriteTable(time_table.data(),
+			time_table.size() * sizeof(uint64_t));
+
+	m_super.SetInodeTables(attrs_first, attrs.size(), times_first,
+			times.size());
+	m_staged.clear();
+}
+
+template <uint32_t BlockSize>
+uint32_t Formatter<BlockSize>::WriteTable(void const *data, size_t bytes)
+{
+	using L = Layout<BlockSize>;
+
+	if (!bytes)
+		return 0;
+
+	uint8_t const *src = static_cast<uint8_t const *>(data);
+	uint32_t const blocks = L::BlocksFor(bytes);
+	uint32_t const first = m_super.AllocateBlocks(blocks);
+
+	for (uint32_t i = 0; i != blocks; ++i) {
+		size_t const off = static_cast<size_t>(i) << L::BlockShift;
+		BlockPtr bp = m_cache.GetBlock(first + i);
+
+		memcpy(bp->Data(), src + off, std::min<size_t>(bytes - off,
+					BlockSize));
+	}
+	return first;
+}
+
+template <uint32_t BlockSize>
+void Formatter<BlockSize>::WriteChecksums()
 {
-	uint32_t const bytes = entries * sizeof(struct aufs_dir_entry);
-	uint32_t const blocks = (bytes + m_config->BlockSize() - 1) /
-					m_config->BlockSize();
-	Inode inode(m_cache, m_super.AllocateInode());
+	using L = Layout<BlockSize>;
+
+	static uint32_t const ChunkBlocks = (1u << 20) >> L::BlockShift;
+	static uint32_t const SumsPerBlock = BlockSize / sizeof(uint32_t);
+
+	uint32_t const csum_blocks = m_config->ChecksumBlocks();
+	if (!csum_blocks)
+		return;
+
+	uint32_t const blocks = std::min(m_config->Blocks(), L::BitsPerMap);
+	uint32_t const csum_first = L::InodeTableBlock +
+					m_config->InodeBlocks();
+	uint32_t const csum_last = csum_first + csum_blocks;
+	std::vector<uint32_t> sums(csum_blocks * SumsPerBlock, 0);
+	std::vector<uint8_t> chunk(ChunkBlocks << L::BlockShift);
+
+	/* everything else is final at this point, checksum what hit the
+	 * device rather than tracking every partial block update */
+	m_cache.Sync();
+	for (uint32_t first = 0; first < blocks; first += ChunkBlocks) {
+		uint32_t const count = std::min(blocks - first, ChunkBlocks);
+
+		m_cache.ReadBlocks(first, count, chunk.data());
+		for (uint32_t i = 0; i != count; ++i) {
+			uint32_t const block = first + i;
+
+			if (!m_super.BlockUsed(block) ||
+					(block >= csum_first && block < csum_last))
+				continue;
+			sums[block] = ToDisk32(Crc32c(0,
+					chunk.data() + (i << L::BlockShift),
+					BlockSize));
+		}
+	}
+
+	for (uint32_t i = 0; i != csum_blocks; ++i) {
+		BlockPtr bp = m_cache.GetBlock(csum_first + i);
+
+		memcpy(bp->Data(), sums.data() + i * SumsPerBlock, BlockSize);
+	}
+}
+
+template <uint32_t BlockSize>
+uint32_t Formatter<BlockSize>::RecordOffset(uint32_t used, uint32_t rec_len)
+	noexcept
+{
+	using L = Layout<BlockSize>;
+
+	/* records never cross a block, the rest of the block stays zero */
+	if ((used & L::BlockMask) + rec_len > BlockSize)
+		return (used + L::BlockMask) & ~L::BlockMask;
+	return used;
+}
+
+template <uint32_t BlockSize>
+typename Formatter<BlockSize>::InodeType
+Formatter<BlockSize>::MkDir(std::vector<std::string> const &names)
+{
+	using L = Layout<BlockSize>;
+
+	uint32_t size = 0;
+	for (std::string const &name : names) {
+		uint32_t const rec_len = AufsRecLen(std::min<size_t>(
+					name.size(), AUFS_REC_NAME_MAXLEN));
+
+		size = RecordOffset(size, rec_len) + rec_len;
+	}
+
+	uint32_t const entries = names.size();
+	uint32_t const blocks = L::BlocksFor(size) +
+			BloomBlocks(entries, size) + IndexBlocks(entries);
+	InodeType inode = NewInode();
 	uint32_t block = m_super.AllocateBlocks(blocks);
 
 	inode.SetFirstBlock(block);
@@ -200,15 +475,18 @@ Inode Formatter::MkDir(uint32_t entries)
 	return inode;
 }
 
-Inode Formatter::MkFile(uint32_t size)
+template <uint32_t BlockSize>
+typename Formatter<BlockSize>::InodeType
+Formatter<BlockSize>::MkFile(uint32_t size)
 {
-	uint32_t const blocks = (size + m_config->BlockSize() - 1) /
-					m_config->BlockSize();
-	Inode inode(m_cache, m_super.AllocateInode());
-	uint32_t block = m_super.AllocateBlocks(blocks);
+	uint32_t const blocks = Layout<BlockSize>::BlocksFor(size);
+	InodeType inode = NewInode();
 
-	inode.SetFirstBlock(block);
 	inode.SetBlocksCount(blocks);
+	if (!m_config->Extents())
+		inode.SetFirstBlock(m_super.AllocateBlocks(blocks));
+	else
+		AllocateExtents(inode, blocks);
 	inode.SetUid(getuid());
 	inode.SetGid(getgid());
 	inode.SetMode(493 | S_IFREG);
@@ -216,49 +494,242 @@ Inode Formatter::MkFile(uint32_t size)
 	return inode;
 }
 
-uint32_t Formatter::Write(Inode &inode, uint8_t const *data, uint32_t size)
+template <uint32_t BlockSize>
+void Formatter<BlockSize>::AllocateExtents(InodeType &inode, uint32_t blocks)
 {
+	using Run = std::pair<uint32_t, uint32_t>;
+
+	uint32_t list;
+	std::vector<Run> const runs = m_super.AllocateExtents(blocks, &list,
+				m_config->MaxRun());
+
+	if (!list) {
+		inode.SetFirstBlock(runs.empty() ? 0 : runs.front().first);
+		return;
+	}
+
+	BlockPtr bp = m_cache.GetBlock(list);
+	struct aufs_extent_header *aeh =
+		reinterpret_cast<struct aufs_extent_header *>(bp->Data());
+	struct aufs_extent *ae = reinterpret_cast<struct aufs_extent *>(
+				aeh + 1);
+
+	memset(bp->Data(), 0, BlockSize);
+	AEH_COUNT(aeh) = ToDisk32(runs.size());
+	for (Run const &run : runs) {
+		AE_FIRST_BLOCK(ae) = ToDisk32(run.first);
+		AE_BLOCKS(ae) = ToDisk32(run.second);
+		++ae;
+	}
+	inode.SetFirstBlock(list | AUFS_EXTENT_LIST);
+}
+
+template <uint32_t BlockSize>
+uint32_t Formatter<BlockSize>::Write(InodeType &inode, uint8_t const *data,
+			uint32_t size)
+{
+	using L = Layout<BlockSize>;
+
 	if (!(inode.Mode() & S_IFREG))
 		throw std::logic_error("it is not file");
 
-	uint32_t const left = inode.BlocksCount() * m_config->BlockSize() -
-					inode.Size();
+	uint32_t const used = inode.Size();
+	uint32_t const left = (inode.BlocksCount() << L::BlockShift) - used;
 	if (left < size)
 		throw std::out_of_range("there is no enough space");
 
-	uint32_t const block = inode.FirstBlock() + inode.Size() /
-					m_config->BlockSize();
-	uint32_t const offset = inode.Size() % m_config->BlockSize();
-	uint32_t const towrite = std::min(size, m_config->BlockSize() - offset);
+	uint32_t const block = DataBlock(inode, used >> L::BlockShift);
+	uint32_t const offset = used & L::BlockMask;
+	uint32_t const towrite = std::min(size, BlockSize - offset);
 
 	BlockPtr bp = m_cache.GetBlock(block);
 	std::copy_n(data, towrite, bp->Data() + offset);
-	inode.SetSize(inode.Size() + towrite);
+	inode.SetSize(used + towrite);
 
 	return towrite;
 }
 
-void Formatter::AddChild(Inode &inode, char const *name, Inode const &ch)
+template <uint32_t BlockSize>
+void Formatter<BlockSize>::AddChild(InodeType &inode, char const *name,
+			InodeType const &ch)
 {
+	using L = Layout<BlockSize>;
+
 	if (!(inode.Mode() & S_IFDIR))
 		throw std::logic_error("it is not directory");
 
-	uint32_t const inblock = m_config->BlockSize() /
-					sizeof(struct aufs_dir_entry);
-	uint32_t const entries = inode.BlocksCount() * inblock;
-	uint32_t const left = entries - inode.Size();
+	size_t const len = strnlen(name, AUFS_REC_NAME_MAXLEN);
+	uint32_t const rec_len = AufsRecLen(len);
+	uint32_t const used = inode.Size();
+	uint32_t const offset = RecordOffset(used, rec_len);
 
-	if (!left)
+	if (!len)
+		throw std::logic_error("entry name is empty");
+	if (offset + rec_len > (inode.BlocksCount() << L::BlockShift))
 		throw std::out_of_range("there is no enough space");
 
-	uint32_t const block = inode.FirstBlock() + inode.Size() / inblock;
-	uint32_t const offset = inode.Size() % inblock;
+	if (used) {
+		/* the previous record is the last one in its block */
+		uint32_t const start = (used - 1) & ~L::BlockMask;
+		BlockPtr pb = m_cache.GetBlock(inode.FirstBlock() +
+					(start >> L::BlockShift));
+		struct aufs_dir_rec const *pp = nullptr;
+
+		for (uint32_t off = start; off != used;
+				off += FromDisk16(pp->adr_rec_len))
+			pp = reinterpret_cast<struct aufs_dir_rec const *>(
+				pb->Data() + (off & L::BlockMask));
+
+		int cmp = memcmp(ADR_NAME(pp), name,
+				std::min<size_t>(pp->adr_name_len, len));
+		/* equal names compare as out of order too */
+		if (!cmp)
+			cmp = pp->adr_name_len < len ? -1 : 1;
+		if (cmp >= 0)
+			throw std::logic_error(
+				"entries must be added in sorted order");
+	}
 
-	BlockPtr bp = m_cache.GetBlock(block);
-	struct aufs_dir_entry *dp = reinterpret_cast<struct aufs_dir_entry *>(
-					bp->Data()) + offset;
-	strncpy(dp->ade_name, name, AUFS_NAME_MAXLEN - 1);
-	dp->ade_name[AUFS_NAME_MAXLEN - 1] = '\0';
-	dp->ade_inode = htonl(ch.InodeNo());
-	inode.SetSize(inode.Size() + 1);
+	BlockPtr bp = m_cache.GetBlock(inode.FirstBlock() +
+				(offset >> L::BlockShift));
+	struct aufs_dir_rec *dp = reinterpret_cast<struct aufs_dir_rec *>(
+				bp->Data() + (offset & L::BlockMask));
+
+	memset(dp, 0, rec_len);
+	ADR_INODE(dp) = ToDisk32(ch.InodeNo());
+	ADR_REC_LEN(dp) = ToDisk16(rec_len);
+	dp->adr_name_len = len;
+	if (m_config->CompatFeatures() & AUFS_COMPAT_DIR_TYPES)
+		dp->adr_type = (ch.Mode() & S_IFMT) >> 12;
+	memcpy(ADR_NAME(dp), name, len);
+	inode.SetSize(offset + rec_len);
+}
+
+template <uint32_t BlockSize>
+uint32_t Formatter<BlockSize>::IndexBlocks(uint32_t entries) const noexcept
+{
+	uint32_t const threshold = m_config->IndexThreshold();
+	uint32_t slots = 1;
+
+	if (!threshold || entries < threshold)
+		return 0;
+
+	/* keep the table at most half full, so probe chains stay short */
+	while (slots < 2 * entries)
+		slots *= 2;
+	return Layout<BlockSize>::BlocksFor(slots *
+				sizeof(struct aufs_dir_slot));
+}
+
+template <uint32_t BlockSize>
+uint32_t Formatter<BlockSize>::BloomBlocks(uint32_t entries, uint32_t size)
+	const noexcept
+{
+	uint32_t const threshold = m_config->BloomThreshold();
+
+	/* an index makes a tail, and every tail starts with a filter */
+	if (!threshold || (entries < threshold && !IndexBlocks(entries)))
+		return 0;
+	return Layout<BlockSize>::BlocksFor(AufsBloomBytes(
+			AufsDirNamesMax(size, m_config->Features())));
+}
+
+template <uint32_t BlockSize>
+void Formatter<BlockSize>::BuildIndex(InodeType &inode)
+{
+	using L = Layout<BlockSize>;
+
+	if (!(inode.Mode() & S_IFDIR))
+		throw std::logic_error("it is not directory");
+
+	uint32_t const size = inode.Size();
+	uint32_t const entry_blocks = L::BlocksFor(size);
+	if (inode.BlocksCount() <= entry_blocks)
+		return;
+
+	/* name hashes and record offsets, in directory order */
+	std::vector<std::pair<uint32_t, uint32_t>> names;
+	for (uint32_t off = 0; off < size; ) {
+		BlockPtr bp = m_cache.GetBlock(inode.FirstBlock() +
+					(off >> L::BlockShift));
+		struct aufs_dir_rec const *dp =
+			reinterpret_cast<struct aufs_dir_rec const *>(
+				bp->Data() + (off & L::BlockMask));
+		uint32_t const rec_len = FromDisk16(dp->adr_rec_len);
+
+		if (!rec_len) {
+			off = (off + L::BlockMask) & ~L::BlockMask;
+			continue;
+		}
+		names.emplace_back(AufsNameHash(ADR_NAME(dp),
+					dp->adr_name_len), off);
+		off += rec_len;
+	}
+
+	uint32_t const entries = names.size();
+	uint32_t const bloom_bytes = AufsBloomBytes(AufsDirNamesMax(size,
+					m_config->Features()));
+	uint32_t const tail_blocks = inode.BlocksCount() - entry_blocks;
+	uint32_t const bloom_blocks = m_config->BloomThreshold() ?
+			L::BlocksFor(bloom_bytes) : 0;
+	if (bloom_blocks > tail_blocks)
+		throw std::logic_error("directory has no room for its filter");
+
+	uint32_t const index_blocks = tail_blocks - bloom_blocks;
+	uint32_t const slots = m_config->IndexThreshold() ? AufsIndexSlots(
+			static_cast<uint64_t>(index_blocks) << L::BlockShift) : 0;
+	if (slots && slots <= entries)
+		throw std::logic_error("directory index is too small");
+
+	uint32_t const bloom_bits = bloom_blocks ? bloom_bytes * 8 : 0;
+	std::vector<uint8_t> tail(tail_blocks << L::BlockShift, 0);
+	struct aufs_dir_slot *table = reinterpret_cast<struct aufs_dir_slot *>(
+				tail.data() + (bloom_blocks << L::BlockShift));
+
+	for (std::pair<uint32_t, uint32_t> const &name : names) {
+		uint32_t const hash = name.first;
+
+		if (bloom_bits) {
+			uint32_t const step = AufsBloomStep(hash);
+
+			for (uint32_t k = 0; k != AUFS_BLOOM_HASHES; ++k) {
+				uint32_t const bit = (hash + k * step) &
+							(bloom_bits - 1);
+
+				tail[bit / 8] |= 1u << (bit % 8);
+			}
+		}
+
+		if (slots) {
+			uint32_t slot = hash & (slots - 1);
+
+			while (ADS_POS(&table[slot]))
+				slot = (slot + 1) & (slots - 1);
+			ADS_HASH(&table[slot]) = ToDisk32(hash);
+			ADS_POS(&table[slot]) = ToDisk32(name.second + 1);
+		}
+	}
+
+	for (uint32_t i = 0; i != tail_blocks; ++i) {
+		BlockPtr bp = m_cache.GetBlock(inode.FirstBlock() +
+					entry_blocks + i);
+
+		memcpy(bp->Data(), tail.data() + (i << L::BlockShift),
+			BlockSize);
+	}
 }
+
+template class Inode<512u>;
+template class Inode<1024u>;
+template class Inode<2048u>;
+template class Inode<4096u>;
+
+template class SuperBlock<512u>;
+template class SuperBlock<1024u>;
+template class SuperBlock<2048u>;
+template class SuperBlock<4096u>;
+
+template class Formatter<512u>;
+template class Formatter<1024u>;
+template class Formatter<2048u>;
+template class Formatter<4096u>;
@@ -1,33 +1,63 @@
 #ifndef __FORMAT_HPP__
 #define __FORMAT_HPP__
 
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "block.hpp"
+#include "layout.hpp"
 
+template <uint32_t BlockSize>
 class Inode {
 public:
 	explicit Inode(BlocksCache &cache, uint32_t no);
+	/* an inode staged outside of the inode table */
+	explicit Inode(struct aufs_inode *raw, uint32_t no) noexcept;
+
+	uint32_t InodeNo() const noexcept
+	{ return m_inode; }
+
+	/* with AUFS_EXTENT_LIST set, the block of the extent list */
+	uint32_t FirstBlock() const noexcept
+	{ return FromDisk32(AI_FIRST_BLOCK(m_raw)); }
+
+	void SetFirstBlock(uint32_t block) noexcept
+	{ AI_FIRST_BLOCK(m_raw) = ToDisk32(block); }
 
-	uint32_t InodeNo() const noexcept;
+	uint32_t BlocksCount() const noexcept
+	{ return FromDisk32(AI_BLOCKS(m_raw)); }
 
-	uint32_t FirstBlock() const noexcept;
-	void SetFirstBlock(uint32_t block) noexcept;
+	void SetBlocksCount(uint32_t count) noexcept
+	{ AI_BLOCKS(m_raw) = ToDisk32(count); }
 
-	uint32_t BlocksCount() const noexcept;
-	void SetBlocksCount(uint32_t count) noexcept;
+	uint32_t Size() const noexcept
+	{ return FromDisk32(AI_SIZE(m_raw)); }
 
-	uint32_t Size() const noexcept;
-	void SetSize(uint32_t size) noexcept;
+	void SetSize(uint32_t size) noexcept
+	{ AI_SIZE(m_raw) = ToDisk32(size); }
 
-	uint32_t Gid() const noexcept;
-	void SetGid(uint32_t gid) noexcept;
+	uint32_t Gid() const noexcept
+	{ return FromDisk32(AI_GID(m_raw)); }
 
-	uint32_t Uid() const noexcept;
-	void SetUid(uint32_t uid) noexcept;
+	void SetGid(uint32_t gid) noexcept
+	{ AI_GID(m_raw) = ToDisk32(gid); }
 
-	uint32_t Mode() const noexcept;
-	void SetMode(uint32_t mode) noexcept;
+	uint32_t Uid() const noexcept
+	{ return FromDisk32(AI_UID(m_raw)); }
 
-	uint64_t CreateTime() const noexcept;
+	void SetUid(uint32_t uid) noexcept
+	{ AI_UID(m_raw) = ToDisk32(uid); }
+
+	uint32_t Mode() const noexcept
+	{ return FromDisk32(AI_MODE(m_raw)); }
+
+	void SetMode(uint32_t mode) noexcept
+	{ AI_MODE(m_raw) = ToDisk32(mode); }
+
+	uint64_t CreateTime() const noexcept
+	{ return FromDisk64(AI_CTIME(m_raw)); }
 
 private:
 	void FillInode(BlocksCache &cache);
@@ -38,13 +68,24 @@ private:
 };
 
 
+template <uint32_t BlockSize>
 class SuperBlock {
 public:
 	explicit SuperBlock(BlocksCache &cache);
 
-	uint32_t AllocateInode() noexcept;
-	uint32_t AllocateBlocks(size_t blocks) noexcept;
+	uint32_t AllocateInode();
+	uint32_t AllocateBlocks(size_t blocks);
+	/* the first free run that fits blocks or, with no such run, the
+	 * fewest largest runs that add up to it, in disk order; *list gets
+	 * a block for the extent list then and is zero otherwise. With
+	 * max_run runs are at most that long and a free block is left
+	 * between the pieces of a free run, so they are never adjacent. */
+	std::vector<std::pair<uint32_t, uint32_t>> AllocateExtents(
+			size_t blocks, uint32_t *list, uint32_t max_run = 0);
+	bool BlockUsed(uint32_t block) const noexcept;
 	void SetRootInode(uint32_t root) noexcept;
+	void SetInodeTables(uint32_t attrs_first, uint32_t attrs_count,
+			uint32_t times_first, uint32_t times_count) noexcept;
 
 private:
 	void FillSuper(BlocksCache &cache) noexcept;
@@ -56,26 +97,71 @@ private:
 	BlockPtr	m_inode_map;
 };
 
+template <uint32_t BlockSize>
 class Formatter {
 public:
-	Formatter(ConfigurationConstPtr config)
-		: m_config(config)
-		, m_cache(config)
-		, m_super(m_cache)
-	{ }
+	using InodeType = Inode<BlockSize>;
+
+	Formatter(ConfigurationConstPtr config);
 
-	void SetRootInode(Inode const &inode) noexcept;
-	Inode MkDir(uint32_t entries);
-	Inode MkFile(uint32_t size);
+	void SetRootInode(InodeType const &inode) noexcept;
+	/* reserves room for exactly these names, added in this order */
+	InodeType MkDir(std::vector<std::string> const &names);
+	InodeType MkFile(uint32_t size);
 
-	uint32_t Write(Inode &inode, uint8_t const *data, uint32_t size);
+	uint32_t Write(InodeType &inode, uint8_t const *data, uint32_t size);
 
-	void AddChild(Inode &inode, char const *name, Inode const &ch);
+	/* names must come in strictly ascending strcmp order, that is
+	 * what lets readers binary search the directory; they are cut to
+	 * AUFS_REC_NAME_MAXLEN bytes */
+	void AddChild(InodeType &inode, char const *name,
+			InodeType const &ch);
+
+	/* fills the Bloom filter and the hash index MkDir reserved for a
+	 * large directory, once all its children are added; does nothing
+	 * for other directories */
+	void BuildIndex(InodeType &inode);
+
+	/* with compact inodes, stores the staged inodes into the inode
+	 * table and writes the attribute and time tables they refer to;
+	 * must come after the last inode change and before WriteChecksums */
+	void WriteInodes();
+
+	/* fills the checksum table, if enabled; must be the last step,
+	 * blocks changed afterwards will not match their checksums */
+	void WriteChecksums();
 
 private:
+	static ConfigurationConstPtr CheckConfig(ConfigurationConstPtr config);
+	static uint32_t RecordOffset(uint32_t used, uint32_t rec_len) noexcept;
+	InodeType NewInode();
+	uint32_t DataBlock(InodeType const &inode, uint32_t idx);
+	void AllocateExtents(InodeType &inode, uint32_t blocks);
+	uint32_t WriteTable(void const *data, size_t bytes);
+	uint32_t IndexBlocks(uint32_t entries) const noexcept;
+	uint32_t BloomBlocks(uint32_t entries, uint32_t size) const noexcept;
+
 	ConfigurationConstPtr	m_config;
 	BlocksCache		m_cache;
-	SuperBlock		m_super;
+	SuperBlock<BlockSize>	m_super;
+	/* wide inodes by number until WriteInodes() with compact inodes,
+	 * a deque so that growing it does not move them */
+	std::deque<struct aufs_inode>	m_staged;
 };
 
+extern template class Inode<512u>;
+extern template class Inode<1024u>;
+extern template class Inode<2048u>;
+extern template class Inode<4096u>;
+
+extern template class SuperBlock<512u>;
+extern template class SuperBlock<1024u>;
+extern template class SuperBlock<2048u>;
+extern template class SuperBlock<4096u>;
+
+extern template class Formatter<512u>;
+extern template class Formatter<1024u>;
+extern template class Formatter<2048u>;
+extern template class Formatter<4096u>;
+
 #endif /*__FORMAT_HPP__*/
@@ -0,0 +1,1105 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "bit_iterator.hpp"
+#include "block.hpp"
+#include "crc32c.hpp"
+#include "layout.hpp"
+
+namespace
+{
+
+/* exit codes follow fsck(8) */
+static int const FsckOk = 0;
+static int const FsckErrors = 4;
+static int const FsckFailed = 8;
+
+/* inode table and directories are read in requests of this size */
+static size_t const ReadChunkBytes = 1048576u;
+
+struct Problem {
+	std::string	m_kind;
+	uint32_t	m_inode;
+	uint64_t	m_block;
+	std::string	m_detail;
+
+	bool operator<(Problem const &p) const noexcept
+	{
+		if (m_inode != p.m_inode)
+			return m_inode < p.m_inode;
+		if (m_block != p.m_block)
+			return m_block < p.m_block;
+		return m_kind < p.m_kind;
+	}
+};
+
+using Problems = std::vector<Problem>;
+
+std::string JsonEscape(std::string const &str)
+{
+	std::ostringstream out;
+
+	for (unsigned char c : str) {
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if (c < 0x20)
+			out << "\\u00" << "0123456789abcdef"[c >> 4]
+				<< "0123456789abcdef"[c & 15];
+		else
+			out << c;
+	}
+	return out.str();
+}
+
+void Report(Problem const &p)
+{
+	std::cout << "{\"error\":\"" << p.m_kind << "\""
+		<< ",\"inode\":" << p.m_inode
+		<< ",\"block\":" << p.m_block
+		<< ",\"detail\":\"" << JsonEscape(p.m_detail) << "\"}"
+		<< std::endl;
+}
+
+struct Extent {
+	uint32_t	m_first;
+	uint32_t	m_count;
+	uint32_t	m_inode;
+
+	bool operator<(Extent const &e) const noexcept
+	{ return m_first < e.m_first; }
+};
+
+/* a directory entry of either format, in host order */
+struct DirEntry {
+	std::string	m_name;
+	uint32_t	m_pos;		/* as the hash index refers to it */
+	uint32_t	m_block;
+	uint32_t	m_inode;
+	uint8_t		m_type;
+};
+
+/* Runs fn(idx, problems) for idx in [0, count) on the given number of
+ * threads; work is handed out in ascending order, so the reads issued by
+ * all the threads together move through the image sequentially. */
+template <typename Fn>
+void Parallel(size_t threads, size_t count, Problems &problems, Fn fn)
+{
+	std::atomic<size_t> next(0);
+	std::vector<Problems> found(threads);
+	std::vector<std::thread> workers;
+	std::exception_ptr error;
+	std::mutex lock;
+
+	for (size_t t = 0; t != threads; ++t)
+		workers.emplace_back([&, t] {
+			try {
+				size_t idx;
+				while ((idx = next++) < count)
+					fn(idx, found[t]);
+			} catch (...) {
+				std::lock_guard<std::mutex> guard(lock);
+				error = std::current_exception();
+				next = count;
+			}
+		});
+
+	for (std::thread &worker : workers)
+		worker.join();
+
+	if (error)
+		std::rethrow_exception(error);
+
+	for (Problems const &p : found)
+		problems.insert(problems.end(), p.begin(), p.end());
+}
+
+template <uint32_t BlockSize>
+class Checker {
+public:
+	using L = Layout<BlockSize>;
+
+	/* sb is the super block in host byte order */
+	explicit Checker(ConfigurationConstPtr config,
+			struct aufs_super_block const &sb, size_t threads)
+		: m_cache(config, true)
+		, m_blocks(config->Blocks())
+		, m_super_inode_blocks(sb.asb_inode_blocks)
+		, m_inode_blocks(std::min(sb.asb_inode_blocks, m_blocks))
+		, m_root(sb.asb_root_inode)
+		, m_features(sb.asb_features)
+		, m_compat_features(sb.asb_compat_features)
+		, m_csum_first(sb.asb_csum_first)
+		, m_csum_blocks(m_features & AUFS_FEATURE_CSUM ?
+					sb.asb_csum_blocks : 0)
+		, m_attrs_first(sb.asb_attrs_first)
+		, m_attrs_count(sb.asb_attrs_count)
+		, m_times_first(sb.asb_times_first)
+		, m_times_count(sb.asb_times_count)
+		, m_threads(std::max<size_t>(threads, 1))
+		, m_inode_shift(L::InodeShiftFor(m_features))
+		, m_inodes(std::min(m_inode_blocks << m_inode_shift,
+					L::BitsPerMap))
+		, m_table(m_inode_blocks << m_inode_shift)
+		, m_refs(m_inodes, 0)
+	{ }
+
+	Problems const & Check()
+	{
+		BlockPtr const block_map = m_cache.GetBlock(1);
+		BlockPtr const inode_map = m_cache.GetBlock(2);
+
+		m_block_map = block_map->Data();
+		m_inode_map = inode_map->Data();
+
+		CheckSuper();
+		LoadInodeTables();
+		ScanInodes();
+		CheckExtents();
+		CheckChecksums();
+		ScanDirs();
+		CheckLinks();
+
+		std::sort(m_problems.begin(), m_problems.end());
+		return m_problems;
+	}
+
+	size_t Inodes() const noexcept
+	{ return m_used; }
+
+	size_t Dirs() const noexcept
+	{ return m_dirs.size(); }
+
+private:
+	void Add(Problems &problems, char const *kind, uint32_t inode,
+			uint64_t block, std::string const &detail) const
+	{ problems.push_back(Problem{kind, inode, block, detail}); }
+
+	bool BlockFree(size_t no) const noexcept
+	{ return bool(BitIterator(m_block_map, 0)[no]); }
+
+	bool InodeUsed(uint32_t no) const noexcept
+	{ return no && no < m_inodes && !BitIterator(m_inode_map, 0)[no]; }
+
+	uint32_t DataStart() const noexcept
+	{ return L::InodeTableBlock + m_inode_blocks + m_csum_blocks; }
+
+	void CheckSuper()
+	{
+		if (L::InodeTableBlock + static_cast<uint64_t>(
+					m_super_inode_blocks) > m_blocks)
+			Add(m_problems, "inode-table-too-large", 0, 0,
+				"inode table does not fit into the device");
+
+		if (!InodeUsed(m_root))
+			Add(m_problems, "bad-root-inode", m_root, 0,
+				"root inode is not allocated");
+
+		if (m_features & ~AUFS_FEATURES_KNOWN) {
+			std::ostringstream detail;
+			detail << "unknown feature bits " << std::hex
+				<< (m_features & ~AUFS_FEATURES_KNOWN);
+			Add(m_problems, "unknown-features", 0, 0, detail.str());
+		}
+
+		if (!m_csum_blocks)
+			return;
+
+		uint32_t const sums_per_block = BlockSize / sizeof(uint32_t);
+		if (m_csum_first != L::InodeTableBlock + m_super_inode_blocks ||
+				static_cast<uint64_t>(m_csum_blocks) *
+					sums_per_block < m_blocks ||
+				static_cast<uint64_t>(m_csum_first) +
+					m_csum_blocks > m_blocks) {
+			std::ostringstream detail;
+			detail << "checksum table [" << m_csum_first << ", "
+				<< static_cast<uint64_t>(m_csum_first) +
+					m_csum_blocks
+				<< ") does not cover the device";
+			Add(m_problems, "bad-checksum-table", 0, m_csum_first,
+				detail.str());
+			m_csum_blocks = 0;
+		}
+	}
+
+	/* reads the attribute and time tables of compact inodes, they are
+	 * accounted for as extents of inode 0 */
+	void LoadInodeTables()
+	{
+		if (!(m_features & AUFS_FEATURE_COMPACT_INODES))
+			return;
+
+		LoadInodeTable("attribute", m_attrs_first, m_attrs_count,
+				m_attrs);
+		LoadInodeTable("time", m_times_first, m_times_count, m_times);
+
+		for (struct aufs_inode_attr &attr : m_attrs) {
+			attr.aia_uid = FromDisk32(attr.aia_uid);
+			attr.aia_gid = FromDisk32(attr.aia_gid);
+			attr.aia_mode = FromDisk32(attr.aia_mode);
+		}
+		for (uint64_t &time : m_times)
+			time = FromDisk64(time);
+	}
+
+	template <typename T>
+	void LoadInodeTable(char const *name, uint32_t first, uint32_t count,
+			std::vector<T> &table)
+	{
+		if (!count)
+			return;
+
+		uint64_t const blocks = (static_cast<uint64_t>(count) *
+					sizeof(T) + BlockSize - 1) / BlockSize;
+		if (count > AUFS_COMPACT_TABLE_MAX || first < DataStart() ||
+				first + blocks > m_blocks) {
+			std::ostringstream detail;
+			detail << "inode " << name << " table of " << count
+				<< " entries at block " << first
+				<< " is outside of the data area";
+			Add(m_problems, "bad-inode-table", 0, first,
+				detail.str());
+			return;
+		}
+
+		std::vector<uint8_t> data(blocks * BlockSize);
+		m_cache.ReadBlocks(first, blocks, data.data());
+		table.resize(count);
+		memcpy(table.data(), data.data(), count * sizeof(T));
+		m_extents.push_back(Extent{first,
+				static_cast<uint32_t>(blocks), 0});
+	}
+
+	void ScanInodes()
+	{
+		size_t const chunk = std::max<size_t>(1,
+					ReadChunkBytes / BlockSize);
+		size_t const blocks = std::min<size_t>(m_inode_blocks,
+					m_blocks > L::InodeTableBlock ?
+					m_blocks - L::InodeTableBlock : 0);
+		size_t const chunks = (blocks + chunk - 1) / chunk;
+
+		Parallel(m_threads, chunks, m_problems,
+			[&] (size_t idx, Problems &problems) {
+				size_t const first = idx * chunk;
+				size_t const count = std::min(chunk,
+							blocks - first);
+
+				ScanInodeBlocks(first, count, problems);
+			});
+
+		for (uint32_t no = 1; no != m_inodes; ++no) {
+			if (!InodeUsed(no))
+				continue;
+
+			struct aufs_inode *inode = &m_table[no];
+			uint32_t const mode = AI_MODE(inode);
+
+			++m_used;
+			if (S_ISDIR(mode))
+				m_dirs.push_back(no);
+			if (Listed(inode))
+				ScanExtentList(no);
+			else if (AI_BLOCKS(inode))
+				m_extents.push_back(Extent{
+					AI_FIRST_BLOCK(inode),
+					AI_BLOCKS(inode), no});
+		}
+	}
+
+	/* a regular file whose blocks are in an extent list */
+	bool Listed(struct aufs_inode *inode) const noexcept
+	{
+		return (m_features & AUFS_FEATURE_EXTENTS) &&
+			S_ISREG(AI_MODE(inode)) &&
+			(AI_FIRST_BLOCK(inode) & AUFS_EXTENT_LIST);
+	}
+
+	/* adds the runs of a file and its list block to the extents */
+	void ScanExtentList(uint32_t no)
+	{
+		struct aufs_inode *inode = &m_table[no];
+		uint32_t const list = AI_FIRST_BLOCK(inode) & ~AUFS_EXTENT_LIST;
+
+		if (list < DataStart() || list >= m_blocks) {
+			std::ostringstream detail;
+			detail << "extent list block " << list
+				<< " is outside of the data area";
+			Add(m_problems, "bad-extent-list", no, list,
+				detail.str());
+			return;
+		}
+
+		std::vector<uint8_t> data(BlockSize);
+		m_cache.ReadBlocks(list, 1, data.data());
+
+		struct aufs_extent_header *aeh =
+			reinterpret_cast<struct aufs_extent_header *>(
+				data.data());
+		struct aufs_extent *ae = reinterpret_cast<struct aufs_extent *>(
+					aeh + 1);
+		uint32_t const count = FromDisk32(AEH_COUNT(aeh));
+
+		m_extents.push_back(Extent{list, 1, no});
+		if (!count || count > AufsExtentsMax(BlockSize)) {
+			std::ostringstream detail;
+			detail << "extent list holds " << count << " runs";
+			Add(m_problems, "bad-extent-list", no, list,
+				detail.str());
+			return;
+		}
+
+		uint64_t total = 0;
+		for (uint32_t i = 0; i != count; ++i) {
+			uint32_t const first = FromDisk32(AE_FIRST_BLOCK(&ae[i]));
+			uint32_t const blocks = FromDisk32(AE_BLOCKS(&ae[i]));
+			uint64_t const end = static_cast<uint64_t>(first) +
+						blocks;
+
+			total += blocks;
+			if (!blocks || first < DataStart() || end > m_blocks) {
+				std::ostringstream detail;
+				detail << "run " << i << " [" << first << ", "
+					<< end << ") is outside of the data area";
+				Add(m_problems, "extent-out-of-range", no,
+					first, detail.str());
+				continue;
+			}
+			m_extents.push_back(Extent{first, blocks, no});
+		}
+
+		if (total != AI_BLOCKS(inode)) {
+			std::ostringstream detail;
+			detail << "runs hold " << total << " blocks, inode has "
+				<< AI_BLOCKS(inode);
+			Add(m_problems, "bad-extent-list", no, list,
+				detail.str());
+		}
+	}
+
+	void ScanInodeBlocks(size_t first, size_t count, Problems &problems)
+	{
+		std::vector<uint8_t> data(count * BlockSize);
+
+		m_cache.ReadBlocks(L::InodeTableBlock + first, count,
+					data.data());
+		for (size_t i = 0; i != count; ++i) {
+			uint32_t const base = (first + i) << m_inode_shift;
+			uint8_t const *block = data.data() + i * BlockSize;
+
+			if (m_features & AUFS_FEATURE_COMPACT_INODES)
+				DecodeCompactBlock(block, base, problems);
+			else
+				DecodeInodeBlock<BlockSize>(block,
+							&m_table[base]);
+			for (uint32_t no = base;
+					no != base + (1u << m_inode_shift); ++no)
+				if (InodeUsed(no) && AI_MODE(&m_table[no]))
+					CheckInode(no, problems);
+		}
+	}
+
+	/* expands the compact inodes of a table block into m_table; those
+	 * referring past the shared tables are left zero */
+	void DecodeCompactBlock(uint8_t const *block, uint32_t base,
+			Problems &problems)
+	{
+		struct aufs_compact_inode const *raw =
+			reinterpret_cast<struct aufs_compact_inode const *>(
+				block);
+
+		for (uint32_t i = 0; i != L::CompactInodesPerBlock; ++i) {
+			uint32_t const no = base + i;
+			uint32_t const attr = FromDisk16(raw[i].aci_attr);
+			uint32_t const time = FromDisk16(raw[i].aci_time);
+			struct aufs_inode *inode = &m_table[no];
+
+			if (!InodeUsed(no))
+				continue;
+
+			if (attr >= m_attrs.size() || time >= m_times.size()) {
+				std::ostringstream detail;
+				detail << "attribute " << attr << " of "
+					<< m_attrs.size() << ", time " << time
+					<< " of " << m_times.size();
+				Add(problems, "bad-inode-attr", no, 0,
+					detail.str());
+				continue;
+			}
+
+			inode->ai_first = FromDisk32(raw[i].aci_first);
+			inode->ai_blocks = FromDisk32(raw[i].aci_blocks);
+			inode->ai_size = FromDisk32(raw[i].aci_size);
+			inode->ai_uid = m_attrs[attr].aia_uid;
+			inode->ai_gid = m_attrs[attr].aia_gid;
+			inode->ai_mode = m_attrs[attr].aia_mode;
+			inode->ai_ctime = m_times[time];
+		}
+	}
+
+	void CheckInode(uint32_t no, Problems &problems)
+	{
+		struct aufs_inode *inode = &m_table[no];
+		uint32_t const mode = AI_MODE(inode);
+		uint32_t const first = AI_FIRST_BLOCK(inode);
+		uint32_t const blocks = AI_BLOCKS(inode);
+		uint32_t const size = AI_SIZE(inode);
+		uint64_t const end = static_cast<uint64_t>(first) + blocks;
+
+		if (!S_ISDIR(mode) && !S_ISREG(mode)) {
+			std::ostringstream detail;
+			detail << "unsupported mode " << std::oct << mode;
+			Add(problems, "bad-mode", no, 0, detail.str());
+			return;
+		}
+
+		if (blocks && !Listed(inode) &&
+				(first < DataStart() || end > m_blocks)) {
+			std::ostringstream detail;
+			detail << "extent [" << first << ", " << end
+				<< ") is outside of the data area";
+			Add(problems, "extent-out-of-range", no, first,
+				detail.str());
+		}
+
+		if (S_ISREG(mode) && L::BlocksFor(size) != blocks) {
+			std::ostringstream detail;
+			detail << "size " << size << " needs "
+				<< L::BlocksFor(size) << " blocks, inode has "
+				<< blocks;
+			Add(problems, "bad-size", no, first, detail.str());
+		}
+
+		if (S_ISDIR(mode) && AufsDirEntryBytes(size, m_features) >
+				(static_cast<uint64_t>(blocks) << L::BlockShift)) {
+			std::ostringstream detail;
+			detail << size << ((m_features &
+					AUFS_FEATURE_DIR_RECORDS) ?
+					" bytes of records" : " entries")
+				<< " do not fit into " << blocks << " blocks";
+			Add(problems, "bad-size", no, first, detail.str());
+		}
+	}
+
+	void CheckExtents()
+	{
+		std::vector<bool> used(m_blocks, false);
+
+		std::fill(used.begin(), used.begin() +
+			std::min<size_t>(DataStart(), m_blocks), true);
+		std::sort(m_extents.begin(), m_extents.end());
+
+		Extent const *prev = nullptr;
+		for (Extent const &e : m_extents) {
+			uint64_t const end = static_cast<uint64_t>(e.m_first) +
+						e.m_count;
+
+			if (prev && prev->m_first + prev->m_count > e.m_first) {
+				std::ostringstream detail;
+				if (prev->m_inode)
+					detail << "extent overlaps with inode "
+						<< prev->m_inode;
+				else
+					detail << "extent overlaps with the "
+						"inode attribute tables";
+				Add(m_problems, "overlapping-extent",
+					e.m_inode, e.m_first, detail.str());
+			}
+			if (!prev || end > prev->m_first + prev->m_count)
+				prev = &e;
+
+			for (uint64_t b = e.m_first;
+					b < std::min<uint64_t>(end, m_blocks); ++b)
+				used[b] = true;
+		}
+
+		for (size_t b = 0; b != L::BitsPerMap; ++b) {
+			bool const in_use = b < m_blocks && used[b];
+
+			if (in_use && BlockFree(b))
+				Add(m_problems, "block-in-use-marked-free", 0,
+					b, "referenced block is free in the map");
+			else if (!in_use && b < m_blocks && !BlockFree(b))
+				Add(m_problems, "leaked-block", 0, b,
+					"unreferenced block is used in the map");
+			else if (b >= m_blocks && BlockFree(b))
+				Add(m_problems, "block-beyond-device", 0, b,
+					"block past the end of the device is free");
+		}
+	}
+
+	void CheckChecksums()
+	{
+		if (!m_csum_blocks)
+			return;
+
+		size_t const chunk = std::max<size_t>(1,
+					ReadChunkBytes / BlockSize);
+		size_t const chunks = (m_blocks + chunk - 1) / chunk;
+
+		m_sums.resize(m_csum_blocks * (BlockSize / sizeof(uint32_t)));
+		m_cache.ReadBlocks(m_csum_first, m_csum_blocks,
+				reinterpret_cast<uint8_t *>(m_sums.data()));
+
+		Parallel(m_threads, chunks, m_problems,
+			[&] (size_t idx, Problems &problems) {
+				size_t const first = idx * chunk;
+				size_t const count = std::min(chunk,
+							m_blocks - first);
+
+				CheckChecksumBlocks(first, count, problems);
+			});
+	}
+
+	void CheckChecksumBlocks(size_t first, size_t count,
+				Problems &problems)
+	{
+		std::vector<uint8_t> data(count * BlockSize);
+
+		m_cache.ReadBlocks(first, count, data.data());
+		for (size_t i = 0; i != count; ++i) {
+			size_t const block = first + i;
+
+			if (BlockFree(block) || (block >= m_csum_first &&
+					block < m_csum_first + m_csum_blocks))
+				continue;
+
+			uint32_t const expected = FromDisk32(m_sums[block]);
+			uint32_t const actual = Crc32c(0,
+					data.data() + i * BlockSize, BlockSize);
+			if (expected != actual) {
+				std::ostringstream detail;
+				detail << "checksum " << std::hex << actual
+					<< " does not match stored "
+					<< expected;
+				Add(problems, "checksum-mismatch", 0, block,
+					detail.str());
+			}
+		}
+	}
+
+	void ScanDirs()
+	{
+		/* directories are visited in on-disk order */
+		std::sort(m_dirs.begin(), m_dirs.end(),
+			[&] (uint32_t l, uint32_t r) {
+				return AI_FIRST_BLOCK(&m_table[l]) <
+					AI_FIRST_BLOCK(&m_table[r]);
+			});
+		m_children.resize(m_dirs.size());
+
+		Parallel(m_threads, m_dirs.size(), m_problems,
+			[&] (size_t idx, Problems &problems) {
+				ScanDir(idx, problems);
+			});
+	}
+
+	void ScanDir(size_t idx, Problems &problems)
+	{
+		uint32_t const no = m_dirs[idx];
+		struct aufs_inode *inode = &m_table[no];
+		uint32_t const first = AI_FIRST_BLOCK(inode);
+		uint64_t const bytes = std::min(AufsDirEntryBytes(
+				AI_SIZE(inode), m_features),
+				static_cast<uint64_t>(AI_BLOCKS(inode)) <<
+					L::BlockShift);
+		uint32_t const blocks = L::BlocksFor(bytes);
+
+		if (!blocks || first < DataStart() ||
+				static_cast<uint64_t>(first) + blocks > m_blocks)
+			return;
+
+		std::vector<uint8_t> data(blocks * BlockSize);
+		std::vector<DirEntry> entries;
+		std::set<std::string> names;
+		std::string prev;
+		bool const types = m_compat_features & AUFS_COMPAT_DIR_TYPES;
+
+		m_cache.ReadBlocks(first, blocks, data.data());
+		if (m_features & AUFS_FEATURE_DIR_RECORDS)
+			ReadRecords(no, data, bytes, entries, problems);
+		else
+			ReadEntries(data, bytes, entries);
+
+		for (DirEntry const &entry : entries) {
+			std::string const &str = entry.m_name;
+			uint32_t const block = first + entry.m_block;
+			uint32_t const child = entry.m_inode;
+
+			if (str.empty() || str.size() > NameMax() ||
+					str.find('/') != std::string::npos ||
+					str.find('\0') != std::string::npos ||
+					str == "." || str == "..")
+				Add(problems, "bad-entry-name", no, block,
+					"invalid name \"" + str + "\"");
+			else if (!names.insert(str).second)
+				Add(problems, "duplicate-entry", no, block,
+					"name \"" + str + "\" is repeated");
+			else if ((m_features & AUFS_FEATURE_SORTED_DIRS) &&
+					&entry != &entries.front() &&
+					prev >= str)
+				Add(problems, "unsorted-entry", no, block,
+					"name \"" + str + "\" follows \"" +
+					prev + "\"");
+			prev = str;
+
+			if (!InodeUsed(child)) {
+				std::ostringstream detail;
+				detail << "entry \"" << str
+					<< "\" refers to unused inode "
+					<< child;
+				Add(problems, "dangling-entry", no, block,
+					detail.str());
+				continue;
+			}
+
+			uint32_t const type = (AI_MODE(&m_table[child]) &
+						S_IFMT) >> 12;
+			if (types && entry.m_type != type) {
+				std::ostringstream detail;
+				detail << "entry \"" << str << "\" has type "
+					<< unsigned(entry.m_type)
+					<< ", inode " << child << " has "
+					<< type;
+				Add(problems, "bad-entry-type", no, block,
+					detail.str());
+			}
+
+			m_children[idx].push_back(child);
+		}
+
+		if (m_features & (AUFS_FEATURE_DIR_BLOOM |
+					AUFS_FEATURE_DIR_INDEX))
+			CheckTail(no, blocks, entries, problems);
+	}
+
+	/* names must be null terminated in fixed size entries, and leave
+	 * the type byte alone if there is one */
+	size_t NameMax() const noexcept
+	{
+		if (m_features & AUFS_FEATURE_DIR_RECORDS)
+			return AUFS_REC_NAME_MAXLEN;
+		if (m_compat_features & AUFS_COMPAT_DIR_TYPES)
+			return AUFS_NAME_MAXLEN - 2;
+		return AUFS_NAME_MAXLEN - 1;
+	}
+
+	/* fixed size entries, names longer than NameMax() are kept so the
+	 * scan reports them */
+	void ReadEntries(std::vector<uint8_t> const &data, uint64_t bytes,
+			std::vector<DirEntry> &entries)
+	{
+		uint32_t const count = bytes / sizeof(struct aufs_dir_entry);
+
+		for (uint32_t i = 0; i != count; ++i) {
+			struct aufs_dir_entry const *entry =
+				reinterpret_cast<struct aufs_dir_entry const *>(
+					data.data()) + i;
+			char const *name = ADE_NAME(entry);
+
+			entries.push_back(DirEntry{std::string(name,
+					strnlen(name, NameMax() + 1)), i,
+				i >> L::EntryShift,
+				FromDisk32(entry->ade_inode),
+				ADE_TYPE(entry)});
+		}
+	}
+
+	/* variable length records; a damaged record ends the directory,
+	 * there is no telling where the next one starts */
+	void ReadRecords(uint32_t no, std::vector<uint8_t> const &data,
+			uint64_t bytes, std::vector<DirEntry> &entries,
+			Problems &problems)
+	{
+		uint32_t const first = AI_FIRST_BLOCK(&m_table[no]);
+
+		for (uint64_t off = 0; off < bytes; ) {
+			uint32_t const block = off >> L::BlockShift;
+			uint64_t const block_end = std::min<uint64_t>(bytes,
+					static_cast<uint64_t>(block + 1) <<
+						L::BlockShift);
+			struct aufs_dir_rec const *rec =
+				reinterpret_cast<struct aufs_dir_rec const *>(
+					data.data() + off);
+			std::ostringstream detail;
+
+			if (block_end - off < sizeof(struct aufs_dir_rec)) {
+				detail << "record at " << off
+					<< " is cut off by the directory end";
+				Add(problems, "bad-dir-record", no,
+					first + block, detail.str());
+				return;
+			}
+
+			uint32_t const rec_len = FromDisk16(rec->adr_rec_len);
+			if (!rec_len) {
+				if (std::any_of(data.data() + off,
+						data.data() + block_end,
+						[] (uint8_t b) { return b; })) {
+					detail << "block padding at " << off
+						<< " is not zero";
+					Add(problems, "bad-dir-record", no,
+						first + block, detail.str());
+				}
+				off = block_end;
+				continue;
+			}
+
+			if (rec_len % AUFS_REC_ALIGN ||
+					rec_len < AufsRecLen(rec->adr_name_len) ||
+					rec_len > block_end - off) {
+				detail << "record at " << off
+					<< " has a bad length " << rec_len;
+				Add(problems, "bad-dir-record", no,
+					first + block, detail.str());
+				return;
+			}
+
+			entries.push_back(DirEntry{std::string(ADR_NAME(rec),
+					rec->adr_name_len),
+				static_cast<uint32_t>(off), block,
+				FromDisk32(rec->adr_inode), rec->adr_type});
+			off += rec_len;
+		}
+	}
+
+	/* the blocks past the entries: a Bloom filter, then a hash index */
+	void CheckTail(uint32_t no, uint32_t entry_blocks,
+			std::vector<DirEntry> const &entries, Problems &problems)
+	{
+		struct aufs_inode *inode = &m_table[no];
+		uint32_t const first = AI_FIRST_BLOCK(inode) + entry_blocks;
+
+		if (AI_BLOCKS(inode) <= entry_blocks ||
+				static_cast<uint64_t>(AI_FIRST_BLOCK(inode)) +
+					AI_BLOCKS(inode) > m_blocks)
+			return;
+
+		uint32_t const blocks = AI_BLOCKS(inode) - entry_blocks;
+		uint32_t bloom_blocks = 0;
+		std::vector<uint8_t> tail(blocks * BlockSize);
+
+		m_cache.ReadBlocks(first, blocks, tail.data());
+		if (m_features & AUFS_FEATURE_DIR_BLOOM) {
+			uint32_t const bytes = AufsBloomBytes(AufsDirNamesMax(
+					AI_SIZE(inode), m_features));
+
+			bloom_blocks = L::BlocksFor(bytes);
+			if (bloom_blocks > blocks) {
+				Add(problems, "bad-dir-bloom", no, first,
+					"no room for the Bloom filter");
+				return;
+			}
+			CheckBloom(no, entries, tail.data(), bytes, first,
+				problems);
+		}
+
+		if ((m_features & AUFS_FEATURE_DIR_INDEX) &&
+				blocks > bloom_blocks)
+			CheckIndex(no, entries,
+				tail.data() + bloom_blocks * BlockSize,
+				first + bloom_blocks, blocks - bloom_blocks,
+				problems);
+	}
+
+	/* a filter that misses a name would hide it from lookups */
+	void CheckBloom(uint32_t no, std::vector<DirEntry> const &entries,
+			uint8_t const *bloom, uint32_t bytes, uint32_t first,
+			Problems &problems)
+	{
+		uint32_t const mask = bytes * 8 - 1;
+
+		for (DirEntry const &entry : entries) {
+			std::string const &name = entry.m_name;
+			uint32_t const hash = AufsNameHash(name.data(),
+						name.size());
+			uint32_t const step = AufsBloomStep(hash);
+
+			for (uint32_t k = 0; k != AUFS_BLOOM_HASHES; ++k) {
+				uint32_t const bit = (hash + k * step) & mask;
+
+				if (bloom[bit / 8] & (1u << (bit % 8)))
+					continue;
+				Add(problems, "bad-dir-bloom", no,
+					first + (bit / 8) / BlockSize,
+					"entry \"" + name +
+					"\" is missing from the Bloom filter");
+				break;
+			}
+		}
+	}
+
+	/* every entry must be reachable from its home slot without crossing
+	 * a free one, and every used slot must point at a matching entry */
+	void CheckIndex(uint32_t no, std::vector<DirEntry> const &entries,
+			uint8_t const *index, uint32_t first, uint32_t blocks,
+			Problems &problems)
+	{
+		uint32_t const slots = AufsIndexSlots(
+				static_cast<uint64_t>(blocks) << L::BlockShift);
+		uint32_t const mask = slots - 1;
+		if (slots <= entries.size()) {
+			std::ostringstream detail;
+			detail << "index has " << slots << " slots for "
+				<< entries.size() << " entries";
+			Add(problems, "bad-dir-index", no, first, detail.str());
+			return;
+		}
+
+		std::vector<bool> seen(entries.size(), false);
+		struct aufs_dir_slot const *table =
+			reinterpret_cast<struct aufs_dir_slot const *>(index);
+		auto const by_pos = [] (DirEntry const &entry, uint32_t pos) {
+			return entry.m_pos < pos;
+		};
+
+		for (uint32_t s = 0; s != slots; ++s) {
+			uint32_t const pos = FromDisk32(table[s].ads_pos);
+			uint32_t const hash = FromDisk32(table[s].ads_hash);
+			uint32_t const block = first + ((s *
+				sizeof(struct aufs_dir_slot)) >> L::BlockShift);
+			std::ostringstream detail;
+
+			if (!pos)
+				continue;
+
+			/* entries come in position order */
+			auto const it = std::lower_bound(entries.begin(),
+					entries.end(), pos - 1, by_pos);
+			size_t const i = it - entries.begin();
+
+			detail << "slot " << s << " ";
+			if (it == entries.end() || it->m_pos != pos - 1 ||
+					seen[i]) {
+				detail << "refers to entry " << pos - 1;
+				Add(problems, "bad-dir-index", no, block,
+					detail.str());
+				continue;
+			}
+
+			if (hash != AufsNameHash(it->m_name.data(),
+					it->m_name.size())) {
+				detail << "has a wrong hash for \""
+					<< it->m_name << "\"";
+				Add(problems, "bad-dir-index", no, block,
+					detail.str());
+				continue;
+			}
+
+			uint32_t probe = hash & mask;
+			while (probe != s && table[probe].ads_pos)
+				probe = (probe + 1) & mask;
+			if (probe != s) {
+				detail << "cannot be reached from slot "
+					<< (hash & mask);
+				Add(problems, "bad-dir-index", no, block,
+					detail.str());
+				continue;
+			}
+			seen[i] = true;
+		}
+
+		for (size_t i = 0; i != entries.size(); ++i)
+			if (!seen[i])
+				Add(problems, "bad-dir-index", no, first,
+					"entry \"" + entries[i].m_name +
+					"\" is missing from the index");
+	}
+
+	void CheckLinks()
+	{
+		std::vector<uint32_t> dir_index(m_inodes, m_dirs.size());
+		for (size_t i = 0; i != m_dirs.size(); ++i)
+			dir_index[m_dirs[i]] = i;
+
+		for (std::vector<uint32_t> const &children : m_children)
+			for (uint32_t child : children)
+				++m_refs[child];
+
+		/* everything allocated must be reachable from the root */
+		std::vector<bool> seen(m_inodes, false);
+		std::vector<uint32_t> queue;
+		if (InodeUsed(m_root)) {
+			queue.push_back(m_root);
+			seen[m_root] = true;
+		}
+		while (!queue.empty()) {
+			uint32_t const no = queue.back();
+			queue.pop_back();
+
+			if (dir_index[no] == m_dirs.size())
+				continue;
+			for (uint32_t child : m_children[dir_index[no]])
+				if (!seen[child]) {
+					seen[child] = true;
+					queue.push_back(child);
+				}
+		}
+
+		for (uint32_t no = 1; no != m_inodes; ++no) {
+			if (!InodeUsed(no))
+				continue;
+
+			if (no == m_root && m_refs[no])
+				Add(m_problems, "root-has-parent", no, 0,
+					"root inode is referenced by a directory");
+			else if (no != m_root && m_refs[no] > 1)
+				Add(m_problems, "multiply-linked", no, 0,
+					"inode is referenced " +
+					std::to_string(m_refs[no]) + " times");
+
+			if (!seen[no])
+				Add(m_problems, "orphan-inode", no, 0,
+					"inode is not reachable from the root");
+		}
+	}
+
+	BlocksCache				m_cache;
+	uint32_t				m_blocks;
+	uint32_t				m_super_inode_blocks;
+	uint32_t				m_inode_blocks;
+	uint32_t				m_root;
+	uint32_t				m_features;
+	uint32_t				m_compat_features;
+	uint32_t				m_csum_first;
+	uint32_t				m_csum_blocks;
+	uint32_t				m_attrs_first;
+	uint32_t				m_attrs_count;
+	uint32_t				m_times_first;
+	uint32_t				m_times_count;
+	size_t					m_threads;
+	uint32_t				m_inode_shift;
+	uint32_t				m_inodes;
+	uint8_t *				m_block_map = nullptr;
+	uint8_t *				m_inode_map = nullptr;
+	std::vector<struct aufs_inode>		m_table;
+	/* host order, compact inodes only */
+	std::vector<struct aufs_inode_attr>	m_attrs;
+	std::vector<uint64_t>			m_times;
+	std::vector<uint32_t>			m_refs;
+	std::vector<uint32_t>			m_sums;
+	std::vector<uint32_t>			m_dirs;
+	std::vector<Extent>			m_extents;
+	std::vector<std::vector<uint32_t>>	m_children;
+	Problems				m_problems;
+	size_t					m_used = 0;
+};
+
+struct CheckImage {
+	ConfigurationConstPtr	m_config;
+	struct aufs_super_block	m_super;
+	size_t			m_threads;
+
+	template <uint32_t BlockSize>
+	size_t Run() const
+	{
+		auto const start = std::chrono::steady_clock::now();
+		Checker<BlockSize> checker(m_config, m_super, m_threads);
+		Problems const &problems = checker.Check();
+		auto const finish = std::chrono::steady_clock::now();
+
+		for (Problem const &p : problems)
+			Report(p);
+
+		std::cout << "{\"summary\":\"" << JsonEscape(m_config->Device())
+			<< "\",\"block_size\":" << BlockSize
+			<< ",\"blocks\":" << m_config->Blocks()
+			<< ",\"inodes\":" << checker.Inodes()
+			<< ",\"dirs\":" << checker.Dirs()
+			<< ",\"errors\":" << problems.size()
+			<< ",\"seconds\":" << std::chrono::duration<double>(
+						finish - start).count()
+			<< "}" << std::endl;
+
+		return problems.size();
+	}
+};
+
+size_t DeviceSize(std::string const & device)
+{
+	std::ifstream in(device.c_str(),
+		std::ios::in | std::ios::binary | std::ios::ate);
+	std::streampos const size = in.tellg();
+
+	return static_cast<size_t>(size);
+}
+
+void PrintHelp()
+{
+	std::cout << "Usage:" << std::endl
+		<< "\tfsck.aufs [(--threads | -j) THREADS] DEVICE"
+		<< std::endl << std::endl
+		<< "Where:" << std::endl
+		<< "\tTHREADS - number of scanning threads. Default is the number of CPUs." << std::endl
+		<< "\tDEVICE  - device file." << std::endl << std::endl
+		<< "Every problem found is printed as one JSON object per line, followed by a summary line." << std::endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	std::string device;
+	size_t threads = std::thread::hardware_concurrency();
+
+	--argc;
+	++argv;
+	while (argc--) {
+		std::string const arg(*argv++);
+		if ((arg == "--threads" || arg == "-j") && argc) {
+			threads = std::stoi(*argv++);
+			--argc;
+		} else if (arg == "--help" || arg == "-h") {
+			PrintHelp();
+			return FsckOk;
+		} else {
+			device = arg;
+		}
+	}
+
+	try {
+		if (device.empty())
+			throw std::runtime_error("Device name expected");
+
+		struct aufs_super_block sb;
+		std::ifstream in(device.c_str(),
+			std::ios::in | std::ios::binary);
+		if (!in.read(reinterpret_cast<char *>(&sb), sizeof(sb)))
+			throw std::runtime_error("Cannot read super block");
+
+		if (FromDisk32(ASB_MAGIC(&sb)) != AUFS_MAGIC)
+			throw std::runtime_error("Wrong magic number");
+
+		uint32_t const block_size = FromDisk32(ASB_BLOCK_SIZE(&sb));
+		if (block_size != 512u && block_size != 1024u &&
+				block_size != 2048u && block_size != 4096u)
+			throw std::runtime_error("Unsupported block size");
+
+		uint32_t const blocks = std::min<size_t>(
+				DeviceSize(device) / block_size, block_size * 8);
+		ConfigurationConstPtr config = std::make_shared<Configuration>(
+				device, "", blocks, block_size);
+
+		FromDiskWords(reinterpret_cast<uint32_t *>(&sb),
+				sizeof(sb) / sizeof(uint32_t));
+		size_t const errors = DispatchBlockSize(block_size,
+			CheckImage{config, sb, threads});
+
+		return errors ? FsckErrors : FsckOk;
+	} catch (std::exception const & e) {
+		std::cout << "{\"fatal\":\"" << JsonEscape(e.what()) << "\"}"
+			<< std::endl;
+	}
+
+	return FsckFailed;
+}
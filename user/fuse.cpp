@@ -0,0 +1,528 @@
+#define FUSE_USE_VERSION 34
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <sys/statvfs.h>
+
+#include "image.hpp"
+
+namespace
+{
+
+/* the image never changes under us, so the kernel may cache for long */
+static double const DefaultTimeout = 86400.0;
+
+struct Child {
+	char const *	m_name;
+	uint32_t	m_len;
+	uint32_t	m_inode;
+};
+
+bool NameLess(char const *l, size_t llen, char const *r, size_t rlen)
+	noexcept
+{
+	int const cmp = memcmp(l, r, std::min(llen, rlen));
+
+	return cmp < 0 || (cmp == 0 && llen < rlen);
+}
+
+/* Lookup index built once at startup: the entries of every directory
+ * sorted by name (the names still point into the image), the parent of
+ * every directory and the link counts. It is never modified afterwards,
+ * so all the worker threads use it without locks. */
+class Index {
+public:
+	explicit Index(Image const &image)
+		: m_children(image.Inodes())
+		, m_parent(image.Inodes(), 0)
+		, m_links(image.Inodes(), 1)
+	{
+		InodeView const root = image.GetInode(image.RootInode());
+		std::vector<uint32_t> queue(1, image.RootInode());
+
+		if (!root || !root.IsDir())
+			throw ImageError("Root inode is not a directory");
+
+		m_parent[image.RootInode()] = image.RootInode();
+		m_links[image.RootInode()] = 2;
+		while (!queue.empty()) {
+			uint32_t const dir = queue.back();
+			std::vector<Child> &children = m_children[dir];
+
+			queue.pop_back();
+			for (DirEntryView const view :
+					image.Entries(image.GetInode(dir))) {
+				InodeView const child =
+					image.GetInode(view.InodeNo());
+
+				/* hard links and loops are not a thing in aufs,
+				 * a damaged image must not hang us */
+				if (!child || m_parent[child.InodeNo()])
+					continue;
+
+				children.push_back(Child{view.Name(),
+					static_cast<uint32_t>(view.NameLen()),
+					child.InodeNo()});
+				if (child.IsDir()) {
+					m_parent[child.InodeNo()] = dir;
+					m_links[child.InodeNo()] = 2;
+					++m_links[dir];
+					queue.push_back(child.InodeNo());
+				}
+			}
+
+			std::sort(children.begin(), children.end(),
+				[] (Child const &l, Child const &r) {
+					return NameLess(l.m_name, l.m_len,
+							r.m_name, r.m_len);
+				});
+		}
+	}
+
+	uint32_t Lookup(uint32_t dir, char const *name, size_t len)
+		const noexcept
+	{
+		std::vector<Child> const &children = m_children[dir];
+		auto it = std::lower_bound(children.begin(), children.end(),
+			Child{name, static_cast<uint32_t>(len), 0},
+			[] (Child const &l, Child const &r) {
+				return NameLess(l.m_name, l.m_len,
+						r.m_name, r.m_len);
+			});
+
+		if (it == children.end() || it->m_len != len ||
+				memcmp(it->m_name, name, len))
+			return 0;
+		return it->m_inode;
+	}
+
+	std::vector<Child> const & Children(uint32_t dir) const noexcept
+	{ return m_children[dir]; }
+
+	uint32_t Parent(uint32_t dir) const noexcept
+	{ return m_parent[dir]; }
+
+	uint32_t Links(uint32_t inode) const noexcept
+	{ return m_links[inode]; }
+
+private:
+	std::vector<std::vector<Child>>	m_children;
+	std::vector<uint32_t>		m_parent;
+	std::vector<uint32_t>		m_links;
+};
+
+struct Server {
+	Server(char const *path, double timeout)
+		: m_image(path)
+		, m_index(m_image)
+		, m_timeout(timeout)
+	{ }
+
+	/* FUSE insists on 1 for the root, so the root and inode 1 swap
+	 * their numbers; the same function maps in both directions */
+	uint32_t MapInode(fuse_ino_t ino) const noexcept
+	{
+		if (ino == FUSE_ROOT_ID)
+			return m_image.RootInode();
+		if (ino == m_image.RootInode())
+			return FUSE_ROOT_ID;
+		return ino <= UINT32_MAX ? static_cast<uint32_t>(ino) : 0;
+	}
+
+	void FillAttr(InodeView inode, struct stat *st) const noexcept
+	{
+		memset(st, 0, sizeof(*st));
+		st->st_ino = MapInode(inode.InodeNo());
+		st->st_mode = inode.Mode();
+		st->st_nlink = m_index.Links(inode.InodeNo());
+		st->st_uid = inode.Uid();
+		st->st_gid = inode.Gid();
+		st->st_size = inode.Size();
+		st->st_blksize = m_image.BlockSize();
+		st->st_blocks = static_cast<blkcnt_t>(inode.BlocksCount()) *
+					(m_image.BlockSize() / 512);
+		st->st_atime = st->st_mtime = st->st_ctime =
+			static_cast<time_t>(inode.CreateTime());
+	}
+
+	void FillEntry(InodeView inode, struct fuse_entry_param *e)
+		const noexcept
+	{
+		memset(e, 0, sizeof(*e));
+		e->ino = MapInode(inode.InodeNo());
+		e->attr_timeout = m_timeout;
+		e->entry_timeout = m_timeout;
+		FillAttr(inode, &e->attr);
+	}
+
+	Image	m_image;
+	Index	m_index;
+	double	m_timeout;
+};
+
+Server & GetServer(fuse_req_t req)
+{ return *static_cast<Server *>(fuse_req_userdata(req)); }
+
+void AufsInit(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+		conn->want |= FUSE_CAP_SPLICE_MOVE;
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+	conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+}
+
+void AufsLookup(fuse_req_t req, fuse_ino_t parent, char const *name)
+{
+	Server const &server = GetServer(req);
+	InodeView const dir = server.m_image.GetInode(
+				server.MapInode(parent));
+	size_t const len = strlen(name);
+
+	if (!dir || !dir.IsDir()) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	if (len > server.m_image.NameMax()) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	InodeView const inode = server.m_image.GetInode(
+			server.m_index.Lookup(dir.InodeNo(), name, len));
+	if (!inode) {
+		/* a zero inode is a negative entry cached just as long */
+		struct fuse_entry_param e;
+
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = server.m_timeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	struct fuse_entry_param e;
+	server.FillEntry(inode, &e);
+	fuse_reply_entry(req, &e);
+}
+
+void AufsGetattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	Server const &server = GetServer(req);
+	InodeView const inode = server.m_image.GetInode(server.MapInode(ino));
+	struct stat st;
+
+	(void) fi;
+	if (!inode) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	server.FillAttr(inode, &st);
+	fuse_reply_attr(req, &st, server.m_timeout);
+}
+
+void AufsOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	Server const &server = GetServer(req);
+	InodeView const inode = server.m_image.GetInode(server.MapInode(ino));
+
+	if (!inode) {
+		fuse_reply_err(req, ENOENT);
+	} else if (!inode.IsFile()) {
+		fuse_reply_err(req, EISDIR);
+	} else if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EROFS);
+	} else {
+		fi->keep_cache = 1;
+		fuse_reply_open(req, fi);
+	}
+}
+
+/* the data goes from the image fd to /dev/fuse with splice() when the
+ * kernel supports it, and is never copied through our memory; a file
+ * split over several runs takes a buffer per run the read touches */
+void AufsRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			struct fuse_file_info *fi)
+{
+	Server const &server = GetServer(req);
+	Image const &image = server.m_image;
+	InodeView const inode = image.GetInode(server.MapInode(ino));
+	size_t const extents = image.ExtentsCount(inode);
+
+	(void) fi;
+	if (!inode) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	std::unique_ptr<char[]> mem(new char[sizeof(struct fuse_bufvec) +
+				extents * sizeof(struct fuse_buf)]);
+	struct fuse_bufvec *buf = reinterpret_cast<struct fuse_bufvec *>(
+				mem.get());
+	uint64_t pos = 0;
+
+	memset(buf, 0, sizeof(*buf));
+	for (size_t i = 0; i != extents && size && off >= 0; ++i) {
+		FileExtent const extent = image.Extent(inode, i);
+		size_t const bytes = image.ExtentData(inode, i).Size();
+		uint64_t const end = pos + bytes;
+
+		if (static_cast<uint64_t>(off) < end) {
+			struct fuse_buf &b = buf->buf[buf->count++];
+			size_t const skip = off - pos;
+			size_t const len = std::min(size, bytes - skip);
+
+			memset(&b, 0, sizeof(b));
+			b.size = len;
+			b.flags = static_cast<enum fuse_buf_flags>(
+					FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+			b.fd = image.Fd();
+			b.pos = static_cast<off_t>(extent.m_first) *
+					image.BlockSize() + skip;
+			off += len;
+			size -= len;
+		}
+
+		/* a run cut short by the end of the image ends the file */
+		if (bytes != static_cast<uint64_t>(extent.m_blocks) *
+				image.BlockSize())
+			break;
+		pos = end;
+	}
+
+	if (!buf->count) {
+		fuse_reply_buf(req, nullptr, 0);
+		return;
+	}
+	fuse_reply_data(req, buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+void AufsOpendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	Server const &server = GetServer(req);
+	InodeView const inode = server.m_image.GetInode(server.MapInode(ino));
+
+	if (!inode) {
+		fuse_reply_err(req, ENOENT);
+	} else if (!inode.IsDir()) {
+		fuse_reply_err(req, ENOTDIR);
+	} else {
+		fi->keep_cache = 1;
+		fi->cache_readdir = 1;
+		fuse_reply_open(req, fi);
+	}
+}
+
+/* Offsets: 1 and 2 follow "." and "..", n + 3 follows the n-th child in
+ * the sorted order of the index. */
+void DoReaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			bool plus)
+{
+	Server const &server = GetServer(req);
+	uint32_t const dir = server.MapInode(ino);
+	InodeView const inode = server.m_image.GetInode(dir);
+
+	if (!inode || !inode.IsDir()) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	std::vector<Child> const &children = server.m_index.Children(dir);
+	std::unique_ptr<char[]> buf(new char[size]);
+	size_t used = 0;
+
+	for (size_t pos = std::max<off_t>(off, 0);
+			pos < children.size() + 2; ++pos) {
+		char name[AUFS_REC_NAME_MAXLEN + 1];
+		InodeView entry;
+		size_t len;
+
+		if (pos == 0) {
+			strcpy(name, ".");
+			entry = inode;
+		} else if (pos == 1) {
+			strcpy(name, "..");
+			entry = server.m_image.GetInode(
+					server.m_index.Parent(dir));
+			if (!entry)
+				entry = inode;
+		} else {
+			Child const &child = children[pos - 2];
+
+			memcpy(name, child.m_name, child.m_len);
+			name[child.m_len] = '\0';
+			entry = server.m_image.GetInode(child.m_inode);
+		}
+
+		struct fuse_entry_param e;
+		server.FillEntry(entry, &e);
+		/* no lookup reference for "." and "..", only attributes */
+		if (pos < 2)
+			e.ino = 0;
+		if (plus)
+			len = fuse_add_direntry_plus(req, buf.get() + used,
+					size - used, name, &e, pos + 1);
+		else
+			len = fuse_add_direntry(req, buf.get() + used,
+					size - used, name, &e.attr, pos + 1);
+		if (len > size - used)
+			break;
+		used += len;
+	}
+
+	fuse_reply_buf(req, buf.get(), used);
+}
+
+void AufsReaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			struct fuse_file_info *fi)
+{
+	(void) fi;
+	DoReaddir(req, ino, size, off, false);
+}
+
+void AufsReaddirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			struct fuse_file_info *fi)
+{
+	(void) fi;
+	DoReaddir(req, ino, size, off, true);
+}
+
+void AufsStatfs(fuse_req_t req, fuse_ino_t ino)
+{
+	Server const &server = GetServer(req);
+	Image const &image = server.m_image;
+	Span<uint8_t const> const block_map = image.BlockMap();
+	Span<uint8_t const> const inode_map = image.InodeMap();
+	struct statvfs st;
+
+	(void) ino;
+	memset(&st, 0, sizeof(st));
+	st.f_bsize = st.f_frsize = image.BlockSize();
+	st.f_blocks = image.Blocks();
+	st.f_files = image.Inodes();
+	st.f_namemax = image.NameMax();
+	for (uint8_t byte : block_map)
+		st.f_bfree += __builtin_popcount(byte);
+	for (uint8_t byte : inode_map)
+		st.f_ffree += __builtin_popcount(byte);
+	st.f_flag = ST_RDONLY;
+	fuse_reply_statfs(req, &st);
+}
+
+struct fuse_lowlevel_ops MakeOps()
+{
+	struct fuse_lowlevel_ops ops;
+
+	memset(&ops, 0, sizeof(ops));
+	ops.init = AufsInit;
+	ops.lookup = AufsLookup;
+	ops.getattr = AufsGetattr;
+	ops.open = AufsOpen;
+	ops.read = AufsRead;
+	ops.opendir = AufsOpendir;
+	ops.readdir = AufsReaddir;
+	ops.readdirplus = AufsReaddirplus;
+	ops.statfs = AufsStatfs;
+	return ops;
+}
+
+struct Options {
+	double	m_timeout;
+};
+
+struct fuse_opt const OptionSpecs[] = {
+	{ "timeout=%lf", offsetof(Options, m_timeout), 0 },
+	FUSE_OPT_END
+};
+
+void PrintHelp()
+{
+	std::cout << "Usage:" << std::endl
+		<< "\taufs-fuse IMAGE MOUNTPOINT [-o timeout=SECONDS] [FUSE OPTIONS]"
+		<< std::endl << std::endl
+		<< "Where:" << std::endl
+		<< "\tIMAGE   - aufs image or device." << std::endl
+		<< "\tSECONDS - attribute and entry cache timeout. Default is one day." << std::endl
+		<< std::endl << "FUSE options:" << std::endl;
+	fuse_cmdline_help();
+	fuse_lowlevel_help();
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argv[1][0] == '-') {
+		PrintHelp();
+		return 1;
+	}
+
+	char const *const image = argv[1];
+	struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv + 1);
+	struct fuse_cmdline_opts opts;
+	Options options = { DefaultTimeout };
+	int ret = 1;
+
+	if (fuse_opt_parse(&args, &options, OptionSpecs, nullptr) ||
+			fuse_opt_add_arg(&args,
+				"-oro,default_permissions,subtype=aufs") ||
+			fuse_parse_cmdline(&args, &opts)) {
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+
+	if (opts.show_help || !opts.mountpoint) {
+		PrintHelp();
+		fuse_opt_free_args(&args);
+		free(opts.mountpoint);
+		return opts.show_help ? 0 : 1;
+	}
+
+	try {
+		Server server(image, options.m_timeout);
+		struct fuse_lowlevel_ops const ops = MakeOps();
+		struct fuse_session *se = fuse_session_new(&args, &ops,
+						sizeof(ops), &server);
+
+		if (se && !fuse_set_signal_handlers(se)) {
+			if (!fuse_session_mount(se, opts.mountpoint)) {
+				fuse_daemonize(opts.foreground);
+				if (opts.singlethread) {
+					ret = fuse_session_loop(se);
+				} else {
+					struct fuse_loop_config config;
+
+					config.clone_fd = opts.clone_fd;
+					config.max_idle_threads =
+						opts.max_idle_threads;
+					ret = fuse_session_loop_mt(se, &config);
+				}
+				fuse_session_unmount(se);
+			}
+			fuse_remove_signal_handlers(se);
+		}
+		if (se)
+			fuse_session_destroy(se);
+	} catch (std::exception const & e) {
+		std::cout << "ERROR: " << e.what() << std::endl;
+	}
+
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,161 @@
+#!/bin/sh
+#
+# Compares aufs-fuse with the kernel module on the same image:
+#
+#	fuse_bench.sh [--check] [IMAGE [JOBS]]
+#
+# Every mount is first checked against what aufs-extract unpacks from the
+# image: the trees must list and read the same, or the script fails. With
+# --check only that is done, on a small generated image if none is given.
+#
+# Every pass walks the whole tree (metadata), then reads every file once
+# sequentially and once with JOBS parallel readers. The kernel module is
+# only measured when running as root with aufs.ko loaded. Caches can only
+# be dropped by root, so the reports of other runs say "cache":"warm" and
+# are no cold read numbers.
+
+set -e
+
+CHECK=
+if [ "$1" = "--check" ]; then
+	CHECK=1
+	shift
+fi
+
+IMAGE=$1
+JOBS=${2:-4}
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+if [ -z "$IMAGE" ] && [ -z "$CHECK" ]; then
+	echo "Usage: $0 [--check] [IMAGE [JOBS]]" >&2
+	exit 1
+fi
+
+MNT=$(mktemp -d)
+WORK=$(mktemp -d)
+trap 'fusermount3 -u "$MNT" 2>/dev/null || umount "$MNT" 2>/dev/null || true; rmdir "$MNT"; rm -rf "$WORK"' EXIT
+
+fail()
+{
+	echo "ERROR: $*" >&2
+	exit 1
+}
+
+# a few levels of directories, empty, small and multi-block files
+make_image()
+{
+	tree=$WORK/tree
+
+	mkdir -p "$tree/dir/sub/deeper" "$tree/empty"
+	: > "$tree/dir/zero"
+	echo hello > "$tree/hello"
+	for i in $(seq 1 300); do
+		echo "file $i" > "$tree/dir/sub/f$i"
+	done
+	head -c 1048577 /dev/urandom > "$tree/dir/sub/deeper/large"
+
+	IMAGE=$WORK/image
+	truncate -s 64M "$IMAGE"
+	"$HERE/mkfs.aufs" -d "$tree" "$IMAGE" > /dev/null ||
+		fail "mkfs.aufs failed"
+}
+
+# the mount must hold exactly what aufs-extract unpacks
+check()
+{
+	name=$1
+	ref=$WORK/ref
+
+	grep -q " $MNT " /proc/mounts || fail "$name: $MNT is not mounted"
+	if [ ! -d "$ref" ]; then
+		"$HERE/aufs-extract" "$IMAGE" "$ref" > /dev/null ||
+			fail "aufs-extract failed"
+	fi
+
+	ls -lR "$MNT" > /dev/null || fail "$name: cannot list the tree"
+	(cd "$ref" && find . | sort) > "$WORK/ref.list"
+	(cd "$MNT" && find . | sort) > "$WORK/mnt.list" ||
+		fail "$name: cannot walk the tree"
+	diff -u "$WORK/ref.list" "$WORK/mnt.list" >&2 ||
+		fail "$name: the tree differs from the image"
+	find "$MNT" -type f -exec cat {} + > /dev/null ||
+		fail "$name: cannot read the files"
+	diff -r "$ref" "$MNT" >&2 ||
+		fail "$name: file contents differ from the image"
+	echo "$name: $(wc -l < "$WORK/mnt.list") entries check out" >&2
+}
+
+now()
+{
+	date +%s.%N
+}
+
+elapsed()
+{
+	awk -v start="$1" -v finish="$2" 'BEGIN { print finish - start }'
+}
+
+if [ "$(id -u)" -eq 0 ]; then
+	CACHE=cold
+else
+	CACHE=warm
+	echo "not root, caches are not dropped and reads are warm" >&2
+fi
+
+drop_caches()
+{
+	if [ "$CACHE" = cold ]; then
+		sync
+		echo 3 > /proc/sys/vm/drop_caches
+	fi
+}
+
+# prints one JSON line per measurement
+measure()
+{
+	name=$1
+
+	drop_caches
+	start=$(now)
+	files=$(find "$MNT" | wc -l)
+	finish=$(now)
+	echo "{\"fs\":\"$name\",\"test\":\"walk\",\"cache\":\"$CACHE\",\"entries\":$files,\"seconds\":$(elapsed "$start" "$finish")}"
+
+	# from the sizes, reading the files here would warm the cache
+	bytes=$(find "$MNT" -type f -exec stat -c %s {} + |
+		awk '{ sum += $1 } END { print sum + 0 }')
+
+	drop_caches
+	start=$(now)
+	find "$MNT" -type f -exec cat {} + > /dev/null
+	finish=$(now)
+	echo "{\"fs\":\"$name\",\"test\":\"read\",\"cache\":\"$CACHE\",\"bytes\":$bytes,\"seconds\":$(elapsed "$start" "$finish")}"
+
+	drop_caches
+	start=$(now)
+	find "$MNT" -type f -print0 | xargs -0 -n 16 -P "$JOBS" cat > /dev/null
+	finish=$(now)
+	echo "{\"fs\":\"$name\",\"test\":\"read-parallel\",\"cache\":\"$CACHE\",\"jobs\":$JOBS,\"bytes\":$bytes,\"seconds\":$(elapsed "$start" "$finish")}"
+}
+
+if [ -z "$IMAGE" ]; then
+	make_image
+fi
+
+"$HERE/aufs-fuse" "$IMAGE" "$MNT" || fail "aufs-fuse cannot mount $IMAGE"
+check fuse
+if [ -z "$CHECK" ]; then
+	measure fuse
+fi
+fusermount3 -u "$MNT"
+
+if [ "$(id -u)" -eq 0 ] && grep -qw aufs /proc/filesystems; then
+	mount -t aufs -o loop,ro "$IMAGE" "$MNT"
+	check kernel
+	if [ -z "$CHECK" ]; then
+		measure kernel
+	fi
+	umount "$MNT"
+else
+	echo "kernel module is not available, skipping it" >&2
+fi
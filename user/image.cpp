@@ -0,0 +1,506 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "image.hpp"
+
+namespace
+{
+
+uint32_t BlockShift(uint32_t block_size)
+{
+	switch (block_size) {
+	case 512u:
+		return 9;
+	case 1024u:
+		return 10;
+	case 2048u:
+		return 11;
+	case 4096u:
+		return 12;
+	}
+	throw ImageError("Unsupported block size");
+}
+
+/* the same order as strcmp, names hold no null bytes */
+int Compare(DirEntryView const &entry, char const *name, size_t len)
+	noexcept
+{
+	int const cmp = memcmp(entry.Name(), name,
+				std::min(entry.NameLen(), len));
+
+	if (cmp || entry.NameLen() == len)
+		return cmp;
+	return entry.NameLen() < len ? -1 : 1;
+}
+
+}
+
+DirEntryView DirEntries::At(size_t off) const noexcept
+{
+	if (m_records)
+		return DirEntryView(reinterpret_cast<struct aufs_dir_rec const *>(
+					m_data.Data() + off), off);
+	return DirEntryView(reinterpret_cast<struct aufs_dir_entry const *>(
+				m_data.Data() + off),
+			off / sizeof(struct aufs_dir_entry));
+}
+
+size_t DirEntries::Next(size_t off) const noexcept
+{
+	if (!m_records)
+		return off + sizeof(struct aufs_dir_entry);
+
+	struct aufs_dir_rec const *rec =
+		reinterpret_cast<struct aufs_dir_rec const *>(
+			m_data.Data() + off);
+	return Settle(off + FromDisk16(rec->adr_rec_len));
+}
+
+/* moves off to the next record that is whole, past the zero padding at
+ * the end of a block; the end of the entries if there is none */
+size_t DirEntries::Settle(size_t off) const noexcept
+{
+	size_t const size = m_data.Size();
+
+	if (!m_records)
+		return std::min(off, size);
+
+	while (off < size) {
+		size_t const block_end = std::min<size_t>(size,
+				(off | (m_block_size - 1)) + 1);
+		struct aufs_dir_rec const *rec =
+			reinterpret_cast<struct aufs_dir_rec const *>(
+				m_data.Data() + off);
+
+		if (block_end - off < sizeof(struct aufs_dir_rec))
+			return size;
+
+		uint32_t const rec_len = FromDisk16(rec->adr_rec_len);
+		if (!rec_len) {
+			off = block_end;
+			continue;
+		}
+
+		if (rec_len % AUFS_REC_ALIGN || !rec->adr_name_len ||
+				rec_len < AufsRecLen(rec->adr_name_len) ||
+				rec_len > block_end - off)
+			return size;
+		return off;
+	}
+	return size;
+}
+
+DirEntries::Iterator DirEntries::Find(uint32_t pos) const noexcept
+{
+	if (!m_records) {
+		size_t const off = static_cast<size_t>(pos) *
+					sizeof(struct aufs_dir_entry);
+
+		return Iterator(this, std::min(off, m_data.Size()));
+	}
+
+	if (pos % AUFS_REC_ALIGN || pos >= m_data.Size() ||
+			Settle(pos) != pos)
+		return end();
+	return Iterator(this, pos);
+}
+
+DirEntries::Iterator DirEntries::BlockFirst(uint32_t idx) const noexcept
+{
+	size_t const off = static_cast<size_t>(idx) * m_block_size;
+	size_t const first = Settle(off);
+
+	if (off >= m_data.Size() || first >= off + m_block_size)
+		return end();
+	return Iterator(this, first);
+}
+
+Image::Image(std::string const &path)
+	: m_fd(open(path.c_str(), O_RDONLY | O_CLOEXEC))
+	, m_data(nullptr)
+	, m_size(0)
+{
+	if (m_fd < 0)
+		throw ImageError("Cannot open " + path + ": " +
+					strerror(errno));
+
+	try {
+		off_t const size = lseek(m_fd, 0, SEEK_END);
+		if (size < static_cast<off_t>(sizeof(struct aufs_super_block)))
+			throw ImageError("Image is too small");
+		m_size = static_cast<size_t>(size);
+
+		void *data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED,
+					m_fd, 0);
+		if (data == MAP_FAILED)
+			throw ImageError("Cannot map " + path + ": " +
+					strerror(errno));
+		m_data = static_cast<uint8_t const *>(data);
+
+		struct aufs_super_block const *sb = Super();
+		if (FromDisk32(sb->asb_magic) != AUFS_MAGIC)
+			throw ImageError("Wrong magic number");
+
+		m_block_size = FromDisk32(sb->asb_block_size);
+		m_block_shift = BlockShift(m_block_size);
+		m_blocks = std::min<size_t>(m_size >> m_block_shift,
+					m_block_size * 8);
+		if (m_blocks < 3)
+			throw ImageError("Image is too small");
+
+		m_root = FromDisk32(sb->asb_root_inode);
+		m_features = FromDisk32(sb->asb_features);
+
+		uint32_t const inode_blocks = std::min<uint32_t>(
+					FromDisk32(sb->asb_inode_blocks),
+					m_blocks - 3);
+		m_inodes = std::min(inode_blocks * InodesPerBlock(),
+					m_block_size * 8);
+
+		if (m_features & AUFS_FEATURE_COMPACT_INODES) {
+			m_attrs = Table<struct aufs_inode_attr const>(
+					FromDisk32(sb->asb_attrs_first),
+					FromDisk32(sb->asb_attrs_count));
+			m_times = Table<uint64_t const>(
+					FromDisk32(sb->asb_times_first),
+					FromDisk32(sb->asb_times_count));
+		}
+	} catch (...) {
+		if (m_data)
+			munmap(const_cast<uint8_t *>(m_data), m_size);
+		close(m_fd);
+		throw;
+	}
+
+	madvise(const_cast<uint8_t *>(m_data), m_size, MADV_WILLNEED);
+}
+
+Image::~Image()
+{
+	munmap(const_cast<uint8_t *>(m_data), m_size);
+	close(m_fd);
+}
+
+Span<uint8_t const> Image::BlocksData(uint32_t first, uint32_t count)
+	const noexcept
+{
+	if (first >= m_blocks)
+		return Span<uint8_t const>();
+
+	count = std::min(count, m_blocks - first);
+	return Span<uint8_t const>(m_data +
+				(static_cast<size_t>(first) << m_block_shift),
+				static_cast<size_t>(count) << m_block_shift);
+}
+
+template <typename T>
+Span<T> Image::Table(uint32_t first, uint32_t count) const noexcept
+{
+	/* block 0 is the super block, no table lives there */
+	if (!first)
+		return Span<T>();
+
+	uint64_t const bytes = static_cast<uint64_t>(count) * sizeof(T);
+	Span<uint8_t const> const data = BlocksData(first,
+			std::min<uint64_t>((bytes + m_block_size - 1) >>
+					m_block_shift, m_blocks));
+
+	return Span<T>(reinterpret_cast<T *>(data.Data()),
+			std::min<size_t>(count, data.Size() / sizeof(T)));
+}
+
+bool Image::InodeUsed(uint32_t no) const noexcept
+{
+	uint8_t const *map = m_data + (2u << m_block_shift);
+
+	/* set bits mark free inodes, the same as in the block map */
+	return no && no < m_inodes && !(map[no / 8] & (1u << (no % 8)));
+}
+
+InodeView Image::GetInode(uint32_t no) const noexcept
+{
+	if (!InodeUsed(no))
+		return InodeView();
+
+	uint8_t const *table = m_data + (3u << m_block_shift);
+
+	if (!(m_features & AUFS_FEATURE_COMPACT_INODES))
+		return InodeView(reinterpret_cast<struct aufs_inode const *>(
+					table) + no, no);
+
+	struct aufs_compact_inode const *raw =
+		reinterpret_cast<struct aufs_compact_inode const *>(
+			table) + no;
+	uint32_t const attr = FromDisk16(raw->aci_attr);
+	uint32_t const time = FromDisk16(raw->aci_time);
+
+	return InodeView(raw, attr < m_attrs.Size() ? &m_attrs[attr] : nullptr,
+			time < m_times.Size() ? m_times[time] : 0, no);
+}
+
+DirEntries Image::Entries(InodeView inode) const noexcept
+{
+	if (!inode || !inode.IsDir())
+		return DirEntries();
+
+	bool const records = m_features & AUFS_FEATURE_DIR_RECORDS;
+	Span<uint8_t const> const data = BlocksData(inode.FirstBlock(),
+					inode.BlocksCount());
+	size_t bytes = std::min<uint64_t>(AufsDirEntryBytes(inode.Size(),
+					m_features), data.Size());
+
+	if (!records)
+		bytes -= bytes % sizeof(struct aufs_dir_entry);
+	return DirEntries(Span<uint8_t const>(data.Data(), bytes),
+			m_block_size, records);
+}
+
+Span<uint8_t const> Image::Tail(InodeView inode) const noexcept
+{
+	if (!inode || !inode.IsDir())
+		return Span<uint8_t const>();
+
+	Span<uint8_t const> const data = BlocksData(inode.FirstBlock(),
+					inode.BlocksCount());
+	size_t const entry_bytes = BlockAligned(AufsDirEntryBytes(
+			inode.Size(), m_features));
+
+	if (data.Size() <= entry_bytes)
+		return Span<uint8_t const>();
+	return Span<uint8_t const>(data.Data() + entry_bytes,
+				data.Size() - entry_bytes);
+}
+
+Span<uint8_t const> Image::Bloom(InodeView inode) const noexcept
+{
+	if (!(m_features & AUFS_FEATURE_DIR_BLOOM))
+		return Span<uint8_t const>();
+
+	Span<uint8_t const> const tail = Tail(inode);
+	if (tail.Empty())
+		return Span<uint8_t const>();
+
+	size_t const bytes = AufsBloomBytes(AufsDirNamesMax(inode.Size(),
+					m_features));
+	if (tail.Size() < bytes)
+		return Span<uint8_t const>();
+	return Span<uint8_t const>(tail.Data(), bytes);
+}
+
+Span<struct aufs_dir_slot const> Image::Index(InodeView inode)
+	const noexcept
+{
+	if (!(m_features & AUFS_FEATURE_DIR_INDEX))
+		return Span<struct aufs_dir_slot const>();
+
+	Span<uint8_t const> const tail = Tail(inode);
+	if (tail.Empty())
+		return Span<struct aufs_dir_slot const>();
+
+	size_t const skip = (m_features & AUFS_FEATURE_DIR_BLOOM) ?
+			BlockAligned(AufsBloomBytes(AufsDirNamesMax(
+				inode.Size(), m_features))) : 0;
+
+	if (tail.Size() <= skip)
+		return Span<struct aufs_dir_slot const>();
+
+	return Span<struct aufs_dir_slot const>(
+		reinterpret_cast<struct aufs_dir_slot const *>(
+			tail.Data() + skip),
+		AufsIndexSlots(tail.Size() - skip));
+}
+
+Span<uint8_t const> Image::Contents(InodeView inode) const noexcept
+{
+	if (!inode || !inode.IsFile() || ExtentsCount(inode) != 1)
+		return Span<uint8_t const>();
+	return ExtentData(inode, 0);
+}
+
+uint32_t Image::ExtentListBlock(InodeView inode) const noexcept
+{
+	if (!(m_features & AUFS_FEATURE_EXTENTS) || !inode.IsFile() ||
+			!(inode.FirstBlock() & AUFS_EXTENT_LIST))
+		return 0;
+	return inode.FirstBlock() & ~AUFS_EXTENT_LIST;
+}
+
+Span<struct aufs_extent const> Image::ExtentList(InodeView inode)
+	const noexcept
+{
+	uint32_t const list = ExtentListBlock(inode);
+	if (!list)
+		return Span<struct aufs_extent const>();
+
+	Span<uint8_t const> const block = BlocksData(list, 1);
+	if (block.Empty())
+		return Span<struct aufs_extent const>();
+
+	struct aufs_extent_header const *aeh =
+		reinterpret_cast<struct aufs_extent_header const *>(
+			block.Data());
+	return Span<struct aufs_extent const>(
+		reinterpret_cast<struct aufs_extent const *>(aeh + 1),
+		std::min(FromDisk32(aeh->aeh_count),
+			AufsExtentsMax(m_block_size)));
+}
+
+size_t Image::ExtentsCount(InodeView inode) const noexcept
+{
+	if (!inode)
+		return 0;
+	if (!ExtentListBlock(inode))
+		return 1;
+	return ExtentList(inode).Size();
+}
+
+FileExtent Image::Extent(InodeView inode, size_t idx) const noexcept
+{
+	if (idx >= ExtentsCount(inode))
+		return FileExtent{0, 0};
+
+	Span<struct aufs_extent const> const list = ExtentList(inode);
+	if (list.Empty())
+		return FileExtent{inode.FirstBlock(), inode.BlocksCount()};
+	return FileExtent{FromDisk32(list[idx].ae_first),
+			FromDisk32(list[idx].ae_blocks)};
+}
+
+Span<uint8_t const> Image::ExtentData(InodeView inode, size_t idx)
+	const noexcept
+{
+	if (!inode || !inode.IsFile())
+		return Span<uint8_t const>();
+
+	uint64_t offset = 0;
+	for (size_t i = 0; i != idx; ++i)
+		offset += static_cast<uint64_t>(Extent(inode, i).m_blocks) <<
+				m_block_shift;
+	if (offset >= inode.Size())
+		return Span<uint8_t const>();
+
+	FileExtent const extent = Extent(inode, idx);
+	Span<uint8_t const> const data = BlocksData(extent.m_first,
+					extent.m_blocks);
+
+	return Span<uint8_t const>(data.Data(), std::min<uint64_t>(
+				inode.Size() - offset, data.Size()));
+}
+
+uint32_t Image::LookupChild(InodeView dir, char const *name, size_t len)
+	const noexcept
+{
+	if (!len || len > NameMax())
+		return 0;
+
+	uint32_t const hash = AufsNameHash(name, len);
+	Span<uint8_t const> const bloom = Bloom(dir);
+	if (!bloom.Empty()) {
+		uint32_t const step = AufsBloomStep(hash);
+		uint32_t const mask = bloom.Size() * 8 - 1;
+
+		for (uint32_t k = 0; k != AUFS_BLOOM_HASHES; ++k) {
+			uint32_t const bit = (hash + k * step) & mask;
+
+			if (!(bloom[bit / 8] & (1u << (bit % 8))))
+				return 0;
+		}
+	}
+
+	DirEntries const entries = Entries(dir);
+	Span<struct aufs_dir_slot const> const index = Index(dir);
+	if (!index.Empty()) {
+		size_t const mask = index.Size() - 1;
+
+		for (size_t i = 0; i != index.Size(); ++i) {
+			struct aufs_dir_slot const &slot =
+					index[(hash + i) & mask];
+			uint32_t const pos = FromDisk32(slot.ads_pos);
+
+			if (!pos)
+				return 0;
+			if (FromDisk32(slot.ads_hash) != hash)
+				continue;
+
+			DirEntries::Iterator const it = entries.Find(pos - 1);
+			if (it == entries.end())
+				return 0;
+			if (!Compare(*it, name, len))
+				return (*it).InodeNo();
+		}
+		return 0;
+	}
+
+	if (m_features & AUFS_FEATURE_SORTED_DIRS) {
+		/* find the last block that starts at or before the name,
+		 * the name can only be in that one */
+		uint32_t lo = 0, hi = BlockAligned(entries.Bytes()) >>
+					m_block_shift;
+
+		while (lo < hi) {
+			uint32_t const mid = lo + (hi - lo) / 2;
+			DirEntries::Iterator const it = entries.BlockFirst(mid);
+
+			if (it == entries.end())
+				break;
+
+			int const cmp = Compare(*it, name, len);
+			if (!cmp)
+				return (*it).InodeNo();
+			if (cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo == hi) {
+			if (!lo)
+				return 0;
+
+			size_t const end = static_cast<size_t>(lo) <<
+						m_block_shift;
+			for (DirEntries::Iterator it = entries.BlockFirst(
+					lo - 1); it != entries.end() &&
+					it.Offset() < end; ++it) {
+				int const cmp = Compare(*it, name, len);
+
+				if (!cmp)
+					return (*it).InodeNo();
+				if (cmp > 0)
+					break;
+			}
+			return 0;
+		}
+		/* a block without entries, fall back to a scan */
+	}
+
+	for (DirEntryView const entry : entries)
+		if (!Compare(entry, name, len))
+			return entry.InodeNo();
+	return 0;
+}
+
+uint32_t Image::Lookup(char const *path) const noexcept
+{
+	InodeView inode = GetInode(m_root);
+
+	while (inode) {
+		while (*path == '/')
+			++path;
+		if (!*path)
+			return inode.InodeNo();
+
+		char const *end = path;
+		while (*end && *end != '/')
+			++end;
+
+		inode = GetInode(LookupChild(inode, path, end - path));
+		path = end;
+	}
+	return 0;
+}
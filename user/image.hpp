@@ -0,0 +1,404 @@
+#ifndef __IMAGE_HPP__
+#define __IMAGE_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include <sys/stat.h>
+
+#include "aufs.hpp"
+#include "byteorder.hpp"
+
+/* A non-owning view of size contiguous objects. */
+template <typename T>
+class Span {
+public:
+	Span() noexcept
+		: m_data(nullptr)
+		, m_size(0)
+	{ }
+
+	Span(T *data, size_t size) noexcept
+		: m_data(data)
+		, m_size(size)
+	{ }
+
+	T * Data() const noexcept
+	{ return m_data; }
+
+	size_t Size() const noexcept
+	{ return m_size; }
+
+	bool Empty() const noexcept
+	{ return !m_size; }
+
+	T & operator[](size_t idx) const noexcept
+	{ return m_data[idx]; }
+
+	T * begin() const noexcept
+	{ return m_data; }
+
+	T * end() const noexcept
+	{ return m_data + m_size; }
+
+private:
+	T *	m_data;
+	size_t	m_size;
+};
+
+
+class ImageError : public std::runtime_error {
+public:
+	explicit ImageError(std::string const &what)
+		: std::runtime_error(what)
+	{ }
+};
+
+
+/* A host order copy of an on-disk inode, wide or compact. Fields a
+ * compact inode refers to outside of the table read as zero. */
+class InodeView {
+public:
+	InodeView() noexcept
+		: m_no(0)
+		, m_first(0)
+		, m_blocks(0)
+		, m_size(0)
+		, m_gid(0)
+		, m_uid(0)
+		, m_mode(0)
+		, m_ctime(0)
+	{ }
+
+	InodeView(struct aufs_inode const *raw, uint32_t no) noexcept
+		: m_no(no)
+		, m_first(FromDisk32(raw->ai_first))
+		, m_blocks(FromDisk32(raw->ai_blocks))
+		, m_size(FromDisk32(raw->ai_size))
+		, m_gid(FromDisk32(raw->ai_gid))
+		, m_uid(FromDisk32(raw->ai_uid))
+		, m_mode(FromDisk32(raw->ai_mode))
+		, m_ctime(FromDisk64(raw->ai_ctime))
+	{ }
+
+	/* attr may be null, ctime is in disk byte order */
+	InodeView(struct aufs_compact_inode const *raw,
+			struct aufs_inode_attr const *attr, uint64_t ctime,
+			uint32_t no) noexcept
+		: m_no(no)
+		, m_first(FromDisk32(raw->aci_first))
+		, m_blocks(FromDisk32(raw->aci_blocks))
+		, m_size(FromDisk32(raw->aci_size))
+		, m_gid(attr ? FromDisk32(attr->aia_gid) : 0)
+		, m_uid(attr ? FromDisk32(attr->aia_uid) : 0)
+		, m_mode(attr ? FromDisk32(attr->aia_mode) : 0)
+		, m_ctime(FromDisk64(ctime))
+	{ }
+
+	explicit operator bool() const noexcept
+	{ return m_no != 0; }
+
+	uint32_t InodeNo() const noexcept
+	{ return m_no; }
+
+	uint32_t FirstBlock() const noexcept
+	{ return m_first; }
+
+	uint32_t BlocksCount() const noexcept
+	{ return m_blocks; }
+
+	uint32_t Size() const noexcept
+	{ return m_size; }
+
+	uint32_t Gid() const noexcept
+	{ return m_gid; }
+
+	uint32_t Uid() const noexcept
+	{ return m_uid; }
+
+	uint32_t Mode() const noexcept
+	{ return m_mode; }
+
+	uint64_t CreateTime() const noexcept
+	{ return m_ctime; }
+
+	bool IsDir() const noexcept
+	{ return S_ISDIR(Mode()); }
+
+	bool IsFile() const noexcept
+	{ return S_ISREG(Mode()); }
+
+private:
+	uint32_t	m_no;
+	uint32_t	m_first;
+	uint32_t	m_blocks;
+	uint32_t	m_size;
+	uint32_t	m_gid;
+	uint32_t	m_uid;
+	uint32_t	m_mode;
+	uint64_t	m_ctime;
+};
+
+
+/* A run of blocks holding part of a file, in host order. */
+struct FileExtent {
+	uint32_t	m_first;
+	uint32_t	m_blocks;
+};
+
+
+/* One directory entry, fixed size or a record; both decode the same. */
+class DirEntryView {
+public:
+	DirEntryView(struct aufs_dir_entry const *raw, uint32_t pos) noexcept
+		: m_name(ADE_NAME(raw))
+		, m_name_len(strnlen(ADE_NAME(raw), AUFS_NAME_MAXLEN))
+		, m_inode(FromDisk32(raw->ade_inode))
+		, m_type(ADE_TYPE(raw))
+		, m_pos(pos)
+	{ }
+
+	DirEntryView(struct aufs_dir_rec const *raw, uint32_t pos) noexcept
+		: m_name(ADR_NAME(raw))
+		, m_name_len(raw->adr_name_len)
+		, m_inode(FromDisk32(raw->adr_inode))
+		, m_type(raw->adr_type)
+		, m_pos(pos)
+	{ }
+
+	/* not necessarily null terminated, use NameLen() */
+	char const * Name() const noexcept
+	{ return m_name; }
+
+	size_t NameLen() const noexcept
+	{ return m_name_len; }
+
+	uint32_t InodeNo() const noexcept
+	{ return m_inode; }
+
+	/* DT_* type of the child, DT_UNKNOWN (0) if the image has none */
+	uint8_t Type() const noexcept
+	{ return m_type; }
+
+	/* what the hash index refers to: the entry index, or the record
+	 * offset with AUFS_FEATURE_DIR_RECORDS */
+	uint32_t Pos() const noexcept
+	{ return m_pos; }
+
+private:
+	char const *	m_name;
+	size_t		m_name_len;
+	uint32_t	m_inode;
+	uint8_t		m_type;
+	uint32_t	m_pos;
+};
+
+
+/* The entries of a directory in stored order. Records that do not fit
+ * their block end the walk, so a damaged directory just looks shorter. */
+class DirEntries {
+public:
+	class Iterator {
+	public:
+		Iterator(DirEntries const *dir, size_t off) noexcept
+			: m_dir(dir)
+			, m_off(off)
+		{ }
+
+		DirEntryView operator*() const noexcept
+		{ return m_dir->At(m_off); }
+
+		Iterator & operator++() noexcept
+		{
+			m_off = m_dir->Next(m_off);
+			return *this;
+		}
+
+		bool operator==(Iterator const &other) const noexcept
+		{ return m_off == other.m_off; }
+
+		bool operator!=(Iterator const &other) const noexcept
+		{ return m_off != other.m_off; }
+
+		/* byte offset of the entry in the directory */
+		size_t Offset() const noexcept
+		{ return m_off; }
+
+	private:
+		DirEntries const *	m_dir;
+		size_t			m_off;
+	};
+
+	DirEntries() noexcept
+		: m_block_size(0)
+		, m_records(false)
+	{ }
+
+	DirEntries(Span<uint8_t const> data, uint32_t block_size,
+			bool records) noexcept
+		: m_data(data)
+		, m_block_size(block_size)
+		, m_records(records)
+	{ }
+
+	Iterator begin() const noexcept
+	{ return Iterator(this, Settle(0)); }
+
+	Iterator end() const noexcept
+	{ return Iterator(this, m_data.Size()); }
+
+	bool Empty() const noexcept
+	{ return begin() == end(); }
+
+	/* the bytes the entries take */
+	size_t Bytes() const noexcept
+	{ return m_data.Size(); }
+
+	/* the entry at position pos, as DirEntryView::Pos() returns it, or
+	 * end() if there is none */
+	Iterator Find(uint32_t pos) const noexcept;
+
+	/* the first entry stored in block idx of the directory, end() if
+	 * the block has none */
+	Iterator BlockFirst(uint32_t idx) const noexcept;
+
+private:
+	DirEntryView At(size_t off) const noexcept;
+	size_t Next(size_t off) const noexcept;
+	size_t Settle(size_t off) const noexcept;
+
+	Span<uint8_t const>	m_data;
+	uint32_t		m_block_size;
+	bool			m_records;
+};
+
+
+/* A read-only aufs image mapped into memory. Every view returned, but
+ * for inodes that are copied, points straight into the mapping and stays
+ * valid while the Image is alive.
+ * Nothing changes after the constructor, so all methods may be called
+ * from any number of threads, and none of them allocates. Views never
+ * reach outside of the mapping, whatever the image contains. */
+class Image {
+public:
+	explicit Image(std::string const &path);
+	~Image();
+
+	Image(Image const &) = delete;
+	Image & operator=(Image const &) = delete;
+
+	uint32_t BlockSize() const noexcept
+	{ return m_block_size; }
+
+	uint32_t Blocks() const noexcept
+	{ return m_blocks; }
+
+	uint32_t Inodes() const noexcept
+	{ return m_inodes; }
+
+	/* inode table entries per block, compact or wide */
+	uint32_t InodesPerBlock() const noexcept
+	{ return m_block_size / AufsInodeSize(m_features); }
+
+	uint32_t RootInode() const noexcept
+	{ return m_root; }
+
+	uint32_t Features() const noexcept
+	{ return m_features; }
+
+	/* the longest name the directories can hold */
+	size_t NameMax() const noexcept
+	{
+		return (m_features & AUFS_FEATURE_DIR_RECORDS) ?
+			AUFS_REC_NAME_MAXLEN : AUFS_NAME_MAXLEN - 1;
+	}
+
+	int Fd() const noexcept
+	{ return m_fd; }
+
+	/* the super block as it is stored, in disk byte order */
+	struct aufs_super_block const * Super() const noexcept
+	{ return reinterpret_cast<struct aufs_super_block const *>(m_data); }
+
+	Span<uint8_t const> BlockMap() const noexcept
+	{ return BlocksData(1, 1); }
+
+	Span<uint8_t const> InodeMap() const noexcept
+	{ return BlocksData(2, 1); }
+
+	/* clamped to the end of the image */
+	Span<uint8_t const> BlocksData(uint32_t first, uint32_t count)
+		const noexcept;
+
+	bool InodeUsed(uint32_t no) const noexcept;
+
+	/* empty view for unallocated or out of range inodes */
+	InodeView GetInode(uint32_t no) const noexcept;
+
+	/* the entries in use, empty if inode is not a directory */
+	DirEntries Entries(InodeView inode) const noexcept;
+
+	/* the Bloom filter of a directory, empty if it has none */
+	Span<uint8_t const> Bloom(InodeView inode) const noexcept;
+
+	/* the hash index slots of a directory, empty if it has none */
+	Span<struct aufs_dir_slot const> Index(InodeView inode) const noexcept;
+
+	/* the bytes of a regular file kept in a single run, empty for
+	 * anything else; see ExtentData() for the others */
+	Span<uint8_t const> Contents(InodeView inode) const noexcept;
+
+	/* the block of the extent list of a file, 0 if it has none */
+	uint32_t ExtentListBlock(InodeView inode) const noexcept;
+
+	/* the number of runs the blocks of inode are kept in */
+	size_t ExtentsCount(InodeView inode) const noexcept;
+
+	/* run idx of inode in file order, empty past the last one */
+	FileExtent Extent(InodeView inode, size_t idx) const noexcept;
+
+	/* the bytes of a regular file in run idx */
+	Span<uint8_t const> ExtentData(InodeView inode, size_t idx)
+		const noexcept;
+
+	/* inode number of name in directory dir, 0 if there is none */
+	uint32_t LookupChild(InodeView dir, char const *name, size_t len)
+		const noexcept;
+
+	/* resolves an absolute or root relative path, "/" and "" yield
+	 * the root; returns 0 if any component is missing */
+	uint32_t Lookup(char const *path) const noexcept;
+
+private:
+	/* the directory blocks past its entries */
+	Span<uint8_t const> Tail(InodeView inode) const noexcept;
+
+	/* the runs of a file with an extent list, empty for the others */
+	Span<struct aufs_extent const> ExtentList(InodeView inode)
+		const noexcept;
+
+	/* count objects stored from block first on, clamped to the image */
+	template <typename T>
+	Span<T> Table(uint32_t first, uint32_t count) const noexcept;
+
+	size_t BlockAligned(size_t bytes) const noexcept
+	{ return (bytes + m_block_size - 1) & ~static_cast<size_t>(
+				m_block_size - 1); }
+
+	int		m_fd;
+	uint8_t const *	m_data;
+	size_t		m_size;
+	uint32_t	m_block_size;
+	uint32_t	m_block_shift;
+	uint32_t	m_blocks;
+	uint32_t	m_inodes;
+	uint32_t	m_root;
+	uint32_t	m_features;
+	/* the shared tables of compact inodes, empty otherwise */
+	Span<struct aufs_inode_attr const>	m_attrs;
+	Span<uint64_t const>			m_times;
+};
+
+#endif /*__IMAGE_HPP__*/
@@ -0,0 +1,140 @@
+#ifndef __LAYOUT_HPP__
+#define __LAYOUT_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "aufs.hpp"
+#include "byteorder.hpp"
+
+constexpr uint32_t Log2(uint32_t v) noexcept
+{ return v > 1 ? 1 + Log2(v >> 1) : 0; }
+
+/* All the layout arithmetic for one of the supported block sizes. Every
+ * per-block count is a power of two, so divisions and modulos become
+ * shifts and masks known at compile time. */
+template <uint32_t BlockSize>
+struct Layout {
+	static_assert(BlockSize >= 512 && !(BlockSize & (BlockSize - 1)),
+			"block size must be a power of two >= 512");
+
+	static constexpr uint32_t BlockShift = Log2(BlockSize);
+	static constexpr uint32_t BlockMask = BlockSize - 1;
+
+	static constexpr uint32_t InodesPerBlock =
+				BlockSize / sizeof(struct aufs_inode);
+	static constexpr uint32_t InodeShift = Log2(InodesPerBlock);
+	static constexpr uint32_t InodeMask = InodesPerBlock - 1;
+
+	static constexpr uint32_t CompactInodesPerBlock =
+				BlockSize / sizeof(struct aufs_compact_inode);
+	static constexpr uint32_t CompactInodeShift =
+				Log2(CompactInodesPerBlock);
+	static constexpr uint32_t CompactInodeMask = CompactInodesPerBlock - 1;
+
+	static constexpr uint32_t EntriesPerBlock =
+				BlockSize / sizeof(struct aufs_dir_entry);
+	static constexpr uint32_t EntryShift = Log2(EntriesPerBlock);
+	static constexpr uint32_t EntryMask = EntriesPerBlock - 1;
+
+	static constexpr uint32_t BitsPerMap = BlockSize * 8;
+	static constexpr uint32_t InodeTableBlock = 3;
+
+	static constexpr uint32_t BlocksFor(uint32_t bytes) noexcept
+	{ return (bytes + BlockMask) >> BlockShift; }
+
+	static constexpr uint32_t InodeBlock(uint32_t no) noexcept
+	{ return InodeTableBlock + (no >> InodeShift); }
+
+	static constexpr uint32_t InodeOffset(uint32_t no) noexcept
+	{ return (no & InodeMask) * sizeof(struct aufs_inode); }
+
+	static constexpr uint32_t CompactInodeBlock(uint32_t no) noexcept
+	{ return InodeTableBlock + (no >> CompactInodeShift); }
+
+	static constexpr uint32_t CompactInodeOffset(uint32_t no) noexcept
+	{ return (no & CompactInodeMask) * sizeof(struct aufs_compact_inode); }
+
+	/* log2 of the inodes in a table block of an image with features */
+	static constexpr uint32_t InodeShiftFor(uint32_t features) noexcept
+	{
+		return (features & AUFS_FEATURE_COMPACT_INODES) ?
+			CompactInodeShift : InodeShift;
+	}
+};
+
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::BlockShift;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::BlockMask;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::InodesPerBlock;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::InodeShift;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::InodeMask;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::CompactInodesPerBlock;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::CompactInodeShift;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::CompactInodeMask;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::EntriesPerBlock;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::EntryShift;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::EntryMask;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::BitsPerMap;
+template <uint32_t BlockSize>
+constexpr uint32_t Layout<BlockSize>::InodeTableBlock;
+
+/* Decodes a whole inode table block into host byte order at once: the
+ * block is swapped as plain 32-bit words and then the halves of each
+ * 64-bit ctime are put back in place. The ctime is only ever touched
+ * through memcpy, it is not a uint32_t object to the compiler. */
+template <uint32_t BlockSize>
+void DecodeInodeBlock(uint8_t const *block, struct aufs_inode *inodes)
+	noexcept
+{
+	static_assert(offsetof(struct aufs_inode, ai_ctime) % 8 == 0,
+			"ctime halves are expected to be whole words");
+
+	memcpy(inodes, block, BlockSize);
+	if (HostIsDiskOrder)
+		return;
+
+	FromDiskWords(reinterpret_cast<uint32_t *>(inodes), BlockSize / 4);
+	for (size_t i = 0; i != Layout<BlockSize>::InodesPerBlock; ++i) {
+		uint64_t ctime;
+
+		memcpy(&ctime, &inodes[i].ai_ctime, sizeof(ctime));
+		ctime = ctime << 32 | ctime >> 32;
+		memcpy(&inodes[i].ai_ctime, &ctime, sizeof(ctime));
+	}
+}
+
+/* Calls visitor.Run<BlockSize>() for the runtime block size, so the rest
+ * of the code only ever sees one of the four supported constants. */
+template <typename Visitor>
+auto DispatchBlockSize(uint32_t block_size, Visitor &&visitor)
+	-> decltype(visitor.template Run<4096u>())
+{
+	switch (block_size) {
+	case 512u:
+		return visitor.template Run<512u>();
+	case 1024u:
+		return visitor.template Run<1024u>();
+	case 2048u:
+		return visitor.template Run<2048u>();
+	case 4096u:
+		return visitor.template Run<4096u>();
+	}
+
+	throw std::runtime_error("Unsupported block size");
+}
+
+#endif /*__LAYOUT_HPP__*/
@@ -15,7 +15,7 @@ size_t DeviceSize(std::string const & device)
 {
 	std::ifstream in(device.c_str(),
 		std::ios::in | std::ios::binary | std::ios::ate);
-	std::ifstream::streampos const size = in.tellg();
+	std::streampos const size = in.tellg();
 
 	return static_cast<size_t>(size);
 }
@@ -70,12 +70,19 @@ ConfigurationConstPtr VerifyConfiguration(ConfigurationConstPtr config)
 void PrintHelp()
 {
 	std::cout << "Usage:" << std::endl
-		<< "\tmkfs.aufs [(--block_size | -s) SIZE] [(--blocks | -b) BLOCKS] DEVICE"
+		<< "\tmkfs.aufs [(--block_size | -s) SIZE] [(--blocks | -b) BLOCKS] [(--dir | -d) DIR] [(--index | -x) ENTRIES] [(--bloom | -f) NAMES] [--checksum | -c] [--compact_inodes | -i] [--extents | -e] [(--max_run | -r) RUN] DEVICE"
 		<< std::endl << std::endl
 		<< "Where:" << std::endl
 		<< "\tSIZE    - block size. Default is 4096 bytes." << std::endl
 		<< "\tBLOCKS  - number of blocks would be used for aufs. By default is DEVICE size / SIZE." << std::endl
-		<< "\tDEVICE  - device file." << std::endl;
+		<< "\tDIR     - directory to copy into the image." << std::endl
+		<< "\tENTRIES - directories with at least that many entries get a hash index. Default is 1024, 0 disables it." << std::endl
+		<< "\tNAMES   - directories with at least that many entries get a Bloom filter of their names. Default is 128, 0 disables it." << std::endl
+		<< "\tRUN     - split files into runs of at most that many blocks, implies -e. Meant for testing readers." << std::endl
+		<< "\tDEVICE  - device file." << std::endl
+		<< "\t-c      - store a CRC32C of every used block, so the kernel can verify reads." << std::endl
+		<< "\t-i      - write 16 byte inodes that share owner, mode and time tables." << std::endl
+		<< "\t-e      - split files over several free runs when no single one fits." << std::endl;
 }
 
 ConfigurationConstPtr ParseArgs(int argc, char **argv)
@@ -83,6 +90,12 @@ ConfigurationConstPtr ParseArgs(int argc, char **argv)
 	std::string device, dir;
 	size_t block_size = 4096u;
 	size_t blocks = 0;
+	bool checksums = false;
+	bool compact_inodes = false;
+	bool extents = false;
+	uint32_t max_run = 0;
+	uint32_t index_threshold = 1024u;
+	uint32_t bloom_threshold = 128u;
 
 	while (argc--) {
 		std::string const arg(*argv++);
@@ -95,6 +108,21 @@ ConfigurationConstPtr ParseArgs(int argc, char **argv)
 		} else if ((arg == "--dir" || arg == "-d") && argc) {
 			dir = *argv++;
 			--argc;
+		} else if ((arg == "--index" || arg == "-x") && argc) {
+			index_threshold = std::stoi(*argv++);
+			--argc;
+		} else if ((arg == "--bloom" || arg == "-f") && argc) {
+			bloom_threshold = std::stoi(*argv++);
+			--argc;
+		} else if (arg == "--checksum" || arg == "-c") {
+			checksums = true;
+		} else if (arg == "--compact_inodes" || arg == "-i") {
+			compact_inodes = true;
+		} else if (arg == "--extents" || arg == "-e") {
+			extents = true;
+		} else if ((arg == "--max_run" || arg == "-r") && argc) {
+			max_run = std::stoi(*argv++);
+			--argc;
 		} else if (arg == "--help" || arg == "-h") {
 			PrintHelp();
 		} else {
@@ -109,21 +137,23 @@ ConfigurationConstPtr ParseArgs(int argc, char **argv)
 		blocks = std::min(DeviceSize(device) / block_size, block_size * 8);
 
 	ConfigurationConstPtr config = std::make_shared<Configuration>(
-		device, dir, blocks, block_size);
+		device, dir, blocks, block_size, checksums, index_threshold,
+		bloom_threshold, compact_inodes, extents, max_run);
 
 	return VerifyConfiguration(config);
 }
 
-Inode CopyFile(Formatter &fmt, std::string const &path)
+template <uint32_t BlockSize>
+Inode<BlockSize> CopyFile(Formatter<BlockSize> &fmt, std::string const &path)
 {
 	std::vector<char> data;
 	std::ifstream file(path, std::ios::binary);
 	if (!file)
 		throw std::runtime_error("cannot open file");
-	std::istream_iterator<char> b(file), e;
+	std::istreambuf_iterator<char> b(file), e;
 	std::copy(b, e, std::back_inserter(data));
 
-	Inode inode = fmt.MkFile(data.size());
+	Inode<BlockSize> inode = fmt.MkFile(data.size());
 	size_t written = 0;
 	while (written != data.size()) {
 		written += fmt.Write(inode,
@@ -135,50 +165,99 @@ Inode CopyFile(Formatter &fmt, std::string const &path)
 	return inode;
 }
 
-Inode CopyDir(Formatter &fmt, std::string const &path)
+template <uint32_t BlockSize>
+Inode<BlockSize> CopyDir(Formatter<BlockSize> &fmt, std::string const &path)
 {
-	std::vector<std::string> entries;
-	struct dirent entry, *entryp = &entry;
+	/* the name stored in the image and the name in the source dir */
+	using Entry = std::pair<std::string, std::string>;
+
+	std::vector<Entry> entries;
+	struct dirent *entryp;
 	std::unique_ptr<DIR, int(*)(DIR *)> dirp(opendir(path.c_str()),
 							&closedir);
 	if (!dirp.get())
 		throw std::runtime_error("cannot open dir");
 
-	while (entryp) {
-		readdir_r(dirp.get(), &entry, &entryp);
-		if (entryp && strcmp(entry.d_name, ".")
-				&& strcmp(entry.d_name, ".."))
-			entries.push_back(std::string(entry.d_name)
-					.substr(0, AUFS_NAME_MAXLEN - 1));
+	while ((entryp = readdir(dirp.get())) != nullptr) {
+		std::string const name(entryp->d_name);
+
+		if (name != "." && name != "..")
+			entries.push_back(Entry(
+				name.substr(0, AUFS_REC_NAME_MAXLEN), name));
 	}
 
-	Inode inode = fmt.MkDir(entries.size());
-	for (std::string const &entry : entries) {
+	/* entries are stored sorted by their (possibly truncated) names */
+	std::sort(entries.begin(), entries.end());
+	auto const same = [] (Entry const &l, Entry const &r) {
+		return l.first == r.first;
+	};
+	auto const dup = std::adjacent_find(entries.begin(), entries.end(),
+					same);
+	if (dup != entries.end()) {
+		std::cout << "WARNING: names in " << path << " are the same "
+			<< "when truncated, e.g. " << dup->second
+			<< ", keeping the first one only" << std::endl;
+		entries.erase(std::unique(entries.begin(), entries.end(),
+					same), entries.end());
+	}
+
+	/* drop what cannot be copied first, MkDir reserves the exact size */
+	entries.erase(std::remove_if(entries.begin(), entries.end(),
+			[&] (Entry const &entry) {
+				std::string const source = path + "/" +
+							entry.second;
+				struct stat buffer;
+
+				return stat(source.c_str(), &buffer) != 0;
+			}), entries.end());
+
+	std::vector<std::string> names;
+	for (Entry const &entry : entries)
+		names.push_back(entry.first);
+
+	Inode<BlockSize> inode = fmt.MkDir(names);
+	for (Entry const &entry : entries) {
+		std::string const source = path + "/" + entry.second;
 		struct stat buffer;
-		if (stat((path + "/" + entry).c_str(), &buffer))
-			continue;
+
+		if (stat(source.c_str(), &buffer))
+			throw std::runtime_error("cannot stat " + source);
 		if (buffer.st_mode & S_IFDIR)
-			fmt.AddChild(inode, entry.c_str(),
-					CopyDir(fmt, path + "/" + entry));
+			fmt.AddChild(inode, entry.first.c_str(),
+					CopyDir(fmt, source));
 		else
-			fmt.AddChild(inode, entry.c_str(),
-					CopyFile(fmt, path + "/" + entry));
+			fmt.AddChild(inode, entry.first.c_str(),
+					CopyFile(fmt, source));
 	}
+	fmt.BuildIndex(inode);
 
 	return inode;
 }
 
+struct FormatImage {
+	ConfigurationConstPtr	m_config;
+
+	template <uint32_t BlockSize>
+	void Run() const
+	{
+		Formatter<BlockSize> format(m_config);
+
+		if (!m_config->SourceDir().empty())
+			format.SetRootInode(CopyDir(format,
+						m_config->SourceDir()));
+		else
+			format.SetRootInode(format.MkDir(std::vector<std::string>()));
+		format.WriteInodes();
+		format.WriteChecksums();
+	}
+};
+
 int main(int argc, char **argv)
 {
 	try {
 		ConfigurationConstPtr config = ParseArgs(argc - 1, argv + 1);
-		Formatter format(config);
 
-		if (!config->SourceDir().empty())
-			format.SetRootInode(CopyDir(format,
-						config->SourceDir()));
-		else
-			format.SetRootInode(format.MkDir(16));
+		DispatchBlockSize(config->BlockSize(), FormatImage{config});
 
 		return 0;
 	} catch (std::exception const & e) {
@@ -0,0 +1,380 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bit_iterator.hpp"
+#include "block.hpp"
+
+namespace
+{
+
+struct TreeStats {
+	uint64_t	m_files = 0;
+	uint64_t	m_dirs = 0;
+	uint64_t	m_bytes = 0;
+};
+
+class TreeGenerator {
+public:
+	explicit TreeGenerator(uint64_t seed, double scale)
+		: m_rng(seed)
+		, m_scale(scale)
+	{ }
+
+	TreeStats const & Stats() const noexcept
+	{ return m_stats; }
+
+	void Generate(std::string const &shape, std::string const &root)
+	{
+		MakeDir(root);
+		if (shape == "tiny")
+			Tiny(root);
+		else if (shape == "deep")
+			Deep(root);
+		else if (shape == "huge")
+			Huge(root);
+		else if (shape == "wide")
+			Wide(root);
+		else if (shape == "mix")
+			Mix(root, 0);
+		else
+			throw std::runtime_error("Unknown tree shape " + shape);
+	}
+
+private:
+	size_t Scaled(size_t count) const noexcept
+	{ return std::max<size_t>(1, static_cast<size_t>(count * m_scale)); }
+
+	size_t Uniform(size_t lo, size_t hi)
+	{ return std::uniform_int_distribution<size_t>(lo, hi)(m_rng); }
+
+	/* names stay below AUFS_NAME_MAXLEN so mkfs never truncates them
+	 * into collisions; the hex suffix keeps them unique per directory */
+	std::string Name(size_t idx)
+	{
+		static char const alphabet[] =
+			"abcdefghijklmnopqrstuvwxyz0123456789_";
+
+		std::ostringstream name;
+		size_t const len = Uniform(1, 12);
+		for (size_t i = 0; i != len; ++i)
+			name << alphabet[Uniform(0, sizeof(alphabet) - 2)];
+		name << '-' << std::hex << idx;
+
+		return name.str();
+	}
+
+	void MakeDir(std::string const &path)
+	{
+		if (mkdir(path.c_str(), 0755))
+			throw std::runtime_error("cannot create dir " + path);
+		++m_stats.m_dirs;
+	}
+
+	void MakeFile(std::string const &path, size_t size)
+	{
+		std::ofstream out(path, std::ios::binary);
+		std::vector<uint64_t> chunk(8192);
+
+		while (size) {
+			size_t const bytes = std::min(size,
+					chunk.size() * sizeof(uint64_t));
+			for (uint64_t &word : chunk)
+				word = m_rng();
+			out.write(reinterpret_cast<char const *>(chunk.data()),
+					bytes);
+			size -= bytes;
+			m_stats.m_bytes += bytes;
+		}
+
+		if (!out)
+			throw std::runtime_error("cannot write file " + path);
+		++m_stats.m_files;
+	}
+
+	void Tiny(std::string const &root)
+	{
+		size_t const files = Scaled(6000);
+		size_t const per_dir = 100;
+
+		std::string dir;
+		for (size_t i = 0; i != files; ++i) {
+			if (i % per_dir == 0) {
+				dir = root + "/" + Name(i / per_dir);
+				MakeDir(dir);
+			}
+			MakeFile(dir + "/" + Name(i), Uniform(0, 512));
+		}
+	}
+
+	void Deep(std::string const &root)
+	{
+		size_t const depth = std::min<size_t>(Scaled(200), 250);
+
+		std::string dir = root;
+		for (size_t i = 0; i != depth; ++i) {
+			MakeFile(dir + "/" + Name(0), Uniform(0, 4096));
+			MakeFile(dir + "/" + Name(1), Uniform(0, 4096));
+			dir += "/" + Name(2);
+			MakeDir(dir);
+		}
+	}
+
+	void Huge(std::string const &root)
+	{
+		size_t const files = 3;
+		size_t const size = Scaled(30u << 20);
+
+		for (size_t i = 0; i != files; ++i)
+			MakeFile(root + "/" + Name(i), size - Uniform(0, 4096));
+	}
+
+	void Wide(std::string const &root)
+	{
+		size_t const files = Scaled(7000);
+
+		for (size_t i = 0; i != files; ++i)
+			MakeFile(root + "/" + Name(i), Uniform(0, 256));
+	}
+
+	void Mix(std::string const &dir, size_t depth)
+	{
+		size_t const files = Uniform(0, Scaled(60));
+		size_t const dirs = depth < 4 ? Uniform(1, 5) : 0;
+
+		for (size_t i = 0; i != files; ++i) {
+			/* log-uniform sizes from empty up to 1MB */
+			size_t const bits = Uniform(0, 20);
+			size_t const size = bits ? Uniform(1ul << (bits - 1),
+						(1ul << bits) - 1) : 0;
+
+			MakeFile(dir + "/" + Name(i), size);
+		}
+
+		for (size_t i = 0; i != dirs; ++i) {
+			std::string const child = dir + "/" + Name(files + i);
+
+			MakeDir(child);
+			Mix(child, depth + 1);
+		}
+	}
+
+	std::mt19937_64	m_rng;
+	double		m_scale;
+	TreeStats	m_stats;
+};
+
+struct RunResult {
+	int		m_status = -1;
+	double		m_seconds = 0.0;
+	long		m_peak_rss_kb = 0;
+};
+
+RunResult RunMkfs(std::string const &mkfs, std::string const &tree,
+			std::string const &image, uint32_t block_size)
+{
+	std::string const size = std::to_string(block_size);
+	RunResult result;
+
+	auto const start = std::chrono::steady_clock::now();
+	pid_t const pid = fork();
+	if (pid < 0)
+		throw std::runtime_error("cannot fork");
+
+	if (pid == 0) {
+		int const null = open("/dev/null", O_WRONLY);
+		if (null >= 0)
+			dup2(null, STDOUT_FILENO);
+		execl(mkfs.c_str(), mkfs.c_str(), "-s", size.c_str(),
+			"-d", tree.c_str(), image.c_str(), (char *)nullptr);
+		_exit(127);
+	}
+
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid)
+		throw std::runtime_error("cannot wait for mkfs");
+	auto const finish = std::chrono::steady_clock::now();
+
+	result.m_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	result.m_seconds =
+		std::chrono::duration<double>(finish - start).count();
+	result.m_peak_rss_kb = usage.ru_maxrss;
+
+	return result;
+}
+
+void CreateImage(std::string const &image, uint32_t block_size)
+{
+	off_t const size = static_cast<off_t>(block_size) * block_size * 8;
+	int const fd = open(image.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+
+	if (fd < 0)
+		throw std::runtime_error("cannot create image " + image);
+
+	int const ret = ftruncate(fd, size);
+	close(fd);
+	if (ret)
+		throw std::runtime_error("cannot resize image " + image);
+}
+
+uint64_t UsedBytes(std::string const &image, uint32_t block_size)
+{
+	ConfigurationConstPtr const config = std::make_shared<Configuration>(
+				image, "", block_size * 8, block_size);
+	BlocksCache cache(config);
+	BlockPtr const map = cache.GetBlock(1);
+
+	BitIterator const b(map->Data(), 0);
+	BitIterator const e(map->Data() + map->Size(), 0);
+
+	return static_cast<uint64_t>(std::count(b, e, false)) * block_size;
+}
+
+int RemoveEntry(char const *path, struct stat const *, int, struct FTW *)
+{ return remove(path); }
+
+void RemoveTree(std::string const &root)
+{ nftw(root.c_str(), &RemoveEntry, 64, FTW_DEPTH | FTW_PHYS); }
+
+void Bench(std::string const &shape, uint64_t seed, double scale,
+			uint32_t block_size, std::string const &mkfs,
+			std::string const &workdir, bool keep)
+{
+	std::string const tree = workdir + "/tree-" + shape;
+	std::string const image = workdir + "/image-" + shape;
+
+	TreeGenerator gen(seed, scale);
+	gen.Generate(shape, tree);
+	CreateImage(image, block_size);
+
+	RunResult const run = RunMkfs(mkfs, tree, image, block_size);
+	TreeStats const &stats = gen.Stats();
+	uint64_t const used = run.m_status == 0 ?
+				UsedBytes(image, block_size) : 0;
+	double const seconds = std::max(run.m_seconds, 1e-9);
+
+	std::cout << "{\"bench\":\"mkfs\""
+		<< ",\"shape\":\"" << shape << "\""
+		<< ",\"seed\":" << seed
+		<< ",\"scale\":" << scale
+		<< ",\"block_size\":" << block_size
+		<< ",\"status\":" << run.m_status
+		<< ",\"files\":" << stats.m_files
+		<< ",\"dirs\":" << stats.m_dirs
+		<< ",\"bytes\":" << stats.m_bytes
+		<< ",\"seconds\":" << run.m_seconds
+		<< ",\"files_per_s\":" << (stats.m_files + stats.m_dirs) / seconds
+		<< ",\"mb_per_s\":" << stats.m_bytes / seconds / 1048576.0
+		<< ",\"image_bytes\":"
+			<< static_cast<uint64_t>(block_size) * block_size * 8
+		<< ",\"used_bytes\":" << used
+		<< ",\"peak_rss_kb\":" << run.m_peak_rss_kb
+		<< "}" << std::endl;
+
+	if (!keep) {
+		RemoveTree(tree);
+		unlink(image.c_str());
+	}
+}
+
+void PrintHelp()
+{
+	std::cout << "Usage:" << std::endl
+		<< "\taufs-mkfs-bench [(--shape | -t) SHAPE] [(--seed | -r) SEED] [(--scale | -x) SCALE]"
+		<< std::endl
+		<< "\t\t[(--block_size | -s) SIZE] [(--mkfs | -m) MKFS] [(--workdir | -w) DIR] [(--keep | -k)]"
+		<< std::endl << std::endl
+		<< "Where:" << std::endl
+		<< "\tSHAPE   - tiny, deep, huge, wide, mix or all. Default is all." << std::endl
+		<< "\tSEED    - random seed of the tree generator. Default is 1." << std::endl
+		<< "\tSCALE   - multiplier for file counts and sizes. Default is 1." << std::endl
+		<< "\tSIZE    - block size. Default is 4096 bytes." << std::endl
+		<< "\tMKFS    - mkfs binary to benchmark. Default is ./mkfs.aufs." << std::endl
+		<< "\tDIR     - where trees and images are created. Default is /tmp." << std::endl
+		<< "\t--keep  - do not remove generated trees and images." << std::endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	std::string shape = "all", mkfs = "./mkfs.aufs", workdir = "/tmp";
+	uint64_t seed = 1;
+	double scale = 1.0;
+	uint32_t block_size = 4096u;
+	bool keep = false;
+
+	--argc;
+	++argv;
+	while (argc--) {
+		std::string const arg(*argv++);
+		if ((arg == "--shape" || arg == "-t") && argc) {
+			shape = *argv++;
+			--argc;
+		} else if ((arg == "--seed" || arg == "-r") && argc) {
+			seed = std::stoull(*argv++);
+			--argc;
+		} else if ((arg == "--scale" || arg == "-x") && argc) {
+			scale = std::stod(*argv++);
+			--argc;
+		} else if ((arg == "--block_size" || arg == "-s") && argc) {
+			block_size = std::stoi(*argv++);
+			--argc;
+		} else if ((arg == "--mkfs" || arg == "-m") && argc) {
+			mkfs = *argv++;
+			--argc;
+		} else if ((arg == "--workdir" || arg == "-w") && argc) {
+			workdir = *argv++;
+			--argc;
+		} else if (arg == "--keep" || arg == "-k") {
+			keep = true;
+		} else {
+			PrintHelp();
+			return arg == "--help" || arg == "-h" ? 0 : 1;
+		}
+	}
+
+	try {
+		if (block_size != 512u && block_size != 1024u &&
+				block_size != 2048u && block_size != 4096u)
+			throw std::runtime_error("Unsupported block size");
+
+		std::string dir = workdir + "/aufs-mkfs-bench-XXXXXX";
+		if (!mkdtemp(&dir[0]))
+			throw std::runtime_error("cannot create " + dir);
+
+		std::vector<std::string> shapes;
+		if (shape == "all")
+			shapes = { "tiny", "deep", "huge", "wide", "mix" };
+		else
+			shapes = { shape };
+
+		for (std::string const &s : shapes)
+			Bench(s, seed, scale, block_size, mkfs, dir, keep);
+
+		if (!keep)
+			rmdir(dir.c_str());
+
+		return 0;
+	} catch (std::exception const & e) {
+		std::cout << "ERROR: " << e.what() << std::endl;
+		PrintHelp();
+	}
+
+	return 1;
+}
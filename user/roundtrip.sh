@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Formats a generated tree with several mkfs.aufs option sets and checks
+# that every image reads back the same:
+#
+#	roundtrip.sh
+#
+# Every image must pass fsck.aufs and unpack with aufs-extract to the
+# source tree. The option sets include --max_run, which splits the larger
+# files over several discontiguous runs, so the extent list paths are
+# taken. When running as root with aufs.ko loaded, every image is also
+# mounted, with "verify" if it has checksums, and compared again.
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+MNT=$WORK/mnt
+trap 'umount "$MNT" 2>/dev/null || true; rm -rf "$WORK"' EXIT
+
+fail()
+{
+	echo "ERROR: $*" >&2
+	exit 1
+}
+
+KERNEL=
+if [ "$(id -u)" -eq 0 ] && grep -qw aufs /proc/filesystems; then
+	KERNEL=1
+else
+	echo "kernel module is not available, checking the tools only" >&2
+fi
+
+# sizes around block and folio boundaries, and files larger than any
+# --max_run below
+tree=$WORK/tree
+mkdir -p "$tree/dir/sub" "$tree/empty" "$MNT"
+: > "$tree/zero"
+for size in 1 4095 4096 4097 65536 200000 1048577; do
+	head -c $size /dev/urandom > "$tree/dir/f$size"
+done
+for i in $(seq 1 100); do
+	echo "small $i" > "$tree/dir/sub/s$i"
+done
+
+roundtrip()
+{
+	name=$1
+	shift
+	image=$WORK/image
+	out=$WORK/out
+
+	rm -rf "$image" "$out"
+	truncate -s 64M "$image"
+	"$HERE/mkfs.aufs" "$@" -d "$tree" "$image" > /dev/null ||
+		fail "$name: mkfs.aufs failed"
+	"$HERE/fsck.aufs" "$image" > "$WORK/fsck.log" || {
+		cat "$WORK/fsck.log" >&2
+		fail "$name: fsck.aufs found problems"
+	}
+	"$HERE/aufs-extract" "$image" "$out" > /dev/null ||
+		fail "$name: aufs-extract failed"
+	diff -r "$tree" "$out" >&2 ||
+		fail "$name: the extracted tree differs"
+
+	if [ -n "$KERNEL" ]; then
+		opts=loop,ro
+		case " $* " in
+		*" -c "*) opts=$opts,verify ;;
+		esac
+		mount -t aufs -o "$opts" "$image" "$MNT" ||
+			fail "$name: cannot mount"
+		diff -r "$tree" "$MNT" >&2 ||
+			fail "$name: the mounted tree differs"
+		umount "$MNT"
+	fi
+	echo "$name: ok" >&2
+}
+
+roundtrip plain
+roundtrip extents -e
+roundtrip split -r 3
+roundtrip split-1k -s 1024 -r 9
+roundtrip split-checksums -r 3 -c
+roundtrip split-compact -r 7 -c -i